@@ -17,11 +17,23 @@
  */
 
 #include "hawkbit.h"
+#include "hawkbit_ddi.h"
+#include "hawkbit_trace.h"
 #include <iomanip>
 #include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include "esp_idf_version.h"
+#include "freertos/task.h"
+#if __has_include("sdkconfig.h")
+#include "sdkconfig.h"
+#endif
 
 static const char* TAG = "hawkbit";
 
+// download summaries kept for reportComplete()
+#define MAX_REPORTED_DOWNLOADS 8
+
 esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 {
     static char *output_buffer;  // Buffer to store response of http request from event handler
@@ -32,6 +44,7 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
             break;
         case HTTP_EVENT_ON_CONNECTED:
             ESP_LOGD(TAG, "HTTP_EVENT_ON_CONNECTED");
+            HAWKBIT_TRACE(CONNECT, 0, 0);
             break;
         case HTTP_EVENT_HEADER_SENT:
             ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
@@ -51,8 +64,16 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
             if (!esp_http_client_is_chunked_response(evt->client)) {
                 // If user_data buffer is configured, copy the response into the buffer
                 if (evt->user_data) {
+                    if (output_len + evt->data_len >= MAX_HTTP_OUTPUT_BUFFER) {
+                        ESP_LOGE(TAG, "Response exceeds MAX_HTTP_OUTPUT_BUFFER");
+                        return ESP_FAIL;
+                    }
                     memcpy((uint8_t*)evt->user_data + output_len, evt->data, evt->data_len);
+                    ((char*)evt->user_data)[output_len + evt->data_len] = '\0';
                 } else {
+#if HAWKBIT_PREALLOCATE
+                    break;
+#else
                     if (output_buffer == NULL) {
                         output_buffer = (char *) malloc(esp_http_client_get_content_length(evt->client));
                         output_len = 0;
@@ -62,6 +83,7 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
                         }
                     }
                     memcpy(output_buffer + output_len, evt->data, evt->data_len);
+#endif
                 }
                 output_len += evt->data_len;
             }
@@ -96,13 +118,17 @@ esp_err_t _http_event_handler(esp_http_client_event_t *evt)
 }
 
 HawkbitClient::HawkbitClient(
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
     JsonDocument& doc,
+#endif
     const std::string& baseUrl,
     const std::string& tenantName,
     const std::string& controllerId,
     const std::string &securityToken,
     char *server_cert_pem_start) :
-    _doc(doc),
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+    _json(doc),
+#endif
     _baseUrl(baseUrl),
     _tenantName(tenantName),
     _controllerId(controllerId),
@@ -113,309 +139,836 @@ HawkbitClient::HawkbitClient(
     _http_config.user_data = resultPayload;        // Pass address of local buffer to get response
     _http_config.disable_auto_redirect = false;
     _http_config.cert_pem = server_cert_pem_start;
+
+}
+
+HawkbitClient::~HawkbitClient()
+{
+#if HAWKBIT_PREALLOCATE
+    if (this->_http != NULL) {
+        esp_http_client_cleanup(this->_http);
+    }
+#endif
+}
+
+void HawkbitClient::tlsVersion(TlsVersion version)
+{
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+    switch (version) {
+        case TLS_1_2:
+            this->_http_config.tls_version = ESP_HTTP_CLIENT_TLS_VER_TLS_1_2;
+            break;
+        case TLS_1_3:
+            this->_http_config.tls_version = ESP_HTTP_CLIENT_TLS_VER_TLS_1_3;
+            break;
+        default:
+            this->_http_config.tls_version = ESP_HTTP_CLIENT_TLS_VER_ANY;
+            break;
+    }
+#else
+    if (version != TLS_ANY) {
+        ESP_LOGW(TAG, "tlsVersion: not supported by this ESP-IDF version, negotiating");
+    }
+#endif
+}
+
+#ifndef CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN
+#define CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN 0
+#endif
+#ifndef CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#define CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN 0
+#endif
+
+static const char* enabled(bool option)
+{
+    return option ? "yes" : "no";
+}
+
+void HawkbitClient::logTlsConfig()
+{
+#ifdef CONFIG_MBEDTLS_HARDWARE_AES
+    const bool hardwareAes = true;
+#else
+    const bool hardwareAes = false;
+#endif
+#ifdef CONFIG_MBEDTLS_HARDWARE_SHA
+    const bool hardwareSha = true;
+#else
+    const bool hardwareSha = false;
+#endif
+#ifdef CONFIG_MBEDTLS_HARDWARE_MPI
+    const bool hardwareMpi = true;
+#else
+    const bool hardwareMpi = false;
+#endif
+#ifdef CONFIG_MBEDTLS_GCM_C
+    const bool gcm = true;
+#else
+    const bool gcm = false;
+#endif
+#ifdef CONFIG_MBEDTLS_CHACHAPOLY_C
+    const bool chachapoly = true;
+#else
+    const bool chachapoly = false;
+#endif
+#ifdef CONFIG_MBEDTLS_DYNAMIC_BUFFER
+    const bool dynamicBuffer = true;
+#else
+    const bool dynamicBuffer = false;
+#endif
+#ifdef CONFIG_MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+    const bool maxFragmentLength = true;
+#else
+    const bool maxFragmentLength = false;
+#endif
+#ifdef CONFIG_MBEDTLS_SSL_PROTO_TLS1_3
+    const bool tls13 = true;
+#else
+    const bool tls13 = false;
+#endif
+
+    // AES-GCM only pays off with hardware AES, ChaCha20-Poly1305 is faster in software
+    ESP_LOGI(TAG, "TLS: hardware AES %s, SHA %s, MPI %s", enabled(hardwareAes), enabled(hardwareSha), enabled(hardwareMpi));
+    ESP_LOGI(TAG, "TLS: AES-GCM %s, ChaCha20-Poly1305 %s, TLS 1.3 %s", enabled(gcm), enabled(chachapoly), enabled(tls13));
+    ESP_LOGI(TAG, "TLS: record buffers in %d / out %d bytes, dynamic %s, max fragment length %s",
+        CONFIG_MBEDTLS_SSL_IN_CONTENT_LEN, CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN, enabled(dynamicBuffer), enabled(maxFragmentLength));
 }
 
 esp_http_client_handle_t HawkbitClient::initHttpHandle(esp_http_client_method_t method, const std::string &url) {
-    esp_http_client_handle_t _http = esp_http_client_init(&_http_config);
-    esp_http_client_set_url(_http, url.c_str());
+    return initHttpHandle(method, url.c_str(), _http_config);
+}
+
+esp_http_client_handle_t HawkbitClient::initHttpHandle(esp_http_client_method_t method, const char* url, const esp_http_client_config_t& config) {
+#if HAWKBIT_PREALLOCATE
+    if (this->_http == NULL) {
+        // created on first use, so settings made after construction apply
+        esp_http_client_config_t shared = _http_config;
+        if (this->_throughputProfile) {
+            // the receive buffer can't grow later, size it for downloads
+            shared.buffer_size = std::max(shared.buffer_size, HAWKBIT_THROUGHPUT_HTTP_BUFFER);
+        }
+        this->_http = esp_http_client_init(&shared);
+        // accepted by every endpoint including artifact downloads, so headers never change
+        esp_http_client_set_header(this->_http, "Accept", "application/hal+json, application/octet-stream");
+        esp_http_client_set_header(this->_http, "Content-Type", "application/json");
+        esp_http_client_set_header(this->_http, "Authorization", this->_authToken.c_str());
+    }
+    esp_http_client_handle_t _http = this->_http;
+    esp_http_client_set_user_data(_http, config.user_data);
+    esp_http_client_set_post_field(_http, NULL, 0);
+    esp_http_client_set_url(_http, url);
+    esp_http_client_set_method(_http, method);
+#else
+    esp_http_client_handle_t _http = esp_http_client_init(&config);
+    esp_http_client_set_url(_http, url);
     esp_http_client_set_method(_http, method);
     esp_http_client_set_header(_http, "Accept", "application/hal+json");
     esp_http_client_set_header(_http, "Content-Type", "application/json");
     esp_http_client_set_header(_http, "Authorization", this->_authToken.c_str());
+#endif
 
     return _http;
 }
 
-UpdateResult HawkbitClient::updateRegistration(const Registration& registration, const std::map<std::string,std::string>& data, MergeMode mergeMode, std::initializer_list<std::string> details)
+void HawkbitClient::releaseHttpHandle(esp_http_client_handle_t handle)
+{
+#if !HAWKBIT_PREALLOCATE
+    esp_http_client_cleanup(handle);
+#endif
+}
+
+esp_http_client_config_t HawkbitClient::streamingConfig() const
 {
-    _doc.clear();
+    // responses are read through the transport, not collected in resultPayload
+    esp_http_client_config_t config = _http_config;
+    config.event_handler = NULL;
+    config.user_data = NULL;
+    return config;
+}
 
-    switch(mergeMode) {
-        case MERGE:
-            _doc["mode"] = "merge";
-            break;
-        case REPLACE:
-            _doc["mode"] = "replace";
-            break;
-        case REMOVE:
-            _doc["mode"] = "remove";
-            break;
+esp_err_t HawkbitClient::openRequest(const char* name, esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen)
+{
+    esp_err_t err = this->_transport->open(http, method, url, writeLen);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s HTTP request failed: %s", name, esp_err_to_name(err));
+        return err;
     }
+#if HAWKBIT_PREALLOCATE
+    // the shared handle keeps its event handler, which records the connect
+#else
+    HAWKBIT_TRACE(CONNECT, 0, 0);
+#endif
+    return ESP_OK;
+}
 
-    _doc.createNestedObject("data");
-    for (const std::pair<std::string,std::string> entry : data) {
-        _doc["data"][std::string(entry.first)] = entry.second;
-    }
+static bool isRedirect(int code)
+{
+    // 308 Permanent Redirect has no constant in older esp_http_client versions
+    return code == HttpStatus_MovedPermanently || code == HttpStatus_Found ||
+        code == HttpStatus_TemporaryRedirect || code == 308;
+}
 
-    JsonArray d = _doc["status"].createNestedArray("details");
-    for (auto detail : details) {
-        d.add(detail);
-    }
+esp_err_t HawkbitClient::fetchResponse(const char* name, esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, const char* body, size_t len, int& code)
+{
+    code = 0;
+    for (int redirects = 0; ; redirects++) {
+        esp_err_t err = openRequest(name, http, method, url, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (len > 0 && this->_transport->write(http, body, len) != (int) len) {
+            ESP_LOGE(TAG, "%s: sending the request body failed", name);
+            this->_transport->close(http);
+            return ESP_FAIL;
+        }
 
-    _doc["status"]["execution"] = "closed";
-    _doc["status"]["result"]["finished"] = "success";
-    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_PUT, registration.url());
+        int64_t contentLength = this->_transport->fetchHeaders(http);
+        code = this->_transport->status(http);
+        ESP_LOGI(TAG, "%s HTTP Status = %d, content_length = %lld", name, code, contentLength);
+        HAWKBIT_TRACE(STATUS, 0, code);
+        if (!isRedirect(code) || this->_http_config.disable_auto_redirect) {
+            return ESP_OK;
+        }
+        if (redirects == HAWKBIT_MAX_REDIRECTS) {
+            ESP_LOGE(TAG, "%s: more than %d redirects", name, HAWKBIT_MAX_REDIRECTS);
+            return ESP_OK;
+        }
 
-    std::string buffer;
-    size_t len = serializeJson(_doc, buffer);
-    (void)len; // ignore unused
+        // what esp_http_client_perform() does: take the URL from the
+        // Location header and send the request again
+        this->_transport->close(http);
+        err = esp_http_client_set_redirection(http);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: redirect without a usable Location", name);
+            return err;
+        }
+    }
+}
 
-    ESP_LOGI(TAG,"JSON - len: %d", len);
-    esp_http_client_set_post_field(_http, buffer.data(), len);
-    esp_err_t err = esp_http_client_perform(_http);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "updateRegistration HTTP Status = %d, content_length = %d",
-                esp_http_client_get_status_code(_http),
-                esp_http_client_get_content_length(_http));
+int HawkbitClient::sendRequest(const char* name, esp_http_client_method_t method, const char* url, const char* body, size_t len)
+{
+    esp_http_client_handle_t _http = initHttpHandle(method, url, streamingConfig());
 
-        ESP_LOGI(TAG,"Result - payload: %s", this->resultPayload);
+    int code = 0;
+    if (fetchResponse(name, _http, method, url, body, len, code) == ESP_OK) {
+        // keep what fits of the response for the log
+        int total = 0;
+        int n;
+        while (total < (int) sizeof(resultPayload) - 1 &&
+            (n = this->_transport->read(_http, resultPayload + total, sizeof(resultPayload) - 1 - total)) > 0) {
+            total += n;
+        }
+        resultPayload[total] = '\0';
+        ESP_LOGD(TAG,"Result - payload: %s", resultPayload);
+        this->_transport->close(_http);
     } else {
-        ESP_LOGE(TAG, "updateRegistration HTTP request failed: %s", esp_err_to_name(err));
+        code = 0;
     }
-    int code = esp_http_client_get_status_code(_http);
-    ESP_LOGD(TAG,"Result - code: %d", code);
 
-    esp_http_client_cleanup(_http);
+    releaseHttpHandle(_http);
+    return code;
+}
 
-    return UpdateResult(code);
+const char* HawkbitClient::mergeModeName(MergeMode mergeMode)
+{
+    switch(mergeMode) {
+        case MERGE:
+            return "merge";
+        case REMOVE:
+            return "remove";
+        case REPLACE:
+        default:
+            return "replace";
+    }
 }
 
-State HawkbitClient::readState()
+UpdateResult HawkbitClient::updateRegistration(const Registration& registration, const std::map<std::string,std::string>& data, MergeMode mergeMode, std::initializer_list<std::string> details)
 {
-    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_GET, (this->_baseUrl + "/" + this->_tenantName + "/controller/v1/" + this->_controllerId));
+    const char* mode = mergeModeName(mergeMode);
 
-    _doc.clear();
+#if HAWKBIT_PREALLOCATE
+    size_t len = _json.registration(requestPayload, sizeof(requestPayload), mode, data, details);
+    const char* body = requestPayload;
+#else
+    size_t len = _json.registration(requestPayload, mode, data, details);
+    const char* body = requestPayload.c_str();
+#endif
+    if (len == 0) {
+        ESP_LOGE(TAG, "updateRegistration: failed to serialize the request body");
+        return UpdateResult(0);
+    }
 
-    esp_err_t err = esp_http_client_perform(_http);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "readState HTTP Status = %d, content_length = %d",
-                esp_http_client_get_status_code(_http),
-                esp_http_client_get_content_length(_http));
-
-            int code = esp_http_client_get_status_code(_http);
-            ESP_LOGD(TAG,"Result - code: %d", code);
-
-            ESP_LOGD(TAG,"Result - payload: %s", this->resultPayload);
-            if ( code == HttpStatus_Ok ) {
-                DeserializationError error = deserializeJson(_doc, resultPayload);
-                if (error) {
-                    ESP_LOGE(TAG, "readState: DeserializationError %s", error.c_str());
-                    esp_http_client_cleanup(_http);
-                    return State();
+    HAWKBIT_TRACE_BEGIN(REQUEST, HawkbitTrace::REGISTRATION, len);
+    ESP_LOGI(TAG,"JSON - len: %d", len);
+    int code = sendRequest("updateRegistration", HTTP_METHOD_PUT, registration.url().c_str(), body, len);
+    ESP_LOGD(TAG,"Result - code: %d", code);
+    HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::REGISTRATION, code);
+
+    return UpdateResult(code);
+}
+
+/**
+ * Writes a request body with chunked transfer encoding. Small pieces are
+ * collected in the buffer and sent as one chunk once it is full.
+ */
+class ChunkedBody {
+    public:
+        ChunkedBody(HawkbitTransport& transport, esp_http_client_handle_t http, char* buffer, size_t size) :
+            _transport(transport),
+            _http(http),
+            _buffer(buffer),
+            _size(size)
+        {
+        }
+
+        bool write(const char* data, size_t len)
+        {
+            while (len > 0) {
+                if (this->_fill == this->_size && !flush()) {
+                    return false;
                 }
-            } else {
-                    ESP_LOGE(TAG, "readState: not succesful with %d", esp_http_client_get_status_code(_http));
-                    esp_http_client_cleanup(_http);
-                    return State();
-            }
-            esp_http_client_cleanup(_http);
-
-            std::string tmp = _doc["config"]["polling"]["sleep"];
-            if (!tmp.empty()) {
-                struct std::tm tm;
-                std::istringstream ss(tmp);
-                ss >> std::get_time(&tm, "%H:%M:%S");
-                this->pollingTime = tm.tm_hour*60*60 + tm.tm_min*60 + tm.tm_sec;
-                ESP_LOGI(TAG, "Received polling time: %s --> sleep %d seconds", tmp.c_str(), this->pollingTime);
+                size_t n = std::min(len, this->_size - this->_fill);
+                memcpy(this->_buffer + this->_fill, data, n);
+                this->_fill += n;
+                data += n;
+                len -= n;
             }
+            return true;
+        }
 
-            std::string href = _doc["_links"]["deploymentBase"]["href"] | "";
-            if (!href.empty()) {
-                ESP_LOGI(TAG,"Fetching deployment: %s", href.c_str());
-                return State(this->readDeployment(href));
-            }
+        bool write(const char* text)
+        {
+            return write(text, strlen(text));
+        }
 
-            href = _doc["_links"]["configData"]["href"] | "";
-            if (!href.empty()) {
-                ESP_LOGI(TAG,"Need to register %s", href.c_str());
-                return State(Registration(href));
+        // value as a quoted JSON string
+        bool string(const std::string& value)
+        {
+            bool ok = write("\"", 1);
+            for (char c : value) {
+                char escaped[7] = { '\\', c, '\0' };
+                if (c == '"' || c == '\\') {
+                    ok = ok && write(escaped, 2);
+                } else if ((uint8_t) c < 0x20) {
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    ok = ok && write(escaped, 6);
+                } else {
+                    ok = ok && write(&c, 1);
+                }
             }
+            return ok && write("\"", 1);
+        }
 
-            href = _doc["_links"]["cancelAction"]["href"] | "";
-            if (!href.empty()) {
-                ESP_LOGI(TAG,"Fetching cancel action: %s", href.c_str());
-                return State(this->readCancel(href));
+        // send what is buffered and the terminating chunk
+        bool finish()
+        {
+            return flush() && this->_transport.write(this->_http, "0\r\n\r\n", 5) == 5;
+        }
+
+    private:
+        HawkbitTransport& _transport;
+        esp_http_client_handle_t _http;
+        char* _buffer;
+        size_t _size;
+        size_t _fill = 0;
+
+        bool flush()
+        {
+            if (this->_fill == 0) {
+                return true;
             }
+            char header[12];
+            int len = snprintf(header, sizeof(header), "%x\r\n", this->_fill);
+            bool ok = this->_transport.write(this->_http, header, len) == len &&
+                this->_transport.write(this->_http, this->_buffer, this->_fill) == (int) this->_fill &&
+                this->_transport.write(this->_http, "\r\n", 2) == 2;
+            this->_fill = 0;
+            return ok;
+        }
+};
+
+void HawkbitClient::attribute(const std::string& name, AttributeProvider provider)
+{
+    for (auto& attribute : this->_attributes) {
+        if (attribute.first == name) {
+            attribute.second = provider;
+            return;
+        }
+    }
+    this->_attributes.push_back(std::make_pair(name, provider));
+}
+
+UpdateResult HawkbitClient::updateRegistration(const Registration& registration, MergeMode mergeMode, std::initializer_list<std::string> details)
+{
+    HAWKBIT_TRACE_BEGIN(REQUEST, HawkbitTrace::REGISTRATION, 0);
+    const char* url = registration.url().c_str();
+    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_PUT, url, streamingConfig());
+
+    // a negative length makes the client announce a chunked body
+    esp_err_t err = openRequest("updateRegistration", _http, HTTP_METHOD_PUT, url, -1);
+    esp_http_client_delete_header(_http, "Transfer-Encoding");
+    if (err != ESP_OK) {
+        releaseHttpHandle(_http);
+        HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::REGISTRATION, 0);
+        return UpdateResult(0);
+    }
+
+    // the response buffer is free while the body is sent
+    ChunkedBody body(*this->_transport, _http, this->resultPayload, sizeof(this->resultPayload));
+    bool ok = body.write("{\"mode\":") && body.string(mergeModeName(mergeMode)) && body.write(",\"data\":{");
+    bool first = true;
+    for (const auto& attribute : this->_attributes) {
+        ok = ok && (first || body.write(",")) && body.string(attribute.first) && body.write(":") && body.string(attribute.second());
+        first = false;
+    }
+    ok = ok && body.write("},\"status\":{\"execution\":\"closed\",\"result\":{\"finished\":\"success\"},\"details\":[");
+    first = true;
+    for (const std::string& detail : details) {
+        ok = ok && (first || body.write(",")) && body.string(detail);
+        first = false;
+    }
+    ok = ok && body.write("]}}") && body.finish();
+
+    int code = 0;
+    if (ok) {
+        int64_t contentLength = this->_transport->fetchHeaders(_http);
+        code = this->_transport->status(_http);
+        ESP_LOGI(TAG, "updateRegistration HTTP Status = %d, content_length = %lld", code, contentLength);
     } else {
-        esp_http_client_cleanup(_http);
-        ESP_LOGE(TAG, "readState HTTP request failed: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "updateRegistration: sending the attributes failed");
     }
 
-    ESP_LOGD(TAG,"No update");
-    return State();
+    this->_transport->close(_http);
+    releaseHttpHandle(_http);
+    HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::REGISTRATION, code);
+
+    return UpdateResult(code);
 }
 
-std::map<std::string,std::string> toMap(const JsonObject& obj) {
-    std::map<std::string,std::string> result;
-    for (const JsonPair& p: obj) {
-        if (p.value().is<const char*>()) {
-            result[std::string(p.key().c_str())] = std::string(p.value().as<const char*>());
+bool HawkbitClient::readDocument(const char* name, const char* url, DdiParser& parser)
+{
+    if (url == NULL) {
+        ESP_LOGE(TAG, "%s: URL exceeds MAX_HTTP_URL_LENGTH", name);
+        return false;
+    }
+
+    // the response is parsed while it is received, not collected in resultPayload
+    HAWKBIT_TRACE_BEGIN(REQUEST, parser.document(), 0);
+    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_GET, url, streamingConfig());
+
+    int code;
+    esp_err_t err = fetchResponse(name, _http, HTTP_METHOD_GET, url, NULL, 0, code);
+    if (err != ESP_OK) {
+        releaseHttpHandle(_http);
+        HAWKBIT_TRACE_END(REQUEST, parser.document(), err);
+        return false;
+    }
+
+    bool result = false;
+    if (code == HttpStatus_Ok) {
+        char buffer[MAX_HTTP_RECV_BUFFER];
+        int len;
+        while ((len = this->_transport->read(_http, buffer, sizeof(buffer))) > 0) {
+            if (!parser.feed(buffer, len)) {
+                break;
+            }
+        }
+        result = parser.finish();
+        HAWKBIT_TRACE(PARSE, parser.document(), result);
+        if (!result) {
+            ESP_LOGE(TAG, "%s: DeserializationError %s", name, parser.error());
         }
+    } else {
+        ESP_LOGE(TAG, "%s: not succesful with %d", name, code);
     }
+
+    this->_transport->close(_http);
+    releaseHttpHandle(_http);
+    HAWKBIT_TRACE_END(REQUEST, parser.document(), code);
+
     return result;
 }
 
-std::map<std::string,std::string> toLinks(const JsonObject& obj) {
-    std::map<std::string,std::string> result;
-    for (const JsonPair& p: obj) {
-        const char* key = p.key().c_str();
-        const char* value = p.value()["href"];
-        result[std::string(key)] = std::string(value);
+static std::string linkHref(const std::map<std::string,std::string>& links, const char* name)
+{
+    auto link = links.find(name);
+    return link != links.end() ? link->second : "";
+}
+
+State HawkbitClient::readState()
+{
+    DdiParser parser(DdiParser::CONTROLLER, this->_ddiLimits);
+    if (!readDocument("readState", this->controllerUrl(), parser)) {
+        return State();
     }
-    return result;
+
+    const std::string& tmp = parser.pollingSleep();
+    if (!tmp.empty()) {
+        struct std::tm tm;
+        std::istringstream ss(tmp);
+        ss >> std::get_time(&tm, "%H:%M:%S");
+        this->pollingTime = tm.tm_hour*60*60 + tm.tm_min*60 + tm.tm_sec;
+        ESP_LOGI(TAG, "Received polling time: %s --> sleep %d seconds", tmp.c_str(), this->pollingTime);
+    }
+
+    std::string href = linkHref(parser.links(), "deploymentBase");
+    if (!href.empty()) {
+        ESP_LOGI(TAG,"Fetching deployment: %s", href.c_str());
+        return State(this->readDeployment(href));
+    }
+
+    href = linkHref(parser.links(), "configData");
+    if (!href.empty()) {
+        ESP_LOGI(TAG,"Need to register %s", href.c_str());
+        return State(Registration(href));
+    }
+
+    href = linkHref(parser.links(), "cancelAction");
+    if (!href.empty()) {
+        ESP_LOGI(TAG,"Fetching cancel action: %s", href.c_str());
+        return State(this->readCancel(href));
+    }
+
+    ESP_LOGD(TAG,"No update");
+    return State();
 }
 
-std::list<Artifact> artifacts(const JsonArray& artifacts)
+Deployment HawkbitClient::readDeployment(const std::string& href)
 {
-    std::list<Artifact> result;
+    DdiParser parser(DdiParser::DEPLOYMENT, this->_ddiLimits);
+    if (!readDocument("readDeployment", href.c_str(), parser)) {
+        return Deployment();
+    }
 
-    for (JsonObject o : artifacts) {
-        Artifact artifact (
-            o["filename"],
-            o["size"] | 0,
-            toMap(o["hashes"]),
-            toLinks(o["_links"])
-        );
-        result.push_back(artifact);
+    Deployment deployment = parser.deployment();
+    if (deployment.id() != this->_downloadsDeployment) {
+        // the downloads of an earlier deployment are not reported with this one
+        this->_downloads.clear();
+        this->_downloadsDeployment = deployment.id();
     }
+    return deployment;
+}
 
-    return result;
+Stop HawkbitClient::readCancel(const std::string& href)
+{
+    DdiParser parser(DdiParser::CANCEL, this->_ddiLimits);
+    if (!readDocument("readCancel", href.c_str(), parser)) {
+        return Stop();
+    }
+    return parser.stop();
 }
 
-std::list<Chunk> chunks(const JsonArray& chunks)
+esp_err_t HawkbitClient::openDownload(esp_http_client_handle_t http, const char* url, uint32_t offset, int& code)
 {
-    std::list<Chunk> result;
+    if (offset > 0) {
+        char range[24];
+        snprintf(range, sizeof(range), "bytes=%u-", offset);
+        esp_http_client_set_header(http, "Range", range);
+    }
 
-    for(JsonObject o : chunks)
-    {
-        Chunk chunk(
-            o["part"],
-            o["version"],
-            o["name"],
-            artifacts(o["artifacts"])
-            );
-        result.push_back(chunk);
+    // redirects, e.g. to a CDN, are requested with the same Range header
+    esp_err_t err = fetchResponse("download", http, HTTP_METHOD_GET, url, NULL, 0, code);
+    if (offset > 0) {
+        // the request is sent by now, don't leave the header on the handle
+        esp_http_client_delete_header(http, "Range");
+    }
+    if (err != ESP_OK) {
+        return err;
     }
 
-    return result;
+    if (code != (offset > 0 ? HTTP_PARTIAL_CONTENT : HttpStatus_Ok)) {
+        this->_transport->close(http);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
 }
 
-Deployment HawkbitClient::readDeployment(const std::string& href)
+DownloadResult HawkbitClient::download(const Artifact& artifact, DownloadSink& sink, const std::string& linkType)
 {
-    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_GET, href);
-    
-    _doc.clear();
-    esp_err_t err = esp_http_client_perform(_http);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "readDeployment HTTP Status = %d, content_length = %d",
-            esp_http_client_get_status_code(_http),
-            esp_http_client_get_content_length(_http));
-            int code = esp_http_client_get_status_code(_http);
-            ESP_LOGD(TAG,"Result - code: %d", code);
-            ESP_LOGD(TAG,"Result - payload: %s", this->resultPayload);
-            if ( code == HttpStatus_Ok ) {
-                DeserializationError error = deserializeJson(_doc, resultPayload);
-                if (error) {
-                    //esp_http_client_cleanup(_http);
-                    // FIXME: need a way to handle errors
-                    //throw 1;
-                }
+    return download(artifact, sink, linkType, 0);
+}
+
+DownloadResult HawkbitClient::download(const Artifact& artifact, DownloadSink& sink, const std::string& linkType, uint32_t offset)
+{
+    auto href = artifact.links().find(linkType);
+    if (href == artifact.links().end()) {
+        ESP_LOGE(TAG, "download: no '%s' link for %s", linkType.c_str(), artifact.filename().c_str());
+        return DownloadResult(0, ESP_ERR_NOT_FOUND);
+    }
+    if (offset > 0 && offset >= artifact.size()) {
+        return DownloadResult(0, ESP_ERR_INVALID_ARG);
+    }
+
+    // restores the power save profile on every return below
+    ThroughputProfile profile(this->_throughputProfile);
+
+    // the payload is streamed into the sink, not into resultPayload
+    esp_http_client_config_t config = streamingConfig();
+    if (profile.active()) {
+        config.buffer_size = std::max(config.buffer_size, HAWKBIT_THROUGHPUT_HTTP_BUFFER);
+    }
+
+    DownloadStats stats;
+    stats.filename = artifact.filename();
+    int64_t start = this->_clock->now();
+
+    HAWKBIT_TRACE_BEGIN(REQUEST, HawkbitTrace::ARTIFACT, 0);
+    const char* url = href->second.c_str();
+    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_GET, url, config);
+#if !HAWKBIT_PREALLOCATE
+    esp_http_client_set_header(_http, "Accept", "application/octet-stream");
+    esp_http_client_delete_header(_http, "Content-Type");
+#endif
+
+    int code = 0;
+    esp_err_t err = openDownload(_http, url, offset, code);
+    stats.ttfb = (this->_clock->now() - start) / 1000;
+    if (err != ESP_OK) {
+        releaseHttpHandle(_http);
+        HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::ARTIFACT, code);
+        return DownloadResult(code, err, stats);
+    }
+
+    err = sink.begin(artifact);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "download: sink rejected %s: %s", artifact.filename().c_str(), esp_err_to_name(err));
+        this->_transport->close(_http);
+        releaseHttpHandle(_http);
+        HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::ARTIFACT, code);
+        return DownloadResult(code, err, stats);
+    }
+    HAWKBIT_TRACE_BEGIN(DOWNLOAD, 0, artifact.size());
+
+    DownloadAutotuner tuner(this->_autotune);
+    tuner.begin(artifact.size() - offset);
+
+    DownloadPipeline pipeline(sink);
+    err = pipeline.start(tuner.bufferSize(), tuner.maxDepth(), tuner.depth());
+
+    uint32_t received = offset;
+    while (err == ESP_OK && received < artifact.size()) {
+        uint8_t* buffer = pipeline.acquire();
+        int len = this->_transport->read(_http, (char*)buffer, std::min<size_t>(tuner.readSize(), artifact.size() - received));
+        if (len <= 0) {
+            pipeline.release(buffer);
+            if (stats.retries >= this->_downloadRetries) {
+                break;
             }
-    } else {
-        ESP_LOGE(TAG, "readDeployment HTTP request failed: %s", esp_err_to_name(err));
+
+            // continue where the connection broke, the sink can't start over
+            stats.retries++;
+            ESP_LOGW(TAG, "download: connection lost at %u of %u bytes, resuming (%u/%u)",
+                received, artifact.size(), stats.retries, this->_downloadRetries);
+            this->_transport->close(_http);
+            this->_clock->sleep(HAWKBIT_DOWNLOAD_RETRY_DELAY_MS << (stats.retries - 1));
+
+            int resumeCode = 0;
+            if (openDownload(_http, url, received, resumeCode) == ESP_OK) {
+                stats.resumes++;
+            }
+            continue;
+        }
+        HAWKBIT_TRACE(DOWNLOAD_BLOCK, len, received);
+        err = pipeline.submit(buffer, len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "download: write failed at %u: %s", received, esp_err_to_name(err));
+            break;
+        }
+        received += len;
+
+        if (tuner.update(len)) {
+            err = pipeline.resize(tuner.depth());
+        }
+    }
+
+    esp_err_t pipelineErr = pipeline.finish();
+    if (err == ESP_OK) {
+        err = pipelineErr;
     }
+    tuner.end(err == ESP_OK && received == artifact.size());
 
-    esp_http_client_cleanup(_http);
+    if (err == ESP_OK && received != artifact.size()) {
+        ESP_LOGE(TAG, "download: received %u of %u bytes", received, artifact.size());
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    int64_t endStart = this->_clock->now();
+    esp_err_t endErr = sink.end(err == ESP_OK);
+    if (err == ESP_OK) {
+        err = endErr;
+    }
+    HAWKBIT_TRACE_END(DOWNLOAD, 0, err);
 
-    std::string id = _doc["id"];
-    std::string download = _doc["deployment"]["download"];
-    std::string update = _doc["deployment"]["update"];
+    this->_transport->close(_http);
+    releaseHttpHandle(_http);
+    HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::ARTIFACT, code);
 
-    return Deployment(id, download, update, chunks(_doc["deployment"]["chunks"]));
+    stats.bytes = received - offset;
+    stats.flashWrite = (pipeline.writeTime() + this->_clock->now() - endStart) / 1000;
+    stats.duration = (this->_clock->now() - start) / 1000;
+    ESP_LOGI(TAG, "%s", stats.summary().c_str());
+
+    this->_lastDownload = stats;
+    if (this->_downloadTelemetry) {
+        if (this->_downloads.size() >= MAX_REPORTED_DOWNLOADS) {
+            this->_downloads.erase(this->_downloads.begin());
+        }
+        this->_downloads.push_back(stats);
+    }
+
+    return DownloadResult(code, err, stats);
 }
 
-Stop HawkbitClient::readCancel(const std::string& href)
+esp_err_t HawkbitClient::downloadRange(const Artifact& artifact, uint32_t offset, uint8_t* buffer, size_t len, const std::string& linkType)
 {
-    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_GET, href);
+    auto href = artifact.links().find(linkType);
+    if (href == artifact.links().end()) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (len == 0 || offset + len > artifact.size()) {
+        return ESP_ERR_INVALID_ARG;
+    }
 
-    _doc.clear();
+    const char* url = href->second.c_str();
+    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_GET, url, streamingConfig());
+#if !HAWKBIT_PREALLOCATE
+    esp_http_client_set_header(_http, "Accept", "application/octet-stream");
+    esp_http_client_delete_header(_http, "Content-Type");
+#endif
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%u-%u", offset, (unsigned)(offset + len - 1));
+    esp_http_client_set_header(_http, "Range", range);
 
-    esp_err_t err = esp_http_client_perform(_http);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "readCancel HTTP Status = %d, content_length = %d",
-                esp_http_client_get_status_code(_http),
-                esp_http_client_get_content_length(_http));
-        int code = esp_http_client_get_status_code(_http);
-        ESP_LOGD(TAG,"Result - code: %d", code);
-
-        ESP_LOGD(TAG,"Result - payload: %s", this->resultPayload);
-
-        if ( code == HttpStatus_Ok ) {
-            DeserializationError error = deserializeJson(_doc, resultPayload);
-            if (error) {
-                //esp_http_client_cleanup(_http);
-                // FIXME: need a way to handle errors
-                //throw 1;
-            }
+    int code;
+    esp_err_t err = fetchResponse("downloadRange", _http, HTTP_METHOD_GET, url, NULL, 0, code);
+    // the shared handle of HAWKBIT_PREALLOCATE must not keep it
+    esp_http_client_delete_header(_http, "Range");
+    if (err != ESP_OK) {
+        releaseHttpHandle(_http);
+        return err;
+    }
+
+    if (code != HTTP_PARTIAL_CONTENT) {
+        ESP_LOGE(TAG, "downloadRange: HTTP Status = %d", code);
+        err = ESP_FAIL;
+    }
+
+    size_t received = 0;
+    while (err == ESP_OK && received < len) {
+        int n = this->_transport->read(_http, (char*)buffer + received, len - received);
+        if (n <= 0) {
+            err = ESP_ERR_INVALID_SIZE;
+            break;
         }
-    } else {
-        ESP_LOGE(TAG, "readCancel HTTP request failed: %s", esp_err_to_name(err));
+        received += n;
     }
 
-    esp_http_client_cleanup(_http);
+    this->_transport->close(_http);
+    releaseHttpHandle(_http);
+    return err;
+}
+
+void HawkbitClient::downloadAttributes(std::map<std::string,std::string>& data) const
+{
+    const DownloadStats& stats = this->_lastDownload;
+    if (stats.filename.empty()) {
+        return;
+    }
 
-    std::string stopId = _doc["cancelAction"]["stopId"] | "";
-    
-    return Stop(stopId);
+    data["ota.download.bytes"] = std::to_string(stats.bytes);
+    data["ota.download.Bps"] = std::to_string(stats.throughput());
+    data["ota.download.ttfb_ms"] = std::to_string(stats.ttfb);
+    data["ota.download.flash_ms"] = std::to_string(stats.flashWrite);
+    data["ota.download.retries"] = std::to_string(stats.retries);
+    data["ota.download.resumes"] = std::to_string(stats.resumes);
 }
 
-std::string HawkbitClient::feedbackUrl(const Deployment& deployment) const
+std::string DownloadStats::summary() const
 {
-    return this->_baseUrl + "/" + this->_tenantName + "/controller/v1/" + this->_controllerId + "/deploymentBase/" + deployment.id() + "/feedback";
+    char line[160];
+    snprintf(line, sizeof(line), "download %s bytes=%u ms=%u Bps=%u ttfb=%u flash=%u retries=%u resumes=%u",
+        this->filename.c_str(), this->bytes, this->duration, this->throughput(), this->ttfb,
+        this->flashWrite, this->retries, this->resumes);
+    return line;
 }
 
-std::string HawkbitClient::feedbackUrl(const Stop& stop) const
+#if HAWKBIT_PREALLOCATE
+const char* HawkbitClient::controllerUrl()
 {
-    return this->_baseUrl + "/" + this->_tenantName + "/controller/v1/" + this->_controllerId + "/cancelAction/" + stop.id() + "/feedback";
+    int len = snprintf(this->_url, sizeof(this->_url), "%s/%s/controller/v1/%s",
+        this->_baseUrl.c_str(), this->_tenantName.c_str(), this->_controllerId.c_str());
+    return len < (int)sizeof(this->_url) ? this->_url : NULL;
 }
 
-template<typename IdProvider>
-UpdateResult HawkbitClient::sendFeedback(IdProvider id, const std::string& execution, const std::string& finished, std::vector<std::string> details)
+const char* HawkbitClient::feedbackUrl(const Deployment& deployment)
 {
-    _doc.clear();
+    int len = snprintf(this->_url, sizeof(this->_url), "%s/%s/controller/v1/%s/deploymentBase/%s/feedback",
+        this->_baseUrl.c_str(), this->_tenantName.c_str(), this->_controllerId.c_str(), deployment.id().c_str());
+    return len < (int)sizeof(this->_url) ? this->_url : NULL;
+}
 
-    _doc["id"] = id.id();
-    
-    JsonArray d = _doc["status"].createNestedArray("details");
-    for (auto detail : details) {
-        d.add(detail);
-    }
+const char* HawkbitClient::feedbackUrl(const Stop& stop)
+{
+    int len = snprintf(this->_url, sizeof(this->_url), "%s/%s/controller/v1/%s/cancelAction/%s/feedback",
+        this->_baseUrl.c_str(), this->_tenantName.c_str(), this->_controllerId.c_str(), stop.id().c_str());
+    return len < (int)sizeof(this->_url) ? this->_url : NULL;
+}
+#else
+const char* HawkbitClient::controllerUrl()
+{
+    this->_url = this->_baseUrl + "/" + this->_tenantName + "/controller/v1/" + this->_controllerId;
+    return this->_url.c_str();
+}
 
-    _doc["status"]["execution"] = execution;
-    _doc["status"]["result"]["finished"] = finished;
-    esp_http_client_handle_t _http = initHttpHandle(HTTP_METHOD_POST, this->feedbackUrl(id));
+const char* HawkbitClient::feedbackUrl(const Deployment& deployment)
+{
+    this->_url = this->_baseUrl + "/" + this->_tenantName + "/controller/v1/" + this->_controllerId + "/deploymentBase/" + deployment.id() + "/feedback";
+    return this->_url.c_str();
+}
 
-    std::string buffer;
-    size_t len = serializeJson(_doc, buffer);
-    (void)len; // ignore unused
+const char* HawkbitClient::feedbackUrl(const Stop& stop)
+{
+    this->_url = this->_baseUrl + "/" + this->_tenantName + "/controller/v1/" + this->_controllerId + "/cancelAction/" + stop.id() + "/feedback";
+    return this->_url.c_str();
+}
+#endif
+
+template<typename IdProvider>
+UpdateResult HawkbitClient::sendFeedback(IdProvider id, const std::string& execution, const std::string& finished, std::vector<std::string> details, size_t optional)
+{
+    const char* url = this->feedbackUrl(id);
+    size_t len;
+    for (;;) {
+#if HAWKBIT_PREALLOCATE
+        len = _json.feedback(requestPayload, sizeof(requestPayload), id.id(), execution, finished, details);
+#else
+        len = _json.feedback(requestPayload, id.id(), execution, finished, details);
+#endif
+        if (len > 0 || optional == 0) {
+            break;
+        }
+        // leave out the first of the optional details until the body fits
+        details.erase(details.end() - optional);
+        optional--;
+    }
+#if HAWKBIT_PREALLOCATE
+    const char* body = requestPayload;
+#else
+    const char* body = requestPayload.c_str();
+#endif
+    if (url == NULL || len == 0) {
+        ESP_LOGE(TAG, "sendFeedback: failed to build the request URL or body");
+        return UpdateResult(0);
+    }
 
+    HAWKBIT_TRACE_BEGIN(REQUEST, HawkbitTrace::FEEDBACK_REQUEST, len);
     ESP_LOGD(TAG,"JSON - len: %d", len);
-    esp_http_client_set_post_field(_http, buffer.data(), len);
 
     // FIXME: handle result
-    esp_err_t err = esp_http_client_perform(_http);
-    if (err == ESP_OK) {
-        ESP_LOGI(TAG, "sendFeedback HTTP Status = %d, content_length = %d",
-                esp_http_client_get_status_code(_http),
-                esp_http_client_get_content_length(_http));
-        ESP_LOGD(TAG,"Result - payload: %s", resultPayload);
-    } else {
-        ESP_LOGE(TAG, "sendFeedback HTTP request failed: %s", esp_err_to_name(err));
-    }
-    int code = esp_http_client_get_status_code(_http);
+    int code = sendRequest("sendFeedback", HTTP_METHOD_POST, url, body, len);
     ESP_LOGD(TAG,"Result - code: %d", code);
-
-    esp_http_client_cleanup(_http);
+    HAWKBIT_TRACE(FEEDBACK, 0, code);
+    HAWKBIT_TRACE_END(REQUEST, HawkbitTrace::FEEDBACK_REQUEST, code);
 
     return UpdateResult(code);
 }
@@ -452,12 +1005,32 @@ UpdateResult HawkbitClient::reportResumed(const Deployment& deployment, std::vec
 
 UpdateResult HawkbitClient::reportComplete(const Deployment& deployment, bool success, std::vector<std::string> details)
 {
-    return sendFeedback(
+    // summaries of the downloads of this deployment's artifacts, the oldest
+    // are left out when the body doesn't fit
+    size_t required = details.size();
+    for (const DownloadStats& stats : this->_downloads) {
+        bool payload = false;
+        for (const Chunk& chunk : deployment.chunks()) {
+            for (const Artifact& artifact : chunk.artifacts()) {
+                payload = payload || artifact.filename() == stats.filename;
+            }
+        }
+        if (payload) {
+            details.push_back(stats.summary());
+        }
+    }
+
+    UpdateResult result = sendFeedback(
         deployment,
         "closed",
         success ? "success" : "failure",
-        details
+        details,
+        details.size() - required
     );
+    if (result.code() >= 200 && result.code() < 300) {
+        this->_downloads.clear();
+    }
+    return result;
 }
 
 UpdateResult HawkbitClient::reportCanceled(const Deployment& deployment, std::vector<std::string> details)
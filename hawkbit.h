@@ -23,15 +23,46 @@
 #include <string>
 #include <map>
 #include <list>
-#include <ArduinoJson.h>
+#include <functional>
+#include <algorithm>
 #include "esp_log.h"
 #include "esp_tls.h"
 
 #include "esp_http_client.h"
+#include "hawkbit_clock.h"
+#include "hawkbit_ddi.h"
+#include "hawkbit_download.h"
+#include "hawkbit_json.h"
+#include "hawkbit_model.h"
+#include "hawkbit_transport.h"
 
 #define MAX_HTTP_RECV_BUFFER 512
 #define MAX_HTTP_OUTPUT_BUFFER 2048
 
+// Redirects followed per request, unless disable_auto_redirect is set
+#ifndef HAWKBIT_MAX_REDIRECTS
+#define HAWKBIT_MAX_REDIRECTS 5
+#endif
+
+#ifndef MAX_HTTP_URL_LENGTH
+#define MAX_HTTP_URL_LENGTH 256
+#endif
+
+// Build with -DHAWKBIT_PREALLOCATE=1 to keep the large and long-lived
+// allocations off the heap: a single HTTP handle is created once and reused,
+// download buffers, queues and the writer task are statically allocated and
+// request bodies and URLs use fixed buffers of MAX_HTTP_OUTPUT_BUFFER and
+// MAX_HTTP_URL_LENGTH. Requests that don't fit fail instead of growing a
+// buffer. This is not a heap-free mode: parsing a response still allocates
+// the strings, maps and lists DdiParser builds and the State, Deployment and
+// Stop returned from them, bounded by the DdiLimits.
+#ifdef HAWKBIT_STATIC_MEMORY
+#error "HAWKBIT_STATIC_MEMORY was renamed to HAWKBIT_PREALLOCATE, the client still allocates while parsing"
+#endif
+#if HAWKBIT_PREALLOCATE && HAWKBIT_JSON_BACKEND != HAWKBIT_JSON_ARDUINOJSON
+#error "HAWKBIT_PREALLOCATE needs the ArduinoJson backend with a StaticJsonDocument"
+#endif
+
 class Artifact;
 class Chunk;
 class Deployment;
@@ -53,229 +84,51 @@ class UpdateResult {
         uint32_t _code;
 };
 
-class DownloadResult {
-    public:
-        DownloadResult(uint32_t code) :
-            _code(code)
-        {
-        }
-
-        uint32_t code() const { return this->_code; }
-
-    private:
-        uint32_t _code;
-};
-
-class Artifact {
-    public:
-        Artifact(
-            const std::string& filename,
-            uint32_t size,
-            const std::map<std::string,std::string>& hashes,
-            const std::map<std::string,std::string>& links
-            ) :
-            _filename(filename),
-            _size(size),
-            _hashes(hashes),
-            _links(links)
-        {
-        }
-
-        const std::string& filename() const { return _filename; }
-        uint32_t size() const { return _size; }
-        const std::map<std::string,std::string>& hashes() const { return _hashes; }
-        const std::map<std::string,std::string>& links() const { return _links; }
-
-        void dump(const std::string& prefix = "") const {
-             ESP_LOGI(prefix.c_str(),"%s %u\n", this->_filename.c_str(), this->_size);
-             ESP_LOGI(prefix.c_str(),"Hashes");
-             for (std::pair<std::string,std::string> element : this->_hashes) {
-                 ESP_LOGI(prefix.c_str(), "    %s = %s\n", element.first.c_str(), element.second.c_str());
-             }
-            ESP_LOGI(prefix.c_str(),"Links");
-             for (std::pair<std::string,std::string> element : this->_links) {
-                 ESP_LOGI(prefix.c_str(), "    %s = %s\n", element.first.c_str(), element.second.c_str());
-             }
-         }
-
-    private:
-        std::string _filename;
-        uint32_t _size;
-        std::map<std::string,std::string> _hashes;
-        std::map<std::string,std::string> _links;
-};
-
-class Chunk {
-    public:
-        Chunk(const std::string& part, const std::string& version, const std::string& name, const std::list<Artifact>& artifacts) :
-            _part(part),
-            _version(version),
-            _name(name),
-            _artifacts(artifacts)
-        {
-        }
-
-        const std::string& part() const { return _part; }
-        const std::string& version() const { return _version; }
-        const std::string& name() const { return _name; }
-        const std::list<Artifact>& artifacts() const { return _artifacts; }
-
-        void dump(const std::string& prefix = "") const {
-             ESP_LOGI(prefix.c_str(),"%s - %s (%s)\n", this->_name.c_str(), this->_version.c_str(), this->_part.c_str());
-             for (Artifact a: this->_artifacts) {
-                 a.dump(prefix + "    ");
-             }
-         }
-
-    private:
-        std::string _part;
-        std::string _version;
-        std::string _name;
-        std::list<Artifact> _artifacts;
-};
-
-class Deployment {
-    public:
-        Deployment() {
-        }
-
-        Deployment(const std::string& id, const std::string& download, const std::string& update, const std::list<Chunk>& chunks) :
-            _id(id),
-            _download(download),
-            _update(update),
-            _chunks(chunks)
-        {
-        }
-
-        const std::string& id() const { return _id; }
-        const std::list<Chunk>& chunks() const { return _chunks; }
-
-        void dump(const std::string& prefix = "") const {
-             ESP_LOGI(prefix.c_str(),"Deployment: %s\n", this->_id.c_str());
-             ESP_LOGI(prefix.c_str(),"    Download: %s, Update: %s\n", this->_download.c_str(), this->_update.c_str());
-             ESP_LOGI(prefix.c_str(),"    Chunks:");
-             std::string chunkPrefix = prefix + "        ";
-             for (Chunk c : this->_chunks) {
-                 c.dump(chunkPrefix);
-             }
-             ESP_LOGI(prefix.c_str(), "");
-         };
-    private:
-        std::string _id;
-        std::string _download;
-        std::string _update;
-        std::list<Chunk> _chunks;
-};
-
-class Stop {
-    public:
-        Stop() {
-        }
-
-        Stop(const std::string&id) :
-            _id(id)
-        {}
-
-        const std::string& id() const { return this->_id; }
-
-        void dump(const std::string& prefix = "") const
-        {
-            ESP_LOGI(prefix.c_str(),"Stop: %s\n", this->_id.c_str());
-        }
-    private:
-        std::string _id;
-};
-
-class Registration {
+/**
+ * Measurements of an artifact download, times in milliseconds.
+ */
+class DownloadStats {
     public:
-        Registration()
-        {
-        }
+        std::string filename;
+        uint32_t bytes = 0;
+        uint32_t duration = 0;
+        // from sending the request until the response headers arrived
+        uint32_t ttfb = 0;
+        // time the sink spent writing, including the final flush
+        uint32_t flashWrite = 0;
+        // reads that failed, and how many of them were resumed with a range request
+        uint16_t retries = 0;
+        uint16_t resumes = 0;
+
+        // bytes per second
+        uint32_t throughput() const { return this->duration ? (uint64_t) this->bytes * 1000 / this->duration : 0; }
 
-        Registration(const std::string& url):
-            _url(url)
-        {
-        }
-
-        const std::string& url() const { return this->_url; }
-
-        void dump(const std::string& prefix = "") const
-        {
-            ESP_LOGI(prefix.c_str(),"Registration: %s\n", this->_url.c_str());
-        }
-
-    private:
-        std::string _url;
+        /**
+         * One line summary for feedback details, e.g.
+         * "download app.bin bytes=1048576 ms=9120 Bps=114976 ttfb=180 flash=2310 retries=0 resumes=0"
+         */
+        std::string summary() const;
 };
 
-class State {
-
+class DownloadResult {
     public:
-
-        typedef enum { NONE, REGISTER, UPDATE, CANCEL } Type;
-
-        State() :
-            _type(State::NONE)
+        DownloadResult(uint32_t code, esp_err_t error = ESP_OK, const DownloadStats& stats = DownloadStats()) :
+            _code(code),
+            _error(error),
+            _stats(stats)
         {
         }
 
-        State(const Stop& stop) :
-            _type(State::CANCEL),
-            _stop(stop)
-        {
-        }
-
-        State(const Registration& registration) :
-            _type(State::REGISTER),
-            _registration(registration)
-        {
-        }
-
-        State(const Deployment& deployment) :
-            _type(State::UPDATE),
-            _deployment(deployment)
-        {
-        }
-
-        bool is(Type type) const
-        {
-            return this->_type == type;
-        }
-
-        Type type() const { return this->_type; }
-        const Deployment& deployment() const { return this->_deployment; }
-        const Stop& stop() const { return this->_stop; }
-        const Registration& registration() const { return this->_registration; }
+        uint32_t code() const { return this->_code; }
+        esp_err_t error() const { return this->_error; }
+        bool ok() const { return this->_code == HttpStatus_Ok && this->_error == ESP_OK; }
 
-        void dump(const std::string& prefix = "") const
-        {
-            switch (this->_type) {
-                case State::NONE:
-                    ESP_LOGI(prefix.c_str(),"State <NONE>");
-                    break;
-                case State::UPDATE:
-                    ESP_LOGI(prefix.c_str(),"State <UPDATE>");
-                    this->_deployment.dump("    ");
-                    break;
-                case State::CANCEL:
-                    ESP_LOGI(prefix.c_str(),"State <CANCEL>");
-                    this->_stop.dump("    ");
-                    break;
-                case State::REGISTER:
-                    ESP_LOGI(prefix.c_str(),"State <REGISTER>");
-                    this->_registration.dump("    ");
-                    break;
-                default:
-                    ESP_LOGI(prefix.c_str(),"State <UNKNOWN>");
-                    break;
-            }
-        }
+        const DownloadStats& stats() const { return this->_stats; }
 
     private:
-        Type _type;
-        Deployment _deployment;
-        Stop _stop;
-        Registration _registration;
+        uint32_t _code;
+        esp_err_t _error;
+        DownloadStats _stats;
 };
 
 class DownloadError {
@@ -291,28 +144,20 @@ class DownloadError {
         uint32_t _code;
 };
 
-// class Download {
-//     public:
-//         Stream& stream() { return this->_stream; }
-
-//     private:
-//         Stream& _stream;
-
-//         Download(Stream& stream) :
-//             _stream(stream)
-//          {
-//          }
-
-//     friend HawkbitClient;
-// };
-
 class HawkbitClient {
     public:
 
         typedef enum { MERGE, REPLACE, REMOVE } MergeMode;
 
+        typedef enum { TLS_ANY, TLS_1_2, TLS_1_3 } TlsVersion;
+
+        // returns the current value of a controller attribute
+        typedef std::function<std::string()> AttributeProvider;
+
         HawkbitClient(
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
             JsonDocument& json,
+#endif
             const std::string& baseUrl,
             const std::string& tenantName,
             const std::string& controllerId,
@@ -320,41 +165,35 @@ class HawkbitClient {
             char *server_cert_pem_start = NULL
             );
 
-        State readState();
-
-        // template<typename DownloadHandler>
-        // void download(const Artifact& artifact, DownloadHandler function)
-        // {
-        //     download(artifact, "download", function);
-        // }
-
-        // template<typename DownloadHandler>
-        // void download(const Artifact& artifact, const std::string& linkType, DownloadHandler function)
-        // {
-        //     auto href = artifact.links().find(linkType);
-
-        //     if ( href == artifact.links().end()) {
-        //         throw std::string("Missing link for download");
-        //     }
-
-        //     _http.begin(this->_wifi, href->second);
-
-        //     _http.addHeader("Authorization", this->_authToken);
+        ~HawkbitClient();
 
-        //     int code = _http.GET();
-        //     log_i("Result - code: %d", code);
+        State readState();
 
-        //     if (code == HTTP_CODE_OK ) {
-        //         Download d(_http.getStream());
-        //         function(d);
-        //     }
+        /**
+         * Download an artifact and stream it into sink.
+         * @param artifact the artifact to fetch
+         * @param sink receives the payload, e.g. an OtaSink
+         * @param linkType which of the artifact links to use ("download" or "download-http")
+         */
+        DownloadResult download(const Artifact& artifact, DownloadSink& sink, const std::string& linkType = "download");
 
-        //     _http.end();
+        /**
+         * Continue a download at offset with a range request. The sink is
+         * begun with the whole artifact but only receives the bytes from
+         * offset on, e.g. to fetch the rest again after a corrupted block.
+         */
+        DownloadResult download(const Artifact& artifact, DownloadSink& sink, const std::string& linkType, uint32_t offset);
 
-        //     if (code != HTTP_CODE_OK ) {
-        //         throw DownloadError(code);
-        //     }
-        // };
+        /**
+         * Fetch part of an artifact into memory with a range request, e.g. a
+         * few packets missed by a MulticastReceiver. Uses a connection of its
+         * own, with HAWKBIT_PREALLOCATE the shared one, so no other request
+         * of the client may be open. Call it from the task using the client,
+         * transports are not thread-safe.
+         * @param offset first byte
+         * @param buffer receives exactly len bytes
+         */
+        esp_err_t downloadRange(const Artifact& artifact, uint32_t offset, uint8_t* buffer, size_t len, const std::string& linkType = "download");
 
         UpdateResult reportProgress(const Deployment& deployment, uint32_t done, uint32_t total, std::vector<std::string> details = {});
 
@@ -372,6 +211,24 @@ class HawkbitClient {
 
         UpdateResult updateRegistration(const Registration& registration, const std::map<std::string,std::string>& data, MergeMode mergeMode = REPLACE, std::initializer_list<std::string> details = {});
 
+        /**
+         * Register a controller attribute, replacing a provider of the same
+         * name. The provider is only called when the attributes are sent.
+         * @param name attribute name
+         * @param provider returns the value
+         */
+        void attribute(const std::string& name, AttributeProvider provider);
+
+        /**
+         * Send the registered attributes, e.g. when readState() returned a
+         * Registration. Each provider is evaluated right before its value is
+         * written, the body is sent with chunked transfer encoding and isn't
+         * limited by MAX_HTTP_OUTPUT_BUFFER. The streamed body can't be sent
+         * again, so unlike the other requests a redirect is not followed and
+         * its 3xx status is returned.
+         */
+        UpdateResult updateRegistration(const Registration& registration, MergeMode mergeMode = REPLACE, std::initializer_list<std::string> details = {});
+
         /**
          * Set the timeout (in milliseconds) for establishing a connection to the server.
          * @param connectTimeout int
@@ -381,16 +238,138 @@ class HawkbitClient {
             this->_http_config.timeout_ms = connectTimeout;
         }
 
+        /**
+         * Set the bounds for responses of the server, a response exceeding
+         * them is rejected as soon as the limit is hit.
+         * @param limits DdiLimits
+         */
+        void ddiLimits(const DdiLimits& limits)
+        {
+            this->_ddiLimits = limits;
+        }
+
+        /**
+         * Restrict the TLS protocol version of the connections. TLS 1.3 saves a
+         * round trip per handshake if the server supports it. Needs ESP-IDF 5.2
+         * or later, older versions always negotiate. Must be set before the
+         * first request.
+         * @param version TlsVersion
+         */
+        void tlsVersion(TlsVersion version);
+
+        /**
+         * Log the TLS build configuration relevant for OTA throughput and heap:
+         * hardware acceleration, AEAD ciphers, record buffer sizes, dynamic
+         * buffers and max fragment length. These are mbedTLS options chosen in
+         * sdkconfig, not per connection.
+         */
+        static void logTlsConfig();
+
+        /**
+         * Enable or disable tuning of read size and pipeline depth during downloads.
+         * When disabled, downloads use synchronous reads of HAWKBIT_DOWNLOAD_MIN_READ_SIZE bytes.
+         * @param enabled bool
+         */
+        void autotune(bool enabled)
+        {
+            this->_autotune = enabled;
+        }
+
+        /**
+         * Switch to a high throughput network profile while downloading artifacts.
+         * Wi-Fi modem sleep is disabled and a larger HTTP receive buffer used, the
+         * previous power save mode is restored when the download ends. With
+         * HAWKBIT_PREALLOCATE the shared HTTP handle gets the larger buffer
+         * for all requests, enable this before the first request.
+         * @param enabled bool
+         */
+        void throughputProfile(bool enabled)
+        {
+            this->_throughputProfile = enabled;
+        }
+
+        /**
+         * Set how often a download is resumed with a range request after the
+         * connection broke, 0 fails on the first error.
+         * @param retries uint8_t
+         */
+        void downloadRetries(uint8_t retries)
+        {
+            this->_downloadRetries = retries;
+        }
+
+        /**
+         * Include a summary of every download of the deployment's artifacts
+         * (throughput, time to first byte, flash write time, retries) in the
+         * details of reportComplete(). Summaries that don't fit into the body
+         * are left out, oldest first, and they are kept until the server
+         * accepted the feedback. Enabled by default.
+         * @param enabled bool
+         */
+        void downloadTelemetry(bool enabled)
+        {
+            this->_downloadTelemetry = enabled;
+        }
+
+        bool getDownloadTelemetry() { return this->_downloadTelemetry; }
+
+        /**
+         * Add the measurements of the last download as controller attributes
+         * ("ota.download.*"), for use with updateRegistration().
+         */
+        void downloadAttributes(std::map<std::string,std::string>& data) const;
+
+        /**
+         * Route the client's requests through another transport, e.g. a
+         * RecordingTransport or ReplayTransport. The transport must outlive
+         * the client.
+         */
+        void transport(HawkbitTransport& transport)
+        {
+            this->_transport = &transport;
+        }
+
+        /**
+         * Use another time source, e.g. a VirtualClock to simulate long
+         * polling schedules quickly. The clock must outlive the client.
+         */
+        void clock(HawkbitClock& clock)
+        {
+            this->_clock = &clock;
+        }
+
+        /**
+         * Wait the polling time the server asked for on the client's clock,
+         * before the next readState().
+         */
+        void waitPollingTime()
+        {
+            this->_clock->sleep((uint32_t) std::min<uint64_t>((uint64_t) this->pollingTime * 1000, UINT32_MAX));
+        }
+
+        /**
+         * Prepare a request with the client's configuration and headers. With
+         * HAWKBIT_PREALLOCATE this is the client's shared handle and must not
+         * be cleaned up by the caller.
+         */
         esp_http_client_handle_t initHttpHandle(esp_http_client_method_t method, const std::string& url);
 
         std::string& getAuthToken() { return this->_authToken; }
         uint32_t getPollingTime() { return this->pollingTime; }
 
     private:
-        JsonDocument& _doc;
+        JsonWriter _json;
     
         char resultPayload[MAX_HTTP_OUTPUT_BUFFER] = {};
         esp_http_client_config_t _http_config = {};
+#if HAWKBIT_PREALLOCATE
+        char requestPayload[MAX_HTTP_OUTPUT_BUFFER] = {};
+        char _url[MAX_HTTP_URL_LENGTH] = {};
+        esp_http_client_handle_t _http = NULL;
+#else
+        std::string requestPayload;
+        std::string _url;
+#endif
 
         std::string _baseUrl;
         std::string _tenantName;
@@ -400,12 +379,43 @@ class HawkbitClient {
         //polling time in seconds
         uint32_t pollingTime = 60;
 
+        DdiLimits _ddiLimits;
+        bool _autotune = true;
+        bool _throughputProfile = false;
+        uint8_t _downloadRetries = HAWKBIT_DOWNLOAD_RETRIES;
+        bool _downloadTelemetry = true;
+        // downloads of the current deployment not yet reported by reportComplete()
+        std::vector<DownloadStats> _downloads;
+        std::string _downloadsDeployment;
+        DownloadStats _lastDownload;
+
+        std::vector<std::pair<std::string,AttributeProvider>> _attributes;
+
+        HawkbitTransport* _transport = &HawkbitTransport::standard();
+        HawkbitClock* _clock = &HawkbitClock::standard();
+
+        esp_http_client_handle_t initHttpHandle(esp_http_client_method_t method, const char* url, const esp_http_client_config_t& config);
+        void releaseHttpHandle(esp_http_client_handle_t handle);
+
+        esp_http_client_config_t streamingConfig() const;
+        esp_err_t openRequest(const char* name, esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen);
+        // open, send the body if any and read the headers, following redirects
+        esp_err_t fetchResponse(const char* name, esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, const char* body, size_t len, int& code);
+        // send a request with a body, @return HTTP status or 0
+        int sendRequest(const char* name, esp_http_client_method_t method, const char* url, const char* body, size_t len);
+
+        bool readDocument(const char* name, const char* url, DdiParser& parser);
+        esp_err_t openDownload(esp_http_client_handle_t http, const char* url, uint32_t offset, int& code);
+        static const char* mergeModeName(MergeMode mergeMode);
+
         Deployment readDeployment(const std::string& href);
         Stop readCancel(const std::string& href);
 
-        std::string feedbackUrl(const Deployment& deployment) const;
-        std::string feedbackUrl(const Stop& stop) const;
+        const char* controllerUrl();
+        const char* feedbackUrl(const Deployment& deployment);
+        const char* feedbackUrl(const Stop& stop);
 
         template<typename IdProvider>
-        UpdateResult sendFeedback(IdProvider id, const std::string& execution, const std::string& finished, std::vector<std::string> details );
+        // @param optional how many of the last details may be left out if the body doesn't fit
+        UpdateResult sendFeedback(IdProvider id, const std::string& execution, const std::string& finished, std::vector<std::string> details, size_t optional = 0);
 };
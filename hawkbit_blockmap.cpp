@@ -0,0 +1,264 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_blockmap.h"
+#include "hawkbit_hash.h"
+#include <algorithm>
+#include <string.h>
+
+static const char* TAG = "hawkbit";
+
+static const char BLOCKMAP_MAGIC[4] = { 'H', 'B', 'B', 'M' };
+static const uint32_t BLOCKMAP_VERSION = 1;
+static const size_t BLOCKMAP_HEADER = 16;
+
+const char* BlockMap::SUFFIX = ".blockmap";
+
+/**
+ * Collects a small artifact in memory.
+ */
+class MemorySink : public DownloadSink {
+    public:
+        MemorySink(size_t limit) :
+            _limit(limit)
+        {
+        }
+
+        esp_err_t begin(const Artifact& artifact) override
+        {
+            if (artifact.size() > this->_limit) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            this->_data.reserve(artifact.size());
+            return ESP_OK;
+        }
+
+        esp_err_t write(const uint8_t* data, size_t len) override
+        {
+            if (this->_data.size() + len > this->_limit) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            this->_data.insert(this->_data.end(), data, data + len);
+            return ESP_OK;
+        }
+
+        const std::vector<uint8_t>& data() const { return this->_data; }
+
+    private:
+        size_t _limit;
+        std::vector<uint8_t> _data;
+};
+
+static uint32_t readLe32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+esp_err_t BlockMap::load(HawkbitClient& client, const Artifact& map, const Artifact& artifact)
+{
+    auto hash = map.hashes().find("sha256");
+    if (hash == map.hashes().end()) {
+        ESP_LOGE(TAG, "BlockMap: %s has no sha256", map.filename().c_str());
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // the map is not part of the payload reported with the feedback
+    MemorySink sink(HAWKBIT_BLOCKMAP_MAX_SIZE);
+    bool telemetry = client.getDownloadTelemetry();
+    client.downloadTelemetry(false);
+    DownloadResult result = client.download(map, sink);
+    client.downloadTelemetry(telemetry);
+    if (!result.ok()) {
+        return result.error() != ESP_OK ? result.error() : ESP_FAIL;
+    }
+
+    std::string expected = hash->second;
+    std::transform(expected.begin(), expected.end(), expected.begin(), ::tolower);
+    Sha256 sha256;
+    sha256.update(sink.data().data(), sink.data().size());
+    if (sha256.finishHex() != expected) {
+        ESP_LOGE(TAG, "BlockMap: sha256 mismatch for %s", map.filename().c_str());
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    return parse(sink.data().data(), sink.data().size(), artifact.size());
+}
+
+esp_err_t BlockMap::parse(const uint8_t* data, size_t len, uint32_t artifactSize)
+{
+    if (len < BLOCKMAP_HEADER || memcmp(data, BLOCKMAP_MAGIC, sizeof(BLOCKMAP_MAGIC)) != 0 || readLe32(data + 4) != BLOCKMAP_VERSION) {
+        ESP_LOGE(TAG, "BlockMap: not a block map");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    uint32_t blockSize = readLe32(data + 8);
+    uint32_t count = readLe32(data + 12);
+    if (blockSize == 0 || blockSize > HAWKBIT_BLOCKMAP_MAX_BLOCK ||
+        count != (artifactSize + blockSize - 1) / blockSize ||
+        len != BLOCKMAP_HEADER + (size_t) count * Sha256::SIZE) {
+        ESP_LOGE(TAG, "BlockMap: %u blocks of %u bytes don't match the artifact", count, blockSize);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    this->_blockSize = blockSize;
+    this->_digests.assign(data + BLOCKMAP_HEADER, data + len);
+    return ESP_OK;
+}
+
+bool BlockMap::matches(uint32_t index, const uint8_t* digest) const
+{
+    return index < count() && memcmp(&this->_digests[index * Sha256::SIZE], digest, Sha256::SIZE) == 0;
+}
+
+bool BlockMap::isBlockMap(const Artifact& artifact)
+{
+    const std::string& name = artifact.filename();
+    size_t suffix = strlen(SUFFIX);
+    return name.size() > suffix && name.compare(name.size() - suffix, suffix, SUFFIX) == 0;
+}
+
+const Artifact* BlockMap::find(const Chunk& chunk, const Artifact& artifact)
+{
+    std::string name = artifact.filename() + SUFFIX;
+    for (const Artifact& candidate : chunk.artifacts()) {
+        if (candidate.filename() == name) {
+            return &candidate;
+        }
+    }
+    return NULL;
+}
+
+DownloadResult VerifyingSink::download(const Artifact& artifact)
+{
+    this->_resumable = true;
+    this->_begun = false;
+    this->_corrupted = NONE;
+    DownloadResult result = this->_client.download(artifact, *this, this->_linkType);
+
+    uint32_t block = NONE;
+    int attempt = 0;
+    while (this->_corrupted != NONE) {
+        attempt = this->_corrupted == block ? attempt + 1 : 1;
+        block = this->_corrupted;
+        if (attempt > HAWKBIT_BLOCKMAP_REFETCHES) {
+            ESP_LOGE(TAG, "VerifyingSink: block %u still corrupted, giving up", block);
+            break;
+        }
+
+        // the previous request is closed, so this is the only one in flight
+        ESP_LOGW(TAG, "VerifyingSink: block %u corrupted, fetching again from there", block);
+        this->_corrupted = NONE;
+        result = this->_client.download(artifact, *this, this->_linkType, block * this->_map.blockSize());
+    }
+
+    this->_resumable = false;
+    if (this->_begun) {
+        // given up, or a request failed before the sink was begun again
+        this->_sink.end(false);
+        this->_begun = false;
+        std::vector<uint8_t>().swap(this->_block);
+        if (result.error() == ESP_OK) {
+            return DownloadResult(result.code(), ESP_ERR_INVALID_CRC, result.stats());
+        }
+    } else if (block != NONE && result.error() == ESP_OK) {
+        // the last request was a range request answered with 206
+        return DownloadResult(HttpStatus_Ok, ESP_OK, result.stats());
+    }
+    return result;
+}
+
+esp_err_t VerifyingSink::begin(const Artifact& artifact)
+{
+    if (this->_map.blockSize() == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    this->_fill = 0;
+    if (this->_begun) {
+        // continued after a corrupted block, the next sink already has the
+        // blocks before it
+        return ESP_OK;
+    }
+
+    this->_block.resize(this->_map.blockSize());
+    this->_index = 0;
+    this->_repaired = 0;
+    this->_corrupted = NONE;
+    this->_repairing = NONE;
+    esp_err_t err = this->_sink.begin(artifact);
+    this->_begun = err == ESP_OK;
+    return err;
+}
+
+esp_err_t VerifyingSink::write(const uint8_t* data, size_t len)
+{
+    while (len > 0) {
+        size_t n = std::min(len, this->_block.size() - this->_fill);
+        memcpy(&this->_block[this->_fill], data, n);
+        this->_fill += n;
+        data += n;
+        len -= n;
+
+        if (this->_fill == this->_block.size()) {
+            esp_err_t err = complete();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t VerifyingSink::complete()
+{
+    uint8_t digest[Sha256::SIZE];
+    Sha256 sha256;
+    sha256.update(&this->_block[0], this->_fill);
+    sha256.finish(digest);
+
+    if (!this->_map.matches(this->_index, digest)) {
+        ESP_LOGW(TAG, "VerifyingSink: block %u corrupted", this->_index);
+        this->_corrupted = this->_index;
+        this->_fill = 0;
+        return ESP_ERR_INVALID_CRC;
+    }
+    if (this->_index == this->_repairing) {
+        this->_repaired++;
+        this->_repairing = NONE;
+    }
+
+    esp_err_t err = this->_sink.write(&this->_block[0], this->_fill);
+    this->_fill = 0;
+    this->_index++;
+    return err;
+}
+
+esp_err_t VerifyingSink::end(bool success)
+{
+    esp_err_t err = ESP_OK;
+    if (success && this->_fill > 0) {
+        err = complete();
+    }
+    if (success && err == ESP_OK && this->_index != this->_map.count()) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    if (this->_corrupted != NONE) {
+        this->_repairing = this->_corrupted;
+        if (this->_resumable) {
+            // download() fetches the rest again, the next sink stays open
+            return ESP_ERR_INVALID_CRC;
+        }
+        err = ESP_ERR_INVALID_CRC;
+    }
+    std::vector<uint8_t>().swap(this->_block);
+
+    esp_err_t endErr = this->_sink.end(success && err == ESP_OK);
+    this->_begun = false;
+    return err != ESP_OK ? err : endErr;
+}
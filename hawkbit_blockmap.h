@@ -0,0 +1,123 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "hawkbit.h"
+
+// Largest block map and block size accepted, the block is held in memory
+// until it is verified
+#ifndef HAWKBIT_BLOCKMAP_MAX_SIZE
+#define HAWKBIT_BLOCKMAP_MAX_SIZE (16 * 1024)
+#endif
+
+#ifndef HAWKBIT_BLOCKMAP_MAX_BLOCK
+#define HAWKBIT_BLOCKMAP_MAX_BLOCK (32 * 1024)
+#endif
+
+// How often a corrupted block is fetched again before the download fails
+#ifndef HAWKBIT_BLOCKMAP_REFETCHES
+#define HAWKBIT_BLOCKMAP_REFETCHES 2
+#endif
+
+/**
+ * The sha256 of every fixed size block of an artifact, shipped as an extra
+ * artifact "<filename>.blockmap" in the same chunk (see
+ * tools/hawkbit_blockmap.py). The block map itself is checked against the
+ * sha256 from the deployment, which makes every block hash as trustworthy
+ * as the hash of the whole artifact.
+ *
+ * Format: "HBBM", version, block size, block count (little endian uint32),
+ * then the 32 byte digests.
+ */
+class BlockMap {
+    public:
+        static const char* SUFFIX;
+
+        /**
+         * Download and check the block map.
+         * @param map the ".blockmap" artifact
+         * @param artifact the artifact it describes
+         */
+        esp_err_t load(HawkbitClient& client, const Artifact& map, const Artifact& artifact);
+
+        esp_err_t parse(const uint8_t* data, size_t len, uint32_t artifactSize);
+
+        uint32_t blockSize() const { return this->_blockSize; }
+        uint32_t count() const { return this->_digests.size() / 32; }
+
+        // true if digest is the expected sha256 of block index
+        bool matches(uint32_t index, const uint8_t* digest) const;
+
+        // the block map of artifact in chunk, NULL if there is none
+        static const Artifact* find(const Chunk& chunk, const Artifact& artifact);
+        static bool isBlockMap(const Artifact& artifact);
+
+    private:
+        uint32_t _blockSize = 0;
+        std::vector<uint8_t> _digests;
+};
+
+/**
+ * Checks every block against a BlockMap before passing it on to another
+ * sink, so a corrupted block never reaches flash.
+ *
+ * Run the download with download(): a corrupted block stops the transfer,
+ * the next sink stays open and the rest of the artifact is fetched again
+ * from the start of that block with a range request. Up to
+ * HAWKBIT_BLOCKMAP_REFETCHES attempts are made per block. The requests are
+ * made from the calling task, the download writer task only verifies.
+ * Used directly as the sink of HawkbitClient::download(), a corrupted
+ * block fails the download.
+ */
+class VerifyingSink : public DownloadSink {
+    public:
+        VerifyingSink(HawkbitClient& client, const BlockMap& map, DownloadSink& sink, const std::string& linkType = "download") :
+            _client(client),
+            _map(map),
+            _sink(sink),
+            _linkType(linkType)
+        {
+        }
+
+        DownloadResult download(const Artifact& artifact);
+
+        esp_err_t begin(const Artifact& artifact) override;
+        esp_err_t write(const uint8_t* data, size_t len) override;
+        esp_err_t end(bool success) override;
+
+        // blocks verified so far, and how many of them had to be fetched again
+        uint32_t verified() const { return this->_index; }
+        uint32_t repaired() const { return this->_repaired; }
+
+    private:
+        static const uint32_t NONE = UINT32_MAX;
+
+        HawkbitClient& _client;
+        const BlockMap& _map;
+        DownloadSink& _sink;
+        std::string _linkType;
+        std::vector<uint8_t> _block;
+        size_t _fill = 0;
+        uint32_t _index = 0;
+        uint32_t _repaired = 0;
+        // the next sink was begun and not ended yet
+        bool _begun = false;
+        // inside download(), a corrupted block keeps the next sink open
+        bool _resumable = false;
+        // block that failed verification, and the one being fetched again
+        uint32_t _corrupted = NONE;
+        uint32_t _repairing = NONE;
+
+        esp_err_t complete();
+};
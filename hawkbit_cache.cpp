@@ -0,0 +1,402 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_cache.h"
+#include "hawkbit_hash.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "esp_timer.h"
+
+static const char* TAG = "hawkbit";
+
+#define TEMP_SUFFIX ".tmp"
+#define DIGEST_SUFFIX ".sha"
+#define DIGEST_LENGTH 64
+#define DONE_BIT 1
+
+static bool hasSuffix(const std::string& name, const char* suffix)
+{
+    size_t len = strlen(suffix);
+    return name.size() > len && name.compare(name.size() - len, std::string::npos, suffix) == 0;
+}
+
+/**
+ * Writes a download to a temporary file and moves it into place only if
+ * the content matches the expected sha256.
+ */
+class CacheFileSink : public DownloadSink {
+    public:
+        CacheFileSink(const std::string& path, const std::string& sha256) :
+            _path(path),
+            _temp(path + TEMP_SUFFIX),
+            _sha256(sha256)
+        {
+        }
+
+        esp_err_t begin(const Artifact& artifact) override
+        {
+            this->_file = fopen(this->_temp.c_str(), "wb");
+            if (this->_file == NULL) {
+                ESP_LOGE(TAG, "ArtifactCache: can't create %s", this->_temp.c_str());
+                return ESP_FAIL;
+            }
+            this->_size = 0;
+            this->_hash.reset();
+            return ESP_OK;
+        }
+
+        esp_err_t write(const uint8_t* data, size_t len) override
+        {
+            this->_hash.update(data, len);
+            this->_size += len;
+            return fwrite(data, 1, len, this->_file) == len ? ESP_OK : ESP_FAIL;
+        }
+
+        esp_err_t end(bool success) override
+        {
+            bool written = fclose(this->_file) == 0;
+            this->_file = NULL;
+
+            esp_err_t err = success && written ? ESP_OK : ESP_FAIL;
+            if (err == ESP_OK && this->_hash.finishHex() != this->_sha256) {
+                ESP_LOGE(TAG, "ArtifactCache: sha256 mismatch for %s", this->_path.c_str());
+                err = ESP_ERR_INVALID_CRC;
+            }
+            if (err == ESP_OK) {
+                // FAT doesn't replace existing files on rename
+                remove(this->_path.c_str());
+                if (rename(this->_temp.c_str(), this->_path.c_str()) != 0) {
+                    err = ESP_FAIL;
+                }
+            }
+            if (err == ESP_OK) {
+                // the name is only a prefix, the whole digest goes next to it
+                std::string digest = this->_path + DIGEST_SUFFIX;
+                FILE* file = fopen(digest.c_str(), "wb");
+                bool saved = file != NULL && fwrite(this->_sha256.data(), 1, this->_sha256.size(), file) == this->_sha256.size();
+                if (file != NULL && fclose(file) != 0) {
+                    saved = false;
+                }
+                if (!saved) {
+                    remove(digest.c_str());
+                    remove(this->_path.c_str());
+                    err = ESP_FAIL;
+                }
+            }
+            if (err != ESP_OK) {
+                remove(this->_temp.c_str());
+            }
+            return err;
+        }
+
+        uint64_t size() const { return this->_size; }
+
+    private:
+        std::string _path;
+        std::string _temp;
+        std::string _sha256;
+        FILE* _file = NULL;
+        uint64_t _size = 0;
+        Sha256 _hash;
+};
+
+ArtifactCache::ArtifactCache(const std::string& directory, uint64_t capacity) :
+    _directory(directory),
+    _capacity(capacity)
+{
+    this->_lock = xSemaphoreCreateMutex();
+}
+
+ArtifactCache::~ArtifactCache()
+{
+    vSemaphoreDelete(this->_lock);
+}
+
+std::string ArtifactCache::name(const std::string& sha256) const
+{
+    std::string name = sha256.substr(0, HAWKBIT_CACHE_NAME_LENGTH);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return name;
+}
+
+std::string ArtifactCache::path(const std::string& name) const
+{
+    return this->_directory + "/" + name;
+}
+
+std::string ArtifactCache::digest(const std::string& sha256)
+{
+    std::string digest = sha256;
+    std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+    return digest;
+}
+
+esp_err_t ArtifactCache::begin()
+{
+    DIR* dir = opendir(this->_directory.c_str());
+    if (dir == NULL) {
+        ESP_LOGE(TAG, "ArtifactCache: can't open %s", this->_directory.c_str());
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    this->_entries.clear();
+    this->_used = 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        std::string name = entry->d_name;
+        std::string file = path(name);
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (hasSuffix(name, TEMP_SUFFIX)) {
+            // left over from an interrupted download
+            remove(file.c_str());
+            continue;
+        }
+        if (hasSuffix(name, DIGEST_SUFFIX)) {
+            // read with the artifact, dropped if that is gone
+            std::string artifact = file.substr(0, file.size() - strlen(DIGEST_SUFFIX));
+            if (stat(artifact.c_str(), &st) != 0) {
+                remove(file.c_str());
+            }
+            continue;
+        }
+
+        char sha256[DIGEST_LENGTH] = {};
+        FILE* digest = fopen((file + DIGEST_SUFFIX).c_str(), "rb");
+        size_t len = digest != NULL ? fread(sha256, 1, sizeof(sha256), digest) : 0;
+        if (digest != NULL) {
+            fclose(digest);
+        }
+        if (len != sizeof(sha256)) {
+            // interrupted before its digest was written
+            remove(file.c_str());
+            remove((file + DIGEST_SUFFIX).c_str());
+            continue;
+        }
+
+        // no access times on these file systems, existing entries count as least recently used
+        this->_entries.push_back({ name, std::string(sha256, sizeof(sha256)), (uint64_t) st.st_size });
+        this->_used += st.st_size;
+    }
+    closedir(dir);
+
+    evict();
+    ESP_LOGI(TAG, "ArtifactCache: %u artifacts, %llu of %llu bytes", this->_entries.size(), this->_used, this->_capacity);
+    xSemaphoreGive(this->_lock);
+    return ESP_OK;
+}
+
+bool ArtifactCache::touch(const std::string& name, const std::string& sha256)
+{
+    for (auto entry = this->_entries.begin(); entry != this->_entries.end(); ++entry) {
+        if (entry->name == name && entry->sha256 == sha256) {
+            this->_entries.splice(this->_entries.begin(), this->_entries, entry);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ArtifactCache::insert(const std::string& name, const std::string& sha256, uint64_t size)
+{
+    for (auto entry = this->_entries.begin(); entry != this->_entries.end(); ++entry) {
+        if (entry->name == name) {
+            this->_used -= entry->size;
+            this->_entries.erase(entry);
+            break;
+        }
+    }
+    this->_entries.push_front({ name, sha256, size });
+    this->_used += size;
+    evict();
+}
+
+void ArtifactCache::evict()
+{
+    // the most recent entry stays even if it alone exceeds the capacity
+    while (this->_used > this->_capacity && this->_entries.size() > 1) {
+        const Entry& oldest = this->_entries.back();
+        ESP_LOGI(TAG, "ArtifactCache: evicting %s", oldest.name.c_str());
+        remove(path(oldest.name).c_str());
+        remove((path(oldest.name) + DIGEST_SUFFIX).c_str());
+        this->_used -= oldest.size;
+        this->_entries.pop_back();
+    }
+}
+
+bool ArtifactCache::contains(const std::string& sha256)
+{
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    bool found = false;
+    std::string name = this->name(sha256);
+    std::string digest = this->digest(sha256);
+    for (const Entry& entry : this->_entries) {
+        if (entry.name == name && entry.sha256 == digest) {
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(this->_lock);
+    return found;
+}
+
+FILE* ArtifactCache::open(const std::string& sha256)
+{
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    std::string name = this->name(sha256);
+    FILE* file = touch(name, digest(sha256)) ? fopen(path(name).c_str(), "rb") : NULL;
+    xSemaphoreGive(this->_lock);
+    return file;
+}
+
+DownloadResult ArtifactCache::fetch(HawkbitClient& client, const Artifact& artifact, DownloadSink& sink, const std::string& linkType)
+{
+    auto hash = artifact.hashes().find("sha256");
+    if (hash == artifact.hashes().end() || hash->second.size() != DIGEST_LENGTH) {
+        return client.download(artifact, sink, linkType);
+    }
+    std::string name = this->name(hash->second);
+    std::string sha256 = digest(hash->second);
+
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    if (touch(name, sha256)) {
+        xSemaphoreGive(this->_lock);
+        return serve(artifact, name, sha256, sink);
+    }
+
+    auto pending = this->_pending.find(sha256);
+    if (pending != this->_pending.end()) {
+        // another task is downloading it, wait for the result
+        Pending* download = pending->second;
+        download->users++;
+        xSemaphoreGive(this->_lock);
+
+        xEventGroupWaitBits(download->done, DONE_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+
+        xSemaphoreTake(this->_lock, portMAX_DELAY);
+        DownloadResult result(download->code, download->error);
+        if (--download->users == 0) {
+            vEventGroupDelete(download->done);
+            delete download;
+        }
+        xSemaphoreGive(this->_lock);
+        return result.ok() ? serve(artifact, name, sha256, sink) : result;
+    }
+
+    for (const auto& other : this->_pending) {
+        if (this->name(other.first) == name) {
+            // another artifact with the same prefix is written to the file,
+            // this one isn't cached
+            xSemaphoreGive(this->_lock);
+            return client.download(artifact, sink, linkType);
+        }
+    }
+
+    Pending* download = new Pending();
+    download->done = xEventGroupCreate();
+    download->users = 1;
+    this->_pending[sha256] = download;
+    xSemaphoreGive(this->_lock);
+
+    DownloadResult result = this->download(client, artifact, sha256, linkType);
+
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    this->_pending.erase(sha256);
+    download->code = result.code();
+    download->error = result.error();
+    xEventGroupSetBits(download->done, DONE_BIT);
+    if (--download->users == 0) {
+        vEventGroupDelete(download->done);
+        delete download;
+    }
+    xSemaphoreGive(this->_lock);
+
+    return result.ok() ? serve(artifact, name, sha256, sink) : result;
+}
+
+DownloadResult ArtifactCache::download(HawkbitClient& client, const Artifact& artifact, const std::string& sha256, const std::string& linkType)
+{
+    std::string name = this->name(sha256);
+    CacheFileSink file(path(name), sha256);
+    DownloadResult result = client.download(artifact, file, linkType);
+    if (result.ok()) {
+        xSemaphoreTake(this->_lock, portMAX_DELAY);
+        insert(name, sha256, file.size());
+        xSemaphoreGive(this->_lock);
+    }
+    return result;
+}
+
+DownloadResult ArtifactCache::serve(const Artifact& artifact, const std::string& name, const std::string& sha256, DownloadSink& sink)
+{
+    DownloadStats stats;
+    stats.filename = artifact.filename();
+    int64_t start = esp_timer_get_time();
+
+    // evicted in the meantime, or replaced by an artifact with the same prefix
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    FILE* file = touch(name, sha256) ? fopen(path(name).c_str(), "rb") : NULL;
+    xSemaphoreGive(this->_lock);
+    if (file == NULL) {
+        return DownloadResult(0, ESP_ERR_NOT_FOUND, stats);
+    }
+
+    esp_err_t err = sink.begin(artifact);
+    if (err != ESP_OK) {
+        fclose(file);
+        return DownloadResult(HttpStatus_Ok, err, stats);
+    }
+
+    std::vector<uint8_t> buffer(HAWKBIT_FLASH_WRITE_BLOCK);
+    Sha256 hash;
+    size_t len;
+    while (err == ESP_OK && (len = fread(&buffer[0], 1, buffer.size(), file)) > 0) {
+        hash.update(&buffer[0], len);
+        int64_t writeStart = esp_timer_get_time();
+        err = sink.write(&buffer[0], len);
+        stats.flashWrite += (esp_timer_get_time() - writeStart) / 1000;
+        stats.bytes += len;
+    }
+    if (err == ESP_OK && (ferror(file) || stats.bytes != artifact.size())) {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    fclose(file);
+    if (err == ESP_OK && hash.finishHex() != sha256) {
+        // the sink isn't ended successfully with corrupted content
+        ESP_LOGE(TAG, "ArtifactCache: %s changed on the file system", artifact.filename().c_str());
+        err = ESP_ERR_INVALID_CRC;
+
+        // the next fetch downloads it again
+        xSemaphoreTake(this->_lock, portMAX_DELAY);
+        for (auto entry = this->_entries.begin(); entry != this->_entries.end(); ++entry) {
+            if (entry->name == name && entry->sha256 == sha256) {
+                remove(path(name).c_str());
+                remove((path(name) + DIGEST_SUFFIX).c_str());
+                this->_used -= entry->size;
+                this->_entries.erase(entry);
+                break;
+            }
+        }
+        xSemaphoreGive(this->_lock);
+    }
+
+    esp_err_t endErr = sink.end(err == ESP_OK);
+    if (err == ESP_OK) {
+        err = endErr;
+    }
+    stats.duration = (esp_timer_get_time() - start) / 1000;
+    ESP_LOGI(TAG, "ArtifactCache: served %s from cache", artifact.filename().c_str());
+    return DownloadResult(HttpStatus_Ok, err, stats);
+}
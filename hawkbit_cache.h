@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <list>
+#include <map>
+#include "hawkbit.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+// Cache files are named after the leading hex digits of the artifact's
+// sha256, the whole digest is kept in a file with ".sha" appended. SPIFFS
+// limits whole paths to 32 characters, on FAT or an SD card with long file
+// names up to all 64 digits can be used.
+#ifndef HAWKBIT_CACHE_NAME_LENGTH
+#define HAWKBIT_CACHE_NAME_LENGTH 16
+#endif
+
+/**
+ * Content addressed artifact store on a mounted VFS file system (SD card,
+ * FAT or SPIFFS), for devices that pass artifacts on to others.
+ *
+ * Artifacts are keyed by the sha256 from Artifact::hashes() and only enter
+ * the cache after the downloaded content matched it. Content served from the
+ * cache is checked against it again. The least recently used artifacts are
+ * evicted once the cache grows beyond its capacity. Fetches of the same
+ * artifact from several tasks download it once, the other callers wait for
+ * that download and are served from the cache.
+ */
+class ArtifactCache {
+    public:
+        /**
+         * @param directory existing directory on a mounted file system
+         * @param capacity bytes the cached artifacts may take
+         */
+        ArtifactCache(const std::string& directory, uint64_t capacity);
+        ~ArtifactCache();
+
+        /**
+         * Index the artifacts already in the directory and remove incomplete
+         * ones. Call once after the file system is mounted.
+         */
+        esp_err_t begin();
+
+        /**
+         * Write an artifact into sink, downloading it with client only if it
+         * isn't cached yet. Artifacts without a sha256 are downloaded directly.
+         */
+        DownloadResult fetch(HawkbitClient& client, const Artifact& artifact, DownloadSink& sink, const std::string& linkType = "download");
+
+        /**
+         * Open a cached artifact for reading and mark it recently used.
+         * @return NULL if the artifact isn't cached
+         */
+        FILE* open(const std::string& sha256);
+
+        bool contains(const std::string& sha256);
+
+        uint64_t used() const { return this->_used; }
+        uint64_t capacity() const { return this->_capacity; }
+
+    private:
+        typedef struct {
+            std::string name;
+            // all 64 digits, lower case
+            std::string sha256;
+            uint64_t size;
+        } Entry;
+
+        typedef struct {
+            EventGroupHandle_t done;
+            int users;
+            uint32_t code;
+            esp_err_t error;
+        } Pending;
+
+        std::string _directory;
+        uint64_t _capacity;
+        uint64_t _used = 0;
+        // most recently used first
+        std::list<Entry> _entries;
+        // downloads in progress by digest
+        std::map<std::string,Pending*> _pending;
+        SemaphoreHandle_t _lock;
+
+        std::string name(const std::string& sha256) const;
+        std::string path(const std::string& name) const;
+        static std::string digest(const std::string& sha256);
+
+        // with _lock held
+        bool touch(const std::string& name, const std::string& sha256);
+        void insert(const std::string& name, const std::string& sha256, uint64_t size);
+        void evict();
+
+        DownloadResult download(HawkbitClient& client, const Artifact& artifact, const std::string& sha256, const std::string& linkType);
+        DownloadResult serve(const Artifact& artifact, const std::string& name, const std::string& sha256, DownloadSink& sink);
+};
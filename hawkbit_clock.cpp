@@ -0,0 +1,38 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_clock.h"
+#include <algorithm>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+int64_t HawkbitClock::now()
+{
+    return esp_timer_get_time();
+}
+
+void HawkbitClock::sleep(uint32_t ms)
+{
+    // pdMS_TO_TICKS() multiplies in TickType_t and overflows for waits of
+    // an hour and more, e.g. a polling time of 12 hours
+    uint64_t ticks = (uint64_t) ms * configTICK_RATE_HZ / 1000;
+    while (ticks > 0) {
+        TickType_t step = (TickType_t) std::min<uint64_t>(ticks, 60 * configTICK_RATE_HZ);
+        vTaskDelay(step);
+        ticks -= step;
+    }
+}
+
+HawkbitClock& HawkbitClock::standard()
+{
+    static HawkbitClock clock;
+    return clock;
+}
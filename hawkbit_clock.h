@@ -0,0 +1,50 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Time source of a HawkbitClient: download timing, retry delays and the
+ * wait between polls. The default uses esp_timer and FreeRTOS delays.
+ */
+class HawkbitClock {
+    public:
+        virtual ~HawkbitClock() {}
+
+        // microseconds since an arbitrary start
+        virtual int64_t now();
+        virtual void sleep(uint32_t ms);
+
+        static HawkbitClock& standard();
+};
+
+/**
+ * Clock that only moves when told to. sleep() returns immediately and
+ * advances the time, so polling schedules, retries and backoff spanning
+ * days run in the time it takes to execute them, e.g. together with a
+ * ReplayTransport.
+ */
+class VirtualClock : public HawkbitClock {
+    public:
+        VirtualClock(int64_t start = 0) :
+            _now(start)
+        {
+        }
+
+        int64_t now() override { return this->_now; }
+        void sleep(uint32_t ms) override { this->_now += (int64_t) ms * 1000; }
+
+        void advance(int64_t us) { this->_now += us; }
+
+    private:
+        volatile int64_t _now;
+};
@@ -0,0 +1,489 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_ddi.h"
+#include "hawkbit_model.h"
+#include <stdlib.h>
+#include <ctype.h>
+
+// depth the array bitmask can track
+#define MAX_NESTING 64
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+#if HAWKBIT_DDI_BULK_SCAN
+// part of a string that is copied as is
+static bool isPlain(char c)
+{
+    return c != '"' && c != '\\' && (unsigned char)c >= 0x20;
+}
+#endif
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool DdiParser::feed(const char* data, size_t len)
+{
+    this->_fed += len;
+    if (this->_fed > this->_limits.document) {
+        return fail("TooLarge");
+    }
+
+    size_t i = 0;
+    while (i < len) {
+#if HAWKBIT_DDI_BULK_SCAN
+        // Runs of plain string characters (hrefs, hashes) and whitespace make
+        // up most of a response, take them in one step instead of through
+        // the state machine. The limit on the token still applies.
+        if (this->_state == S_STRING && this->_token.size() <= this->_limits.string && isPlain(data[i])) {
+            size_t run = i + 1;
+            size_t max = i + this->_limits.string + 1 - this->_token.size();
+            while (run < len && run < max && isPlain(data[run])) {
+                run++;
+            }
+            this->_token.append(data + i, run - i);
+            i = run;
+            continue;
+        }
+        // whitespace is skipped everywhere outside strings and literals
+        if ((this->_state < S_STRING || this->_state == S_AFTER || this->_state == S_DONE) && isSpace(data[i])) {
+            i++;
+            continue;
+        }
+#endif
+
+        if (!consume(data[i++])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DdiParser::finish()
+{
+    if (this->_state == S_ERROR) {
+        return false;
+    }
+    if (this->_state != S_DONE) {
+        return fail("IncompleteInput");
+    }
+    return true;
+}
+
+bool DdiParser::fail(const char* error)
+{
+    this->_state = S_ERROR;
+    this->_error = error;
+    return false;
+}
+
+bool DdiParser::consume(char c)
+{
+    // a character adds at most 4 bytes to the token
+    if (this->_token.size() > this->_limits.string) {
+        return fail("StringTooLong");
+    }
+
+    switch (this->_state) {
+        case S_ERROR:
+            return false;
+
+        case S_DONE:
+            return isSpace(c) || fail("InvalidInput");
+
+        case S_VALUE_OR_END:
+            if (c == ']') {
+                return end(true);
+            }
+            // fall through
+        case S_VALUE:
+            if (isSpace(c)) {
+                return true;
+            }
+            if (c == '{') {
+                return begin(false);
+            }
+            if (c == '[' && this->_depth > 0) {
+                return begin(true);
+            }
+            if (this->_depth == 0) {
+                return fail("InvalidInput");
+            }
+            if (c == '"') {
+                this->_isKey = false;
+                this->_token.clear();
+                this->_surrogate = 0;
+                this->_state = S_STRING;
+                return true;
+            }
+            if (c == '-' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) {
+                this->_token.assign(1, c);
+                this->_state = S_LITERAL;
+                return true;
+            }
+            return fail("InvalidInput");
+
+        case S_KEY_OR_END:
+            if (c == '}') {
+                return end(false);
+            }
+            // fall through
+        case S_KEY:
+            if (isSpace(c)) {
+                return true;
+            }
+            if (c == '"') {
+                this->_isKey = true;
+                this->_token.clear();
+                this->_surrogate = 0;
+                this->_state = S_STRING;
+                return true;
+            }
+            return fail("InvalidInput");
+
+        case S_COLON:
+            if (isSpace(c)) {
+                return true;
+            }
+            if (c == ':') {
+                this->_state = S_VALUE;
+                return true;
+            }
+            return fail("InvalidInput");
+
+        case S_STRING:
+            if (c == '\\') {
+                this->_state = S_ESCAPE;
+                return true;
+            }
+            if (c == '"') {
+                if (this->_isKey) {
+                    key();
+                    this->_state = S_COLON;
+                    return true;
+                }
+                this->_state = S_AFTER;
+                return value(true);
+            }
+            if ((unsigned char)c < 0x20) {
+                return fail("InvalidInput");
+            }
+            this->_token += c;
+            return true;
+
+        case S_ESCAPE:
+            this->_state = S_STRING;
+            switch (c) {
+                case '"':
+                case '\\':
+                case '/':
+                    this->_token += c;
+                    return true;
+                case 'b':
+                    this->_token += '\b';
+                    return true;
+                case 'f':
+                    this->_token += '\f';
+                    return true;
+                case 'n':
+                    this->_token += '\n';
+                    return true;
+                case 'r':
+                    this->_token += '\r';
+                    return true;
+                case 't':
+                    this->_token += '\t';
+                    return true;
+                case 'u':
+                    this->_unicode = 0;
+                    this->_unicodeDigits = 0;
+                    this->_state = S_UNICODE;
+                    return true;
+                default:
+                    return fail("InvalidInput");
+            }
+
+        case S_UNICODE: {
+            int digit = hexDigit(c);
+            if (digit < 0) {
+                return fail("InvalidInput");
+            }
+            this->_unicode = (this->_unicode << 4) | digit;
+            if (++this->_unicodeDigits < 4) {
+                return true;
+            }
+
+            this->_state = S_STRING;
+            if (this->_unicode >= 0xD800 && this->_unicode < 0xDC00) {
+                // high surrogate, combined with the following \u escape
+                this->_surrogate = this->_unicode;
+                return true;
+            }
+            if (this->_unicode >= 0xDC00 && this->_unicode < 0xE000 && this->_surrogate) {
+                appendUtf8(0x10000 + ((this->_surrogate - 0xD800) << 10) + (this->_unicode - 0xDC00));
+            } else {
+                appendUtf8(this->_unicode);
+            }
+            this->_surrogate = 0;
+            return true;
+        }
+
+        case S_LITERAL:
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '+' || c == '-' || c == '.') {
+                this->_token += c;
+                return true;
+            }
+            if (isalpha((unsigned char)this->_token[0]) && this->_token != "true" && this->_token != "false" && this->_token != "null") {
+                return fail("InvalidInput");
+            }
+            this->_state = S_AFTER;
+            return value(false) && consume(c);
+
+        case S_AFTER:
+            if (isSpace(c)) {
+                return true;
+            }
+            if (c == ',') {
+                this->_state = isArray(this->_depth - 1) ? S_VALUE : S_KEY;
+                return true;
+            }
+            if (c == '}') {
+                return end(false);
+            }
+            if (c == ']') {
+                return end(true);
+            }
+            return fail("InvalidInput");
+    }
+
+    return fail("InvalidInput");
+}
+
+void DdiParser::appendUtf8(uint32_t codepoint)
+{
+    if (codepoint < 0x80) {
+        this->_token += (char)codepoint;
+    } else if (codepoint < 0x800) {
+        this->_token += (char)(0xC0 | (codepoint >> 6));
+        this->_token += (char)(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        this->_token += (char)(0xE0 | (codepoint >> 12));
+        this->_token += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        this->_token += (char)(0x80 | (codepoint & 0x3F));
+    } else {
+        this->_token += (char)(0xF0 | (codepoint >> 18));
+        this->_token += (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        this->_token += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        this->_token += (char)(0x80 | (codepoint & 0x3F));
+    }
+}
+
+bool DdiParser::at(std::initializer_list<uint8_t> path) const
+{
+    if (path.size() != this->_depth || this->_depth > HAWKBIT_DDI_MAX_DEPTH) {
+        return false;
+    }
+
+    size_t i = 0;
+    for (uint8_t key : path) {
+        if (key != K_ANY && key != this->_path[i]) {
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+bool DdiParser::begin(bool array)
+{
+    if (this->_depth >= MAX_NESTING || this->_depth >= this->_limits.nesting) {
+        return fail("TooDeep");
+    }
+
+    bool inArray = this->_depth > 0 && isArray(this->_depth - 1);
+    if (!array && !inArray && this->_depth > 0 && this->_depth <= HAWKBIT_DDI_MAX_DEPTH && this->_path[this->_depth - 1] == K_LINKS) {
+        // entering one of the _links, remember its name for the href
+        this->_linkName = this->_name;
+    }
+
+    if (this->_depth < HAWKBIT_DDI_MAX_DEPTH) {
+        this->_path[this->_depth] = this->_depth == 0 ? K_ROOT : (inArray ? K_ITEM : this->_key);
+    }
+    if (array) {
+        this->_arrays |= (uint64_t)1 << this->_depth;
+    } else {
+        this->_arrays &= ~((uint64_t)1 << this->_depth);
+    }
+
+    this->_depth++;
+    this->_key = K_OTHER;
+    this->_state = array ? S_VALUE_OR_END : S_KEY_OR_END;
+    return true;
+}
+
+bool DdiParser::end(bool array)
+{
+    if (this->_depth == 0 || isArray(this->_depth - 1) != array) {
+        return fail("InvalidInput");
+    }
+
+    if (!array && this->_document == DEPLOYMENT) {
+        if (at({ K_ROOT, K_DEPLOYMENT, K_CHUNKS, K_ITEM, K_ARTIFACTS, K_ITEM })) {
+            if (this->_artifacts.size() >= this->_limits.artifacts) {
+                return fail("TooManyArtifacts");
+            }
+            this->_artifacts.push_back(Artifact(this->_filename, this->_size, this->_hashes, this->_artifactLinks));
+            this->_filename.clear();
+            this->_size = 0;
+            this->_hashes.clear();
+            this->_artifactLinks.clear();
+        } else if (at({ K_ROOT, K_DEPLOYMENT, K_CHUNKS, K_ITEM })) {
+            if (this->_chunks.size() >= this->_limits.chunks) {
+                return fail("TooManyChunks");
+            }
+            this->_chunks.push_back(Chunk(this->_part, this->_version, this->_chunkName, this->_artifacts));
+            this->_part.clear();
+            this->_version.clear();
+            this->_chunkName.clear();
+            this->_artifacts.clear();
+        }
+    }
+
+    this->_depth--;
+    this->_state = this->_depth == 0 ? S_DONE : S_AFTER;
+    return true;
+}
+
+void DdiParser::key()
+{
+    static const struct {
+        const char* name;
+        uint8_t key;
+    } KEYS[] = {
+        { "config", K_CONFIG },
+        { "polling", K_POLLING },
+        { "sleep", K_SLEEP },
+        { "_links", K_LINKS },
+        { "href", K_HREF },
+        { "id", K_ID },
+        { "deployment", K_DEPLOYMENT },
+        { "download", K_DOWNLOAD },
+        { "update", K_UPDATE },
+        { "chunks", K_CHUNKS },
+        { "part", K_PART },
+        { "version", K_VERSION },
+        { "name", K_NAME },
+        { "artifacts", K_ARTIFACTS },
+        { "filename", K_FILENAME },
+        { "size", K_SIZE },
+        { "hashes", K_HASHES },
+        { "cancelAction", K_CANCEL_ACTION },
+        { "stopId", K_STOP_ID },
+    };
+
+    this->_name.swap(this->_token);
+    this->_key = K_OTHER;
+    for (const auto& k : KEYS) {
+        if (this->_name == k.name) {
+            this->_key = k.key;
+            break;
+        }
+    }
+}
+
+bool DdiParser::insert(std::map<std::string,std::string>& map, const std::string& key, size_t limit, const char* error)
+{
+    auto entry = map.find(key);
+    if (entry != map.end()) {
+        entry->second = this->_token;
+        return true;
+    }
+    if (map.size() >= limit) {
+        return fail(error);
+    }
+    map[key] = this->_token;
+    return true;
+}
+
+bool DdiParser::value(bool string)
+{
+    switch (this->_document) {
+        case CONTROLLER:
+            if (!string) {
+                break;
+            }
+            if (this->_key == K_SLEEP && at({ K_ROOT, K_CONFIG, K_POLLING })) {
+                this->_sleep = this->_token;
+            } else if (this->_key == K_HREF && at({ K_ROOT, K_LINKS, K_ANY })) {
+                return insert(this->_links, this->_linkName, this->_limits.links, "TooManyLinks");
+            }
+            break;
+
+        case DEPLOYMENT:
+            if (this->_depth < 4) {
+                if (string && this->_key == K_ID && at({ K_ROOT })) {
+                    this->_id = this->_token;
+                } else if (string && this->_key == K_DOWNLOAD && at({ K_ROOT, K_DEPLOYMENT })) {
+                    this->_download = this->_token;
+                } else if (string && this->_key == K_UPDATE && at({ K_ROOT, K_DEPLOYMENT })) {
+                    this->_update = this->_token;
+                }
+            } else if (at({ K_ROOT, K_DEPLOYMENT, K_CHUNKS, K_ITEM })) {
+                if (!string) {
+                    break;
+                }
+                if (this->_key == K_PART) {
+                    this->_part = this->_token;
+                } else if (this->_key == K_VERSION) {
+                    this->_version = this->_token;
+                } else if (this->_key == K_NAME) {
+                    this->_chunkName = this->_token;
+                }
+            } else if (at({ K_ROOT, K_DEPLOYMENT, K_CHUNKS, K_ITEM, K_ARTIFACTS, K_ITEM })) {
+                if (string && this->_key == K_FILENAME) {
+                    this->_filename = this->_token;
+                } else if (!string && this->_key == K_SIZE) {
+                    this->_size = strtoul(this->_token.c_str(), NULL, 10);
+                }
+            } else if (at({ K_ROOT, K_DEPLOYMENT, K_CHUNKS, K_ITEM, K_ARTIFACTS, K_ITEM, K_HASHES })) {
+                if (string) {
+                    return insert(this->_hashes, this->_name, this->_limits.hashes, "TooManyHashes");
+                }
+            } else if (string && this->_key == K_HREF && at({ K_ROOT, K_DEPLOYMENT, K_CHUNKS, K_ITEM, K_ARTIFACTS, K_ITEM, K_LINKS, K_ANY })) {
+                return insert(this->_artifactLinks, this->_linkName, this->_limits.links, "TooManyLinks");
+            }
+            break;
+
+        case CANCEL:
+            if (string && this->_key == K_STOP_ID && at({ K_ROOT, K_CANCEL_ACTION })) {
+                this->_id = this->_token;
+            }
+            break;
+    }
+    return true;
+}
+
+Deployment DdiParser::deployment() const
+{
+    return Deployment(this->_id, this->_download, this->_update, this->_chunks);
+}
+
+Stop DdiParser::stop() const
+{
+    return Stop(this->_id);
+}
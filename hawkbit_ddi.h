@@ -0,0 +1,191 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <list>
+#include <initializer_list>
+#include <stdint.h>
+
+// Nesting tracked by the parser, members below it are skipped. The deepest
+// DDI path (deployment.chunks[].artifacts[]._links.<name>.href) needs 8.
+#ifndef HAWKBIT_DDI_MAX_DEPTH
+#define HAWKBIT_DDI_MAX_DEPTH 8
+#endif
+
+// Take runs of plain string characters and whitespace in one step instead of
+// through the state machine. 0 gives the per character reference the host
+// tests compare against (see test/).
+#ifndef HAWKBIT_DDI_BULK_SCAN
+#define HAWKBIT_DDI_BULK_SCAN 1
+#endif
+
+// Default DdiLimits. Responses beyond them are rejected while they are
+// parsed, so neither parse time nor the model can grow with the input.
+#ifndef HAWKBIT_DDI_MAX_DOCUMENT
+#define HAWKBIT_DDI_MAX_DOCUMENT (64 * 1024)
+#endif
+
+#ifndef HAWKBIT_DDI_MAX_NESTING
+#define HAWKBIT_DDI_MAX_NESTING 32
+#endif
+
+#ifndef HAWKBIT_DDI_MAX_STRING
+#define HAWKBIT_DDI_MAX_STRING 1024
+#endif
+
+#ifndef HAWKBIT_DDI_MAX_CHUNKS
+#define HAWKBIT_DDI_MAX_CHUNKS 8
+#endif
+
+#ifndef HAWKBIT_DDI_MAX_ARTIFACTS
+#define HAWKBIT_DDI_MAX_ARTIFACTS 8
+#endif
+
+#ifndef HAWKBIT_DDI_MAX_LINKS
+#define HAWKBIT_DDI_MAX_LINKS 8
+#endif
+
+#ifndef HAWKBIT_DDI_MAX_HASHES
+#define HAWKBIT_DDI_MAX_HASHES 4
+#endif
+
+class Artifact;
+class Chunk;
+class Deployment;
+class Stop;
+
+/**
+ * Bounds enforced by DdiParser.
+ */
+struct DdiLimits {
+    // bytes of the whole response
+    size_t document = HAWKBIT_DDI_MAX_DOCUMENT;
+    // nesting of arrays and objects, at most 64
+    size_t nesting = HAWKBIT_DDI_MAX_NESTING;
+    // of any key or value, after unescaping
+    size_t string = HAWKBIT_DDI_MAX_STRING;
+    size_t chunks = HAWKBIT_DDI_MAX_CHUNKS;
+    // per chunk
+    size_t artifacts = HAWKBIT_DDI_MAX_ARTIFACTS;
+    // per _links object
+    size_t links = HAWKBIT_DDI_MAX_LINKS;
+    // per artifact
+    size_t hashes = HAWKBIT_DDI_MAX_HASHES;
+};
+
+/**
+ * Streaming parser for the DDI responses the client reads.
+ *
+ * The response is fed in arbitrary pieces as it arrives from the network and
+ * the model is built directly from the parse events, only the members the
+ * client uses are kept. Nesting is tracked in a fixed stack of
+ * HAWKBIT_DDI_MAX_DEPTH frames. Input exceeding the DdiLimits fails with
+ * an error like "TooManyChunks" as soon as the limit is hit.
+ */
+class DdiParser {
+    public:
+        typedef enum { CONTROLLER, DEPLOYMENT, CANCEL } Document;
+
+        DdiParser(Document document, const DdiLimits& limits = DdiLimits()) :
+            _document(document),
+            _limits(limits)
+        {
+        }
+
+        /**
+         * Parse the next piece of the response.
+         * @return false once the input is not valid JSON
+         */
+        bool feed(const char* data, size_t len);
+
+        /**
+         * @return true if a complete JSON document was parsed
+         */
+        bool finish();
+
+        Document document() const { return this->_document; }
+        const char* error() const { return this->_error; }
+
+        // CONTROLLER: config.polling.sleep and the hrefs of _links
+        const std::string& pollingSleep() const { return this->_sleep; }
+        const std::map<std::string,std::string>& links() const { return this->_links; }
+
+        // DEPLOYMENT
+        Deployment deployment() const;
+
+        // CANCEL
+        Stop stop() const;
+
+    private:
+        typedef enum {
+            S_VALUE, S_VALUE_OR_END, S_KEY, S_KEY_OR_END, S_COLON,
+            S_STRING, S_ESCAPE, S_UNICODE, S_LITERAL, S_AFTER, S_DONE, S_ERROR
+        } ParseState;
+
+        typedef enum {
+            K_OTHER, K_ROOT, K_ITEM, K_ANY,
+            K_CONFIG, K_POLLING, K_SLEEP, K_LINKS, K_HREF, K_ID,
+            K_DEPLOYMENT, K_DOWNLOAD, K_UPDATE, K_CHUNKS, K_PART, K_VERSION, K_NAME,
+            K_ARTIFACTS, K_FILENAME, K_SIZE, K_HASHES, K_CANCEL_ACTION, K_STOP_ID
+        } Key;
+
+        Document _document;
+        DdiLimits _limits;
+        size_t _fed = 0;
+        ParseState _state = S_VALUE;
+        bool _isKey = false;
+        uint32_t _unicode = 0;
+        uint8_t _unicodeDigits = 0;
+        uint32_t _surrogate = 0;
+        size_t _depth = 0;
+        // key each open container was entered by, and which of them are arrays
+        uint8_t _path[HAWKBIT_DDI_MAX_DEPTH];
+        uint64_t _arrays = 0;
+        uint8_t _key = K_OTHER;
+        std::string _name;
+        std::string _token;
+        const char* _error = NULL;
+
+        // model under construction
+        std::string _sleep;
+        std::map<std::string,std::string> _links;
+        std::string _linkName;
+
+        std::string _id;
+        std::string _download;
+        std::string _update;
+        std::list<Chunk> _chunks;
+
+        std::string _part;
+        std::string _version;
+        std::string _chunkName;
+        std::list<Artifact> _artifacts;
+
+        std::string _filename;
+        uint32_t _size = 0;
+        std::map<std::string,std::string> _hashes;
+        std::map<std::string,std::string> _artifactLinks;
+
+        bool consume(char c);
+        bool fail(const char* error);
+        void appendUtf8(uint32_t codepoint);
+
+        bool isArray(size_t depth) const { return (this->_arrays >> depth) & 1; }
+        bool begin(bool array);
+        bool end(bool array);
+        void key();
+        bool value(bool string);
+        bool insert(std::map<std::string,std::string>& map, const std::string& key, size_t limit, const char* error);
+
+        bool at(std::initializer_list<uint8_t> path) const;
+};
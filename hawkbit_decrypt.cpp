@@ -0,0 +1,199 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_decrypt.h"
+#include <algorithm>
+#include <string.h>
+#include "mbedtls/version.h"
+
+static const char* TAG = "hawkbit";
+
+static const char ENCRYPTED_MAGIC[4] = { 'H', 'B', 'G', 'C' };
+static const size_t IV_SIZE = 12;
+
+DecryptingSink::DecryptingSink(const uint8_t* key, size_t keyLen, DownloadSink& sink) :
+    _keyLen(keyLen),
+    _sink(sink)
+{
+    // a key of another length is rejected by begin()
+    memcpy(this->_key, key, std::min(keyLen, sizeof(this->_key)));
+    mbedtls_gcm_init(&this->_gcm);
+}
+
+DecryptingSink::~DecryptingSink()
+{
+    mbedtls_gcm_free(&this->_gcm);
+    memset(this->_key, 0, sizeof(this->_key));
+    delete this->_plain;
+}
+
+esp_err_t DecryptingSink::begin(const Artifact& artifact)
+{
+    if (artifact.size() < HEADER_SIZE + TAG_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (this->_keyLen != 16 && this->_keyLen != 24 && this->_keyLen != 32) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    this->_size = artifact.size();
+    this->_offset = 0;
+    this->_error = ESP_OK;
+
+    // hashes and size of the artifact describe the ciphertext
+    delete this->_plain;
+    this->_plain = new Artifact(artifact.filename(), artifact.size() - HEADER_SIZE - TAG_SIZE, {}, artifact.links());
+
+    esp_err_t err = this->_sink.begin(*this->_plain);
+    this->_begun = err == ESP_OK;
+    return err;
+}
+
+esp_err_t DecryptingSink::start()
+{
+    if (memcmp(this->_header, ENCRYPTED_MAGIC, sizeof(ENCRYPTED_MAGIC)) != 0) {
+        ESP_LOGE(TAG, "DecryptingSink: %s is not encrypted", this->_plain->filename().c_str());
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    const uint8_t* iv = this->_header + sizeof(ENCRYPTED_MAGIC);
+    this->_partialLen = 0;
+    mbedtls_gcm_free(&this->_gcm);
+    mbedtls_gcm_init(&this->_gcm);
+    if (mbedtls_gcm_setkey(&this->_gcm, MBEDTLS_CIPHER_ID_AES, this->_key, this->_keyLen * 8) != 0) {
+        return ESP_FAIL;
+    }
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    int ret = mbedtls_gcm_starts(&this->_gcm, MBEDTLS_GCM_DECRYPT, iv, IV_SIZE);
+#else
+    int ret = mbedtls_gcm_starts(&this->_gcm, MBEDTLS_GCM_DECRYPT, iv, IV_SIZE, NULL, 0);
+#endif
+    return ret == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t DecryptingSink::decrypt(const uint8_t* data, size_t len)
+{
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+    size_t outLen = 0;
+    if (mbedtls_gcm_update(&this->_gcm, data, len, this->_out, sizeof(this->_out), &outLen) != 0) {
+        return ESP_FAIL;
+    }
+#else
+    // mbedTLS 2.x takes multiples of 16 bytes in every update but the last,
+    // reads end anywhere, so the tail is held back for the next call
+    size_t outLen = 0;
+    if (this->_partialLen > 0) {
+        size_t n = std::min(len, sizeof(this->_partial) - this->_partialLen);
+        memcpy(this->_partial + this->_partialLen, data, n);
+        this->_partialLen += n;
+        data += n;
+        len -= n;
+        if (this->_partialLen < sizeof(this->_partial)) {
+            return ESP_OK;
+        }
+        if (mbedtls_gcm_update(&this->_gcm, sizeof(this->_partial), this->_partial, this->_out) != 0) {
+            return ESP_FAIL;
+        }
+        outLen = sizeof(this->_partial);
+        this->_partialLen = 0;
+    }
+
+    size_t whole = len - len % sizeof(this->_partial);
+    if (whole > 0 && mbedtls_gcm_update(&this->_gcm, whole, data, this->_out + outLen) != 0) {
+        return ESP_FAIL;
+    }
+    outLen += whole;
+    memcpy(this->_partial, data + whole, len - whole);
+    this->_partialLen = len - whole;
+#endif
+    return outLen > 0 ? this->_sink.write(this->_out, outLen) : ESP_OK;
+}
+
+esp_err_t DecryptingSink::write(const uint8_t* data, size_t len)
+{
+    const uint32_t cipherEnd = this->_size - TAG_SIZE;
+
+    while (len > 0 && this->_error == ESP_OK) {
+        size_t n;
+        if (this->_offset < HEADER_SIZE) {
+            n = std::min<size_t>(len, HEADER_SIZE - this->_offset);
+            memcpy(this->_header + this->_offset, data, n);
+            if (this->_offset + n == HEADER_SIZE) {
+                this->_error = start();
+            }
+        } else if (this->_offset < cipherEnd) {
+            n = std::min<size_t>(std::min<size_t>(len, cipherEnd - this->_offset), HAWKBIT_DECRYPT_BLOCK);
+            this->_error = decrypt(data, n);
+        } else if (this->_offset < this->_size) {
+            // the tag trails the ciphertext
+            n = std::min<size_t>(len, this->_size - this->_offset);
+            memcpy(this->_tag + (this->_offset - cipherEnd), data, n);
+        } else {
+            this->_error = ESP_ERR_INVALID_SIZE;
+            break;
+        }
+        this->_offset += n;
+        data += n;
+        len -= n;
+    }
+    return this->_error;
+}
+
+esp_err_t DecryptingSink::end(bool success)
+{
+    esp_err_t err = this->_error;
+    if (success && err == ESP_OK) {
+        uint8_t tag[TAG_SIZE];
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+        size_t outLen = 0;
+        int ret = mbedtls_gcm_finish(&this->_gcm, this->_out, sizeof(this->_out), &outLen, tag, sizeof(tag));
+        if (ret == 0 && outLen > 0) {
+            err = this->_sink.write(this->_out, outLen);
+        }
+#else
+        // the held back tail is the last update
+        int ret = 0;
+        if (this->_partialLen > 0) {
+            ret = mbedtls_gcm_update(&this->_gcm, this->_partialLen, this->_partial, this->_out);
+            if (ret == 0) {
+                err = this->_sink.write(this->_out, this->_partialLen);
+            }
+            this->_partialLen = 0;
+        }
+        if (ret == 0) {
+            ret = mbedtls_gcm_finish(&this->_gcm, tag, sizeof(tag));
+        }
+#endif
+        if (this->_offset != this->_size) {
+            err = ESP_ERR_INVALID_SIZE;
+        } else if (ret != 0) {
+            err = ESP_FAIL;
+        } else if (err == ESP_OK) {
+            // constant time, don't tell how much of the tag matched
+            uint8_t diff = 0;
+            for (size_t i = 0; i < TAG_SIZE; i++) {
+                diff |= tag[i] ^ this->_tag[i];
+            }
+            if (diff != 0) {
+                ESP_LOGE(TAG, "DecryptingSink: authentication of %s failed", this->_plain->filename().c_str());
+                err = ESP_ERR_INVALID_CRC;
+            }
+        }
+    }
+
+    esp_err_t endErr = ESP_OK;
+    if (this->_begun) {
+        endErr = this->_sink.end(success && err == ESP_OK);
+        this->_begun = false;
+    }
+    mbedtls_gcm_free(&this->_gcm);
+    mbedtls_gcm_init(&this->_gcm);
+    return err != ESP_OK ? err : endErr;
+}
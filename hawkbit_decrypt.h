@@ -0,0 +1,70 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include "hawkbit.h"
+#include "mbedtls/gcm.h"
+
+// Bytes decrypted per call into mbedTLS and handed on to the next sink
+#ifndef HAWKBIT_DECRYPT_BLOCK
+#define HAWKBIT_DECRYPT_BLOCK 1024
+#endif
+
+/**
+ * Decrypts an artifact encrypted with AES-GCM on the way to another sink,
+ * so the server and CDNs only ever store ciphertext (see
+ * tools/hawkbit_encrypt.py).
+ *
+ * Format: "HBGC", 12 byte IV, ciphertext, 16 byte tag. The sink after it
+ * sees the plaintext size, the hashes of the artifact are those of the
+ * ciphertext and not passed on. The tag is checked in end(), a mismatch ends
+ * the next sink unsuccessfully, so an OtaSink never activates a tampered
+ * image. mbedTLS uses the AES accelerator of the chip.
+ */
+class DecryptingSink : public DownloadSink {
+    public:
+        /**
+         * @param key AES key, copied, begin() fails unless it has 16, 24 or 32 bytes
+         * @param sink receives the plaintext
+         */
+        DecryptingSink(const uint8_t* key, size_t keyLen, DownloadSink& sink);
+        ~DecryptingSink();
+
+        DecryptingSink(const DecryptingSink&) = delete;
+        DecryptingSink& operator=(const DecryptingSink&) = delete;
+
+        esp_err_t begin(const Artifact& artifact) override;
+        esp_err_t write(const uint8_t* data, size_t len) override;
+        esp_err_t end(bool success) override;
+
+        static const size_t HEADER_SIZE = 16;
+        static const size_t TAG_SIZE = 16;
+
+    private:
+        uint8_t _key[32];
+        size_t _keyLen;
+        DownloadSink& _sink;
+        mbedtls_gcm_context _gcm;
+        Artifact* _plain = NULL;
+        bool _begun = false;
+        esp_err_t _error = ESP_OK;
+        uint32_t _size = 0;
+        uint32_t _offset = 0;
+        uint8_t _header[HEADER_SIZE];
+        uint8_t _tag[TAG_SIZE];
+        uint8_t _out[HAWKBIT_DECRYPT_BLOCK + 16];
+        // ciphertext not yet decrypted, only used with mbedTLS 2.x
+        uint8_t _partial[16];
+        size_t _partialLen = 0;
+
+        esp_err_t start();
+        esp_err_t decrypt(const uint8_t* data, size_t len);
+};
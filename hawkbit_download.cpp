@@ -0,0 +1,834 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_download.h"
+#include "hawkbit.h"
+#include "hawkbit_hash.h"
+#include "hawkbit_trace.h"
+#include <algorithm>
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_netif.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+static const char* TAG = "hawkbit";
+
+#define FLASH_SECTOR_SIZE 4096
+
+esp_err_t FlashSink::begin(const Artifact& artifact)
+{
+    this->_fill = 0;
+    this->_flushed = 0;
+#if !HAWKBIT_PREALLOCATE
+    this->_block.resize(this->_blockSize);
+#endif
+    return open(artifact);
+}
+
+esp_err_t FlashSink::write(const uint8_t* data, size_t len)
+{
+    while (len > 0) {
+        if (this->_fill == 0 && len >= this->_blockSize) {
+            // nothing buffered and at least one full block, hand it over without copying
+            size_t direct = len - (len % this->_blockSize);
+            esp_err_t err = writeBlock(data, direct);
+            if (err != ESP_OK) {
+                return err;
+            }
+            data += direct;
+            len -= direct;
+            continue;
+        }
+
+        size_t n = std::min(len, this->_blockSize - this->_fill);
+        memcpy(&this->_block[0] + this->_fill, data, n);
+        this->_fill += n;
+        data += n;
+        len -= n;
+
+        if (this->_fill == this->_blockSize) {
+            this->_fill = 0;
+            esp_err_t err = writeBlock(&this->_block[0], this->_blockSize);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t FlashSink::writeBlock(const uint8_t* data, size_t len)
+{
+    HAWKBIT_TRACE_BEGIN(FLASH_WRITE, std::min<size_t>(len, UINT16_MAX), this->_flushed);
+    esp_err_t err = flush(data, len);
+    HAWKBIT_TRACE_END(FLASH_WRITE, std::min<size_t>(len, UINT16_MAX), err);
+    this->_flushed += len;
+    return err;
+}
+
+esp_err_t FlashSink::end(bool success)
+{
+    esp_err_t err = ESP_OK;
+    if (success && this->_fill > 0) {
+        err = writeBlock(&this->_block[0], this->_fill);
+    }
+    this->_fill = 0;
+#if !HAWKBIT_PREALLOCATE
+    std::vector<uint8_t>().swap(this->_block);
+#endif
+
+    esp_err_t closeErr = close(success && err == ESP_OK);
+    return err != ESP_OK ? err : closeErr;
+}
+
+esp_err_t OtaSink::open(const Artifact& artifact)
+{
+    if (this->_partition == NULL) {
+        this->_partition = esp_ota_get_next_update_partition(NULL);
+    }
+    if (this->_partition == NULL) {
+        ESP_LOGE(TAG, "OtaSink: no OTA update partition available");
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (artifact.size() > this->_partition->size) {
+        ESP_LOGE(TAG, "OtaSink: %s (%u bytes) does not fit into %s", artifact.filename().c_str(), artifact.size(), this->_partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGI(TAG, "OtaSink: writing %s to %s, block size %u", artifact.filename().c_str(), this->_partition->label, this->blockSize());
+    return esp_ota_begin(this->_partition, OTA_WITH_SEQUENTIAL_WRITES, &this->_handle);
+}
+
+esp_err_t OtaSink::flush(const uint8_t* data, size_t len)
+{
+    return esp_ota_write(this->_handle, data, len);
+}
+
+esp_err_t OtaSink::close(bool success)
+{
+    if (!success) {
+        return esp_ota_abort(this->_handle);
+    }
+    return esp_ota_end(this->_handle);
+}
+
+esp_err_t PartitionSink::open(const Artifact& artifact)
+{
+    if (this->_partition == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (artifact.size() > this->_partition->size) {
+        ESP_LOGE(TAG, "PartitionSink: %s (%u bytes) does not fit into %s", artifact.filename().c_str(), artifact.size(), this->_partition->label);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGI(TAG, "PartitionSink: writing %s to %s, block size %u", artifact.filename().c_str(), this->_partition->label, this->blockSize());
+    this->_offset = 0;
+    size_t erase = (artifact.size() + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    return esp_partition_erase_range(this->_partition, 0, erase);
+}
+
+esp_err_t PartitionSink::flush(const uint8_t* data, size_t len)
+{
+    esp_err_t err = esp_partition_write(this->_partition, this->_offset, data, len);
+    this->_offset += len;
+    return err;
+}
+
+esp_err_t PartitionSink::close(bool success)
+{
+    return ESP_OK;
+}
+
+HashingSink::HashingSink(DownloadSink& sink, bool required) :
+    _sink(sink),
+    _required(required),
+    _hash(new ArtifactHash())
+{
+}
+
+HashingSink::~HashingSink()
+{
+    delete this->_hash;
+}
+
+esp_err_t HashingSink::begin(const Artifact& artifact)
+{
+    this->_filename = artifact.filename();
+    if (this->_hash->begin(artifact.hashes()) == 0 && this->_required) {
+        ESP_LOGE(TAG, "HashingSink: %s has no known hash", this->_filename.c_str());
+        return ESP_ERR_NOT_FOUND;
+    }
+    return this->_sink.begin(artifact);
+}
+
+esp_err_t HashingSink::write(const uint8_t* data, size_t len)
+{
+    this->_hash->update(data, len);
+    return this->_sink.write(data, len);
+}
+
+esp_err_t HashingSink::end(bool success)
+{
+    esp_err_t err = ESP_OK;
+    if (success) {
+        const char* mismatch = this->_hash->verify();
+        if (mismatch) {
+            ESP_LOGE(TAG, "HashingSink: %s mismatch for %s", mismatch, this->_filename.c_str());
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    esp_err_t endErr = this->_sink.end(success && err == ESP_OK);
+    return err != ESP_OK ? err : endErr;
+}
+
+TeeSink::~TeeSink()
+{
+    stop();
+    for (Output* output : this->_outputs) {
+        delete output->hash;
+        delete output;
+    }
+}
+
+void TeeSink::add(DownloadSink& sink, bool required)
+{
+    Output* output = new Output();
+    output->tee = this;
+    output->sink = &sink;
+    output->required = required;
+    output->begun = false;
+    output->error = ESP_OK;
+    output->hash = new Sha256();
+    output->jobs = NULL;
+    output->done = NULL;
+    this->_outputs.push_back(output);
+}
+
+esp_err_t TeeSink::begin(const Artifact& artifact)
+{
+    this->_memory = (uint8_t*) malloc(this->_bufferSize * this->_depth);
+    this->_free = xQueueCreate(this->_depth, sizeof(uint8_t));
+    if (this->_memory == NULL || this->_free == NULL) {
+        stop();
+        return ESP_ERR_NO_MEM;
+    }
+    this->_users.assign(this->_depth, 0);
+    for (size_t i = 0; i < this->_depth; i++) {
+        uint8_t buffer = i;
+        xQueueSend(this->_free, &buffer, 0);
+    }
+
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < this->_outputs.size(); i++) {
+        Output* output = this->_outputs[i];
+        output->error = ESP_OK;
+        output->sha256.clear();
+        output->hash->reset();
+
+        output->jobs = xQueueCreate(this->_depth + 1, sizeof(Job));
+        output->done = xSemaphoreCreateBinary();
+        if (output->jobs == NULL || output->done == NULL ||
+            xTaskCreate(writer, "hawkbit_tee", HAWKBIT_DOWNLOAD_WRITER_STACK, output, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+            if (output->jobs) vQueueDelete(output->jobs);
+            if (output->done) vSemaphoreDelete(output->done);
+            output->jobs = NULL;
+            output->done = NULL;
+            err = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        output->error = output->sink->begin(artifact);
+        output->begun = output->error == ESP_OK;
+        if (output->error != ESP_OK) {
+            ESP_LOGW(TAG, "TeeSink: sink %u rejected %s: %s", i, artifact.filename().c_str(), esp_err_to_name(output->error));
+            if (output->required) {
+                err = output->error;
+                break;
+            }
+        }
+    }
+
+    if (err != ESP_OK) {
+        end(false);
+    }
+    return err;
+}
+
+esp_err_t TeeSink::write(const uint8_t* data, size_t len)
+{
+    while (len > 0) {
+        uint8_t users = 0;
+        for (Output* output : this->_outputs) {
+            if (output->error != ESP_OK && output->required) {
+                return output->error;
+            }
+            if (output->error == ESP_OK) {
+                users++;
+            }
+        }
+        if (users == 0) {
+            // only optional sinks and all of them failed
+            return ESP_OK;
+        }
+
+        uint8_t buffer;
+        xQueueReceive(this->_free, &buffer, portMAX_DELAY);
+        size_t n = std::min(len, this->_bufferSize);
+        memcpy(this->_memory + buffer * this->_bufferSize, data, n);
+        data += n;
+        len -= n;
+
+        // count the users before handing out the buffer, fast writers may finish right away
+        this->_users[buffer] = users;
+        Job job = { buffer, n };
+        for (Output* output : this->_outputs) {
+            if (output->error == ESP_OK && users > 0) {
+                users--;
+                xQueueSend(output->jobs, &job, portMAX_DELAY);
+            }
+        }
+        while (users-- > 0) {
+            // a sink failed in the meantime
+            release(buffer);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t TeeSink::end(bool success)
+{
+    stop();
+
+    esp_err_t err = ESP_OK;
+    for (Output* output : this->_outputs) {
+        if (output->begun) {
+            esp_err_t endErr = output->sink->end(success && output->error == ESP_OK);
+            if (output->error == ESP_OK) {
+                output->error = endErr;
+            }
+            output->begun = false;
+        }
+        if (output->error == ESP_OK) {
+            output->sha256 = output->hash->finishHex();
+        }
+        if (output->required && output->error != ESP_OK && err == ESP_OK) {
+            err = output->error;
+        }
+    }
+    return err;
+}
+
+void TeeSink::release(uint8_t buffer)
+{
+    portENTER_CRITICAL(&this->_lock);
+    bool last = --this->_users[buffer] == 0;
+    portEXIT_CRITICAL(&this->_lock);
+    if (last) {
+        xQueueSend(this->_free, &buffer, portMAX_DELAY);
+    }
+}
+
+void TeeSink::stop()
+{
+    for (Output* output : this->_outputs) {
+        if (output->jobs == NULL) {
+            continue;
+        }
+        Job stop = { 0, 0 };
+        xQueueSend(output->jobs, &stop, portMAX_DELAY);
+        xSemaphoreTake(output->done, portMAX_DELAY);
+        vQueueDelete(output->jobs);
+        vSemaphoreDelete(output->done);
+        output->jobs = NULL;
+        output->done = NULL;
+    }
+
+    if (this->_free != NULL) {
+        vQueueDelete(this->_free);
+        this->_free = NULL;
+    }
+    free(this->_memory);
+    this->_memory = NULL;
+}
+
+void TeeSink::writer(void* arg)
+{
+    Output* output = (Output*) arg;
+    TeeSink* tee = output->tee;
+
+    Job job;
+    while (xQueueReceive(output->jobs, &job, portMAX_DELAY) == pdTRUE && job.len > 0) {
+        if (output->error == ESP_OK) {
+            const uint8_t* data = tee->_memory + job.buffer * tee->_bufferSize;
+            output->hash->update(data, job.len);
+            esp_err_t err = output->sink->write(data, job.len);
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "TeeSink: write failed: %s", esp_err_to_name(err));
+                output->error = err;
+            }
+        }
+        tee->release(job.buffer);
+    }
+
+    xSemaphoreGive(output->done);
+    vTaskDelete(NULL);
+}
+
+static const char* NETWORK_KEYS[] = { "tune_other", "tune_wifi", "tune_eth", "tune_cell" };
+
+DownloadAutotuner::NetworkType DownloadAutotuner::currentNetwork()
+{
+    esp_netif_t* netif = esp_netif_get_default_netif();
+    if (netif == NULL) {
+        return UNKNOWN;
+    }
+
+    const char* key = esp_netif_get_ifkey(netif);
+    if (key == NULL) {
+        return UNKNOWN;
+    }
+    if (strncmp(key, "WIFI", 4) == 0) {
+        return WIFI;
+    }
+    if (strncmp(key, "ETH", 3) == 0) {
+        return ETHERNET;
+    }
+    if (strncmp(key, "PPP", 3) == 0) {
+        return CELLULAR;
+    }
+    return UNKNOWN;
+}
+
+void DownloadAutotuner::begin(uint32_t size)
+{
+    this->_network = currentNetwork();
+    this->_probing = false;
+    this->_tuned = false;
+    this->_index = -1;
+    this->_count = 0;
+
+    if (!this->_enabled) {
+        this->_bufferSize = HAWKBIT_DOWNLOAD_MIN_READ_SIZE;
+        this->_maxDepth = 1;
+        this->_current = { HAWKBIT_DOWNLOAD_MIN_READ_SIZE, 1 };
+        return;
+    }
+
+#if HAWKBIT_PREALLOCATE
+    size_t limit = HAWKBIT_DOWNLOAD_MEMORY_LIMIT;
+#else
+    size_t limit = std::min<size_t>(HAWKBIT_DOWNLOAD_MEMORY_LIMIT, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / 2);
+#endif
+    this->_bufferSize = HAWKBIT_DOWNLOAD_MAX_READ_SIZE;
+    while (this->_bufferSize > HAWKBIT_DOWNLOAD_MIN_READ_SIZE && this->_bufferSize > limit) {
+        this->_bufferSize /= 2;
+    }
+    this->_maxDepth = std::max<size_t>(1, std::min<size_t>(HAWKBIT_DOWNLOAD_MAX_DEPTH, limit / this->_bufferSize));
+
+    Setting setting;
+    if (recall(setting)) {
+        this->_current.readSize = std::min<size_t>(setting.readSize, this->_bufferSize);
+        this->_current.depth = std::min<size_t>(setting.depth, this->_maxDepth);
+        ESP_LOGI(TAG, "Autotune: using read size %u, depth %u", this->_current.readSize, this->_current.depth);
+        return;
+    }
+
+    // without measurements, prefer the largest reads that fit
+    this->_current = { (uint16_t)this->_bufferSize, 1 };
+
+    const size_t capacity = sizeof(this->_candidates) / sizeof(this->_candidates[0]);
+    for (size_t readSize = HAWKBIT_DOWNLOAD_MIN_READ_SIZE; readSize <= this->_bufferSize && this->_count < capacity / 2; readSize *= 2) {
+        this->_candidates[this->_count++] = { (uint16_t)readSize, 1 };
+    }
+    this->_readSizes = this->_count;
+
+    // one warm-up window plus one for every read size and every depth
+    size_t windows = 1 + this->_readSizes;
+    for (size_t depth = 2; depth <= this->_maxDepth; depth *= 2) {
+        windows++;
+    }
+    if (size < 2 * windows * HAWKBIT_AUTOTUNE_WINDOW) {
+        this->_count = 0;
+        return;
+    }
+
+    this->_probing = true;
+    this->_windowBytes = 0;
+    this->_windowStart = esp_timer_get_time();
+}
+
+bool DownloadAutotuner::update(size_t bytes)
+{
+    if (!this->_probing) {
+        return false;
+    }
+
+    this->_windowBytes += bytes;
+    if (this->_windowBytes < HAWKBIT_AUTOTUNE_WINDOW) {
+        return false;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed = std::max<int64_t>(1, now - this->_windowStart);
+    if (this->_index >= 0) {
+        this->_rates[this->_index] = (uint32_t)(this->_windowBytes * 1000000LL / elapsed);
+        ESP_LOGD(TAG, "Autotune: read size %u, depth %u: %u bytes/s", this->_candidates[this->_index].readSize, this->_candidates[this->_index].depth, this->_rates[this->_index]);
+    }
+    this->_index++;
+
+    if (this->_index == (int)this->_readSizes) {
+        // read sizes done, try deeper pipelines with the fastest one
+        uint16_t readSize = this->_candidates[best(0, this->_readSizes)].readSize;
+        const size_t capacity = sizeof(this->_candidates) / sizeof(this->_candidates[0]);
+        for (size_t depth = 2; depth <= this->_maxDepth && this->_count < capacity; depth *= 2) {
+            this->_candidates[this->_count++] = { readSize, (uint8_t)depth };
+        }
+    }
+
+    if (this->_index == (int)this->_count) {
+        this->_current = this->_candidates[best(0, this->_count)];
+        this->_probing = false;
+        this->_tuned = true;
+        ESP_LOGI(TAG, "Autotune: selected read size %u, depth %u", this->_current.readSize, this->_current.depth);
+    } else {
+        this->_current = this->_candidates[this->_index];
+    }
+
+    this->_windowBytes = 0;
+    this->_windowStart = now;
+    return true;
+}
+
+void DownloadAutotuner::end(bool success)
+{
+    if (success && this->_tuned) {
+        remember(this->_current);
+    }
+    this->_probing = false;
+}
+
+size_t DownloadAutotuner::best(size_t from, size_t to) const
+{
+    size_t result = from;
+    for (size_t i = from; i < to; i++) {
+        if (this->_rates[i] > this->_rates[result]) {
+            result = i;
+        }
+    }
+    return result;
+}
+
+static struct {
+    bool valid;
+    uint16_t readSize;
+    uint8_t depth;
+} s_remembered[4];
+
+bool DownloadAutotuner::recall(Setting& setting) const
+{
+    if (!s_remembered[this->_network].valid) {
+        nvs_handle_t nvs;
+        if (nvs_open("hawkbit", NVS_READONLY, &nvs) != ESP_OK) {
+            return false;
+        }
+        size_t len = sizeof(Setting);
+        esp_err_t err = nvs_get_blob(nvs, NETWORK_KEYS[this->_network], &setting, &len);
+        nvs_close(nvs);
+        if (err != ESP_OK || len != sizeof(Setting) || setting.readSize == 0 || setting.depth == 0) {
+            return false;
+        }
+        s_remembered[this->_network] = { true, setting.readSize, setting.depth };
+    }
+
+    setting.readSize = s_remembered[this->_network].readSize;
+    setting.depth = s_remembered[this->_network].depth;
+    return true;
+}
+
+void DownloadAutotuner::remember(const Setting& setting) const
+{
+    s_remembered[this->_network] = { true, setting.readSize, setting.depth };
+
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, NETWORK_KEYS[this->_network], &setting, sizeof(Setting)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+DownloadPipeline::~DownloadPipeline()
+{
+    finish();
+}
+
+#if HAWKBIT_PREALLOCATE
+static bool s_pipelineBusy = false;
+static portMUX_TYPE s_pipelineLock = portMUX_INITIALIZER_UNLOCKED;
+
+// The writer task with its queues is created by the first download and
+// serves all later ones. Deleting a task with a static TCB and creating it
+// again before the idle task cleaned up the old one corrupts the kernel's
+// task lists.
+static QueueHandle_t s_full = NULL;
+static DownloadPipeline* volatile s_pipeline = NULL;
+#endif
+
+esp_err_t DownloadPipeline::start(size_t bufferSize, size_t maxDepth, size_t depth)
+{
+#if HAWKBIT_PREALLOCATE
+    static uint8_t buffers[HAWKBIT_DOWNLOAD_MEMORY_LIMIT];
+
+    bool busy;
+    portENTER_CRITICAL(&s_pipelineLock);
+    busy = s_pipelineBusy || bufferSize * maxDepth > sizeof(buffers) || maxDepth > HAWKBIT_DOWNLOAD_MAX_DEPTH;
+    if (!busy) {
+        s_pipelineBusy = true;
+    }
+    portEXIT_CRITICAL(&s_pipelineLock);
+    if (busy) {
+        ESP_LOGE(TAG, "Download buffers in use or too small");
+        return ESP_ERR_INVALID_STATE;
+    }
+    this->_memory = buffers;
+#else
+    this->_memory = (uint8_t*) malloc(bufferSize * maxDepth);
+    if (this->_memory == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate %u download buffers of %u bytes", maxDepth, bufferSize);
+        return ESP_ERR_NO_MEM;
+    }
+#endif
+    this->_bufferSize = bufferSize;
+    this->_maxDepth = maxDepth;
+    this->_depth = 1;
+    this->_error = ESP_OK;
+    this->_writeTime = 0;
+
+    if (maxDepth < 2) {
+        return ESP_OK;
+    }
+
+#if HAWKBIT_PREALLOCATE
+    static StaticQueue_t freeQueue;
+    static StaticQueue_t fullQueue;
+    static uint8_t freeStorage[HAWKBIT_DOWNLOAD_MAX_DEPTH * sizeof(uint8_t*)];
+    static uint8_t fullStorage[HAWKBIT_DOWNLOAD_MAX_DEPTH * sizeof(Job)];
+    static StaticSemaphore_t doneSemaphore;
+    static StaticTask_t task;
+    static StackType_t stack[HAWKBIT_DOWNLOAD_WRITER_STACK];
+    static QueueHandle_t freeHandle = NULL;
+    static SemaphoreHandle_t doneHandle = NULL;
+    static bool started = false;
+
+    if (!started) {
+        freeHandle = xQueueCreateStatic(HAWKBIT_DOWNLOAD_MAX_DEPTH, sizeof(uint8_t*), freeStorage, &freeQueue);
+        s_full = xQueueCreateStatic(HAWKBIT_DOWNLOAD_MAX_DEPTH, sizeof(Job), fullStorage, &fullQueue);
+        doneHandle = xSemaphoreCreateBinaryStatic(&doneSemaphore);
+        started = xTaskCreateStatic(writer, "hawkbit_writer", HAWKBIT_DOWNLOAD_WRITER_STACK, NULL, uxTaskPriorityGet(NULL), stack, &task) != NULL;
+    }
+    if (started) {
+        s_pipeline = this;
+        this->_free = freeHandle;
+        this->_full = s_full;
+        this->_done = doneHandle;
+    }
+#else
+    this->_free = xQueueCreate(maxDepth, sizeof(uint8_t*));
+    this->_full = xQueueCreate(maxDepth, sizeof(Job));
+    this->_done = xSemaphoreCreateBinary();
+    bool started = this->_free != NULL && this->_full != NULL && this->_done != NULL &&
+        xTaskCreate(writer, "hawkbit_writer", HAWKBIT_DOWNLOAD_WRITER_STACK, this, uxTaskPriorityGet(NULL), NULL) == pdPASS;
+#endif
+    if (!started) {
+        // run synchronously instead
+        ESP_LOGW(TAG, "Failed to start download writer, continuing without pipelining");
+#if !HAWKBIT_PREALLOCATE
+        if (this->_free) vQueueDelete(this->_free);
+        if (this->_full) vQueueDelete(this->_full);
+        if (this->_done) vSemaphoreDelete(this->_done);
+#endif
+        this->_free = this->_full = this->_done = NULL;
+        this->_maxDepth = 1;
+        return ESP_OK;
+    }
+
+    uint8_t* buffer = this->_memory;
+    xQueueSend(this->_free, &buffer, 0);
+    return resize(depth);
+}
+
+uint8_t* DownloadPipeline::acquire()
+{
+    if (this->_free == NULL) {
+        return this->_memory;
+    }
+
+    uint8_t* buffer = NULL;
+    xQueueReceive(this->_free, &buffer, portMAX_DELAY);
+    return buffer;
+}
+
+void DownloadPipeline::release(uint8_t* buffer)
+{
+    if (this->_free != NULL) {
+        xQueueSend(this->_free, &buffer, portMAX_DELAY);
+    }
+}
+
+esp_err_t DownloadPipeline::submit(uint8_t* buffer, size_t len)
+{
+    if (this->_error != ESP_OK) {
+        release(buffer);
+        return this->_error;
+    }
+
+    if (this->_depth < 2) {
+        esp_err_t err = write(buffer, len);
+        release(buffer);
+        return err;
+    }
+
+    Job job = { buffer, len };
+    xQueueSend(this->_full, &job, portMAX_DELAY);
+    return this->_error;
+}
+
+esp_err_t DownloadPipeline::write(const uint8_t* data, size_t len)
+{
+    // only ever called from one task at a time, the writer or the submitting one
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = this->_sink.write(data, len);
+    this->_writeTime += esp_timer_get_time() - start;
+    return err;
+}
+
+void DownloadPipeline::drain(uint8_t** buffers)
+{
+    // all buffers of the current depth back in hand means the writer is idle
+    for (size_t i = 0; i < this->_depth; i++) {
+        xQueueReceive(this->_free, &buffers[i], portMAX_DELAY);
+    }
+}
+
+esp_err_t DownloadPipeline::resize(size_t depth)
+{
+    if (this->_free == NULL) {
+        return this->_error;
+    }
+
+    uint8_t* buffers[HAWKBIT_DOWNLOAD_MAX_DEPTH];
+    drain(buffers);
+
+    this->_depth = std::max<size_t>(1, std::min(depth, this->_maxDepth));
+    for (size_t i = 0; i < this->_depth; i++) {
+        uint8_t* buffer = this->_memory + i * this->_bufferSize;
+        xQueueSend(this->_free, &buffer, 0);
+    }
+    return this->_error;
+}
+
+esp_err_t DownloadPipeline::finish()
+{
+    if (this->_free != NULL) {
+        uint8_t* buffers[HAWKBIT_DOWNLOAD_MAX_DEPTH];
+        drain(buffers);
+
+        Job stop = { NULL, 0 };
+        xQueueSend(this->_full, &stop, portMAX_DELAY);
+        xSemaphoreTake(this->_done, portMAX_DELAY);
+
+#if !HAWKBIT_PREALLOCATE
+        vQueueDelete(this->_free);
+        vQueueDelete(this->_full);
+        vSemaphoreDelete(this->_done);
+#endif
+        this->_free = this->_full = this->_done = NULL;
+    }
+
+#if HAWKBIT_PREALLOCATE
+    if (this->_memory != NULL) {
+        portENTER_CRITICAL(&s_pipelineLock);
+        s_pipelineBusy = false;
+        portEXIT_CRITICAL(&s_pipelineLock);
+    }
+#else
+    free(this->_memory);
+#endif
+    this->_memory = NULL;
+    return this->_error;
+}
+
+void DownloadPipeline::work()
+{
+    Job job;
+    while (xQueueReceive(this->_full, &job, portMAX_DELAY) == pdTRUE && job.data != NULL) {
+        if (this->_error == ESP_OK) {
+            esp_err_t err = write(job.data, job.len);
+            if (err != ESP_OK) {
+                this->_error = err;
+            }
+        }
+        xQueueSend(this->_free, &job.data, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(this->_done);
+}
+
+void DownloadPipeline::writer(void* arg)
+{
+#if HAWKBIT_PREALLOCATE
+    // serves one download after the other, start() sets s_pipeline before
+    // the first job of a download is queued
+    for (;;) {
+        Job job;
+        xQueuePeek(s_full, &job, portMAX_DELAY);
+        s_pipeline->work();
+    }
+#else
+    ((DownloadPipeline*) arg)->work();
+    vTaskDelete(NULL);
+#endif
+}
+
+ThroughputProfile::ThroughputProfile(bool enabled) :
+    _active(enabled)
+{
+    if (!enabled) {
+        return;
+    }
+
+#ifdef HAWKBIT_HAS_WIFI
+    // fails if Wi-Fi isn't started, nothing to switch then
+    if (esp_wifi_get_ps(&this->_powerSave) != ESP_OK || this->_powerSave == WIFI_PS_NONE) {
+        return;
+    }
+    esp_err_t err = esp_wifi_set_ps(WIFI_PS_NONE);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to disable Wi-Fi power save: %s", esp_err_to_name(err));
+        return;
+    }
+    this->_powerSaveChanged = true;
+    ESP_LOGD(TAG, "Wi-Fi power save disabled for download");
+#endif
+}
+
+ThroughputProfile::~ThroughputProfile()
+{
+#ifdef HAWKBIT_HAS_WIFI
+    if (this->_powerSaveChanged) {
+        esp_wifi_set_ps(this->_powerSave);
+        ESP_LOGD(TAG, "Wi-Fi power save restored");
+    }
+#endif
+}
@@ -0,0 +1,434 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#if __has_include("esp_wifi.h")
+#include "esp_wifi.h"
+#define HAWKBIT_HAS_WIFI 1
+#endif
+
+// Size of the blocks handed to esp_ota_write/esp_partition_write. Network
+// reads are accumulated until a full block is available, so flash only sees
+// sector aligned writes (except for the tail of an artifact).
+#ifndef HAWKBIT_FLASH_WRITE_BLOCK
+#define HAWKBIT_FLASH_WRITE_BLOCK 4096
+#endif
+
+// Bounds for the download autotuner: HTTP read sizes are probed between the
+// minimum and maximum, the pipeline depth (buffers in flight between the
+// network and the sink) up to HAWKBIT_DOWNLOAD_MAX_DEPTH. The buffers never
+// take more than HAWKBIT_DOWNLOAD_MEMORY_LIMIT bytes.
+#ifndef HAWKBIT_DOWNLOAD_MIN_READ_SIZE
+#define HAWKBIT_DOWNLOAD_MIN_READ_SIZE 512
+#endif
+
+#ifndef HAWKBIT_DOWNLOAD_MAX_READ_SIZE
+#define HAWKBIT_DOWNLOAD_MAX_READ_SIZE 8192
+#endif
+
+#ifndef HAWKBIT_DOWNLOAD_MAX_DEPTH
+#define HAWKBIT_DOWNLOAD_MAX_DEPTH 4
+#endif
+
+#ifndef HAWKBIT_DOWNLOAD_MEMORY_LIMIT
+#define HAWKBIT_DOWNLOAD_MEMORY_LIMIT (16 * 1024)
+#endif
+
+// Number of bytes measured for each candidate setting while probing
+#ifndef HAWKBIT_AUTOTUNE_WINDOW
+#define HAWKBIT_AUTOTUNE_WINDOW (32 * 1024)
+#endif
+
+// HTTP receive buffer used for downloads while the throughput profile is active
+#ifndef HAWKBIT_THROUGHPUT_HTTP_BUFFER
+#define HAWKBIT_THROUGHPUT_HTTP_BUFFER 4096
+#endif
+
+// Default number of times a broken download is resumed, and the delay before
+// the first attempt (doubled for each further one)
+#ifndef HAWKBIT_DOWNLOAD_RETRIES
+#define HAWKBIT_DOWNLOAD_RETRIES 2
+#endif
+
+#ifndef HAWKBIT_DOWNLOAD_RETRY_DELAY_MS
+#define HAWKBIT_DOWNLOAD_RETRY_DELAY_MS 1000
+#endif
+
+// Status of a range response, not in HttpStatus_Code of older ESP-IDF versions
+#define HTTP_PARTIAL_CONTENT 206
+
+// With HAWKBIT_PREALLOCATE the download buffers, queues and writer task are
+// allocated statically and only one download can run at a time.
+#ifndef HAWKBIT_DOWNLOAD_WRITER_STACK
+#define HAWKBIT_DOWNLOAD_WRITER_STACK 4096
+#endif
+
+class Artifact;
+class Sha256;
+class ArtifactHash;
+
+/**
+ * Receives the payload of an artifact download.
+ *
+ * begin() is called once the server accepted the request, write() for every
+ * block of data and end() exactly once after begin() succeeded, with success
+ * set to false if the download failed at any point.
+ */
+class DownloadSink {
+    public:
+        virtual ~DownloadSink() {}
+
+        virtual esp_err_t begin(const Artifact& artifact) { return ESP_OK; }
+        virtual esp_err_t write(const uint8_t* data, size_t len) = 0;
+        virtual esp_err_t end(bool success) { return ESP_OK; }
+};
+
+/**
+ * Base for sinks writing to flash. Coalesces incoming data into blocks of
+ * blockSize bytes and only calls flush() with complete blocks, the remaining
+ * tail is flushed by end().
+ */
+class FlashSink : public DownloadSink {
+    public:
+        esp_err_t begin(const Artifact& artifact) override;
+        esp_err_t write(const uint8_t* data, size_t len) override;
+        esp_err_t end(bool success) override;
+
+        size_t blockSize() const { return this->_blockSize; }
+
+    protected:
+        FlashSink(size_t blockSize) :
+            _blockSize(blockSize ? blockSize : HAWKBIT_FLASH_WRITE_BLOCK)
+        {
+#if HAWKBIT_PREALLOCATE
+            if (this->_blockSize > HAWKBIT_FLASH_WRITE_BLOCK) {
+                this->_blockSize = HAWKBIT_FLASH_WRITE_BLOCK;
+            }
+#endif
+        }
+
+        virtual esp_err_t open(const Artifact& artifact) = 0;
+        virtual esp_err_t flush(const uint8_t* data, size_t len) = 0;
+        virtual esp_err_t close(bool success) = 0;
+
+    private:
+        esp_err_t writeBlock(const uint8_t* data, size_t len);
+
+        size_t _blockSize;
+        size_t _fill = 0;
+        uint32_t _flushed = 0;
+#if HAWKBIT_PREALLOCATE
+        uint8_t _block[HAWKBIT_FLASH_WRITE_BLOCK];
+#else
+        std::vector<uint8_t> _block;
+#endif
+};
+
+/**
+ * Writes an application image to an OTA partition. Defaults to the next
+ * update partition, activating it is left to the caller.
+ */
+class OtaSink : public FlashSink {
+    public:
+        OtaSink(const esp_partition_t* partition = NULL, size_t blockSize = HAWKBIT_FLASH_WRITE_BLOCK) :
+            FlashSink(blockSize),
+            _partition(partition)
+        {
+        }
+
+        const esp_partition_t* partition() const { return this->_partition; }
+
+    protected:
+        esp_err_t open(const Artifact& artifact) override;
+        esp_err_t flush(const uint8_t* data, size_t len) override;
+        esp_err_t close(bool success) override;
+
+    private:
+        const esp_partition_t* _partition;
+        esp_ota_handle_t _handle = 0;
+};
+
+/**
+ * Writes raw data to a partition, starting at offset 0. The range needed for
+ * the artifact is erased in open().
+ */
+class PartitionSink : public FlashSink {
+    public:
+        PartitionSink(const esp_partition_t* partition, size_t blockSize = HAWKBIT_FLASH_WRITE_BLOCK) :
+            FlashSink(blockSize),
+            _partition(partition)
+        {
+        }
+
+        const esp_partition_t* partition() const { return this->_partition; }
+
+    protected:
+        esp_err_t open(const Artifact& artifact) override;
+        esp_err_t flush(const uint8_t* data, size_t len) override;
+        esp_err_t close(bool success) override;
+
+    private:
+        const esp_partition_t* _partition;
+        size_t _offset = 0;
+};
+
+/**
+ * Checks a download against the sha256, sha1 and md5 the server lists for
+ * the artifact while passing it on to another sink. The digests are updated
+ * in the writer task, overlapping with the network reads. On a mismatch
+ * end() fails with ESP_ERR_INVALID_CRC and ends the next sink
+ * unsuccessfully, so e.g. an OtaSink doesn't activate the image.
+ */
+class HashingSink : public DownloadSink {
+    public:
+        /**
+         * @param required fail begin() with ESP_ERR_NOT_FOUND if the
+         *                 artifact has none of the known hashes
+         */
+        HashingSink(DownloadSink& sink, bool required = false);
+        ~HashingSink();
+
+        HashingSink(const HashingSink&) = delete;
+        HashingSink& operator=(const HashingSink&) = delete;
+
+        esp_err_t begin(const Artifact& artifact) override;
+        esp_err_t write(const uint8_t* data, size_t len) override;
+        esp_err_t end(bool success) override;
+
+    private:
+        DownloadSink& _sink;
+        bool _required;
+        ArtifactHash* _hash;
+        std::string _filename;
+};
+
+/**
+ * Passes one download on to several sinks at the same time, e.g. the local
+ * OTA partition, a callback forwarding to a coprocessor over UART and a
+ * cache file.
+ *
+ * Every sink is written by a task of its own from a shared set of buffers,
+ * so a slow sink only holds back the download once all buffers wait for it.
+ * The sha256 of the data each sink accepted is available after end(). A
+ * failing required sink fails the download, other sinks are dropped and the
+ * download continues without them. The buffers and tasks are allocated in
+ * begin(), also with HAWKBIT_PREALLOCATE.
+ */
+class TeeSink : public DownloadSink {
+    public:
+        TeeSink(size_t bufferSize = HAWKBIT_FLASH_WRITE_BLOCK, size_t depth = 2) :
+            _bufferSize(bufferSize),
+            _depth(std::max<size_t>(1, std::min<size_t>(depth, UINT8_MAX)))
+        {
+        }
+
+        ~TeeSink();
+
+        /**
+         * Add a sink, before begin().
+         * @param required whether a failure of this sink fails the download
+         */
+        void add(DownloadSink& sink, bool required = true);
+
+        esp_err_t begin(const Artifact& artifact) override;
+        esp_err_t write(const uint8_t* data, size_t len) override;
+        esp_err_t end(bool success) override;
+
+        size_t size() const { return this->_outputs.size(); }
+        // result of the sink added as index, after end()
+        esp_err_t error(size_t index) const { return this->_outputs[index]->error; }
+        const std::string& sha256(size_t index) const { return this->_outputs[index]->sha256; }
+
+    private:
+        typedef struct {
+            uint8_t buffer;
+            size_t len;     // 0 stops the writer
+        } Job;
+
+        typedef struct {
+            TeeSink* tee;
+            DownloadSink* sink;
+            bool required;
+            bool begun;
+            volatile esp_err_t error;
+            Sha256* hash;
+            std::string sha256;
+            QueueHandle_t jobs;
+            SemaphoreHandle_t done;
+        } Output;
+
+        size_t _bufferSize;
+        size_t _depth;
+        std::vector<Output*> _outputs;
+        uint8_t* _memory = NULL;
+        std::vector<uint8_t> _users;
+        QueueHandle_t _free = NULL;
+        portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+        void release(uint8_t buffer);
+        void stop();
+        static void writer(void* arg);
+};
+
+/**
+ * Picks HTTP read size and pipeline depth for a download.
+ *
+ * On the first sufficiently large download over a network type the tuner
+ * probes the candidate settings one measurement window each (read sizes
+ * first, then pipeline depths with the best read size) and keeps the fastest
+ * one for the rest of the transfer. The result is remembered per network
+ * type, in NVS if it is available, and used directly for later downloads.
+ */
+class DownloadAutotuner {
+    public:
+        typedef enum { UNKNOWN, WIFI, ETHERNET, CELLULAR } NetworkType;
+
+        DownloadAutotuner(bool enabled = true) :
+            _enabled(enabled)
+        {
+        }
+
+        void begin(uint32_t size);
+
+        /**
+         * Account for received bytes.
+         * @return true if readSize() or depth() changed
+         */
+        bool update(size_t bytes);
+
+        void end(bool success);
+
+        size_t readSize() const { return this->_current.readSize; }
+        size_t depth() const { return this->_current.depth; }
+
+        // size and number of buffers to allocate for the whole transfer
+        size_t bufferSize() const { return this->_bufferSize; }
+        size_t maxDepth() const { return this->_maxDepth; }
+
+        NetworkType network() const { return this->_network; }
+
+        static NetworkType currentNetwork();
+
+    private:
+        typedef struct {
+            uint16_t readSize;
+            uint8_t depth;
+        } Setting;
+
+        bool _enabled;
+        NetworkType _network = UNKNOWN;
+        size_t _bufferSize = HAWKBIT_DOWNLOAD_MIN_READ_SIZE;
+        size_t _maxDepth = 1;
+        Setting _current = { HAWKBIT_DOWNLOAD_MIN_READ_SIZE, 1 };
+
+        bool _probing = false;
+        bool _tuned = false;
+        int _index = -1;
+        size_t _readSizes = 0;
+        size_t _count = 0;
+        size_t _windowBytes = 0;
+        int64_t _windowStart = 0;
+        Setting _candidates[16];
+        uint32_t _rates[16];
+
+        size_t best(size_t from, size_t to) const;
+        bool recall(Setting& setting) const;
+        void remember(const Setting& setting) const;
+};
+
+/**
+ * Moves downloaded data from the network loop to a sink.
+ *
+ * With a depth of one the sink is written synchronously. With a larger depth
+ * a writer task drains filled buffers while the next ones are read, so slow
+ * flash writes don't stall the connection.
+ */
+class DownloadPipeline {
+    public:
+        DownloadPipeline(DownloadSink& sink) :
+            _sink(sink)
+        {
+        }
+
+        ~DownloadPipeline();
+
+        esp_err_t start(size_t bufferSize, size_t maxDepth, size_t depth);
+
+        // a free buffer of bufferSize bytes, blocks while all are in flight
+        uint8_t* acquire();
+        // return a buffer obtained from acquire() without data
+        void release(uint8_t* buffer);
+        // hand over len bytes in a buffer obtained from acquire()
+        esp_err_t submit(uint8_t* buffer, size_t len);
+
+        esp_err_t resize(size_t depth);
+
+        // wait for all pending writes and stop the writer task
+        esp_err_t finish();
+
+        // microseconds spent in the sink's write()
+        int64_t writeTime() const { return this->_writeTime; }
+
+    private:
+        typedef struct {
+            uint8_t* data;
+            size_t len;
+        } Job;
+
+        DownloadSink& _sink;
+        uint8_t* _memory = NULL;
+        size_t _bufferSize = 0;
+        size_t _maxDepth = 0;
+        size_t _depth = 1;
+        QueueHandle_t _free = NULL;
+        QueueHandle_t _full = NULL;
+        SemaphoreHandle_t _done = NULL;
+        volatile esp_err_t _error = ESP_OK;
+        int64_t _writeTime = 0;
+
+        esp_err_t write(const uint8_t* data, size_t len);
+        void drain(uint8_t** buffers);
+        void work();
+        static void writer(void* arg);
+};
+
+/**
+ * Switches the network to a high throughput profile while it is in scope:
+ * Wi-Fi modem sleep is disabled and the previous power save mode restored
+ * on destruction, so every return path of a download ends up back in the
+ * idle profile.
+ */
+class ThroughputProfile {
+    public:
+        ThroughputProfile(bool enabled);
+        ~ThroughputProfile();
+
+        // enabled, the larger HTTP buffer applies even without Wi-Fi
+        bool active() const { return this->_active; }
+
+    private:
+        bool _active = false;
+#ifdef HAWKBIT_HAS_WIFI
+        // only restored if it was switched here
+        bool _powerSaveChanged = false;
+        wifi_ps_type_t _powerSave = WIFI_PS_NONE;
+#endif
+};
@@ -0,0 +1,163 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_hash.h"
+#include <ctype.h>
+#include "mbedtls/version.h"
+
+// the _ret variants of mbedTLS 2.x became the plain names in 3.x
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define sha256_starts mbedtls_sha256_starts
+#define sha256_update mbedtls_sha256_update
+#define sha256_finish mbedtls_sha256_finish
+#define sha1_starts mbedtls_sha1_starts
+#define sha1_update mbedtls_sha1_update
+#define sha1_finish mbedtls_sha1_finish
+#define md5_starts mbedtls_md5_starts
+#define md5_update mbedtls_md5_update
+#define md5_finish mbedtls_md5_finish
+#else
+#define sha256_starts mbedtls_sha256_starts_ret
+#define sha256_update mbedtls_sha256_update_ret
+#define sha256_finish mbedtls_sha256_finish_ret
+#define sha1_starts mbedtls_sha1_starts_ret
+#define sha1_update mbedtls_sha1_update_ret
+#define sha1_finish mbedtls_sha1_finish_ret
+#define md5_starts mbedtls_md5_starts_ret
+#define md5_update mbedtls_md5_update_ret
+#define md5_finish mbedtls_md5_finish_ret
+#endif
+
+Sha256::Sha256()
+{
+    mbedtls_sha256_init(&this->_context);
+    sha256_starts(&this->_context, 0);
+}
+
+Sha256::~Sha256()
+{
+    mbedtls_sha256_free(&this->_context);
+}
+
+void Sha256::reset()
+{
+    mbedtls_sha256_free(&this->_context);
+    mbedtls_sha256_init(&this->_context);
+    sha256_starts(&this->_context, 0);
+}
+
+void Sha256::update(const uint8_t* data, size_t len)
+{
+    sha256_update(&this->_context, data, len);
+}
+
+void Sha256::finish(uint8_t digest[SIZE])
+{
+    sha256_finish(&this->_context, digest);
+    reset();
+}
+
+std::string Sha256::finishHex()
+{
+    uint8_t digest[SIZE];
+    finish(digest);
+    return hex(digest, sizeof(digest));
+}
+
+std::string Sha256::hex(const uint8_t* data, size_t len)
+{
+    static const char DIGITS[] = "0123456789abcdef";
+
+    std::string result(2 * len, '0');
+    for (size_t i = 0; i < len; i++) {
+        result[2 * i] = DIGITS[data[i] >> 4];
+        result[2 * i + 1] = DIGITS[data[i] & 0x0f];
+    }
+    return result;
+}
+
+static std::string expected(const std::map<std::string,std::string>& hashes, const char* algorithm)
+{
+    auto hash = hashes.find(algorithm);
+    if (hash == hashes.end()) {
+        return "";
+    }
+    std::string digest = hash->second;
+    for (char& c : digest) {
+        c = tolower((unsigned char) c);
+    }
+    return digest;
+}
+
+ArtifactHash::ArtifactHash()
+{
+    mbedtls_sha1_init(&this->_sha1);
+    mbedtls_md5_init(&this->_md5);
+}
+
+ArtifactHash::~ArtifactHash()
+{
+    mbedtls_sha1_free(&this->_sha1);
+    mbedtls_md5_free(&this->_md5);
+}
+
+size_t ArtifactHash::begin(const std::map<std::string,std::string>& hashes)
+{
+    this->_expected256 = expected(hashes, "sha256");
+    this->_expected1 = expected(hashes, "sha1");
+    this->_expectedMd5 = expected(hashes, "md5");
+
+    this->_sha256.reset();
+    mbedtls_sha1_free(&this->_sha1);
+    mbedtls_sha1_init(&this->_sha1);
+    sha1_starts(&this->_sha1);
+    mbedtls_md5_free(&this->_md5);
+    mbedtls_md5_init(&this->_md5);
+    md5_starts(&this->_md5);
+
+    return !this->_expected256.empty() + !this->_expected1.empty() + !this->_expectedMd5.empty();
+}
+
+void ArtifactHash::update(const uint8_t* data, size_t len)
+{
+    if (!this->_expected256.empty()) {
+        this->_sha256.update(data, len);
+    }
+    if (!this->_expected1.empty()) {
+        sha1_update(&this->_sha1, data, len);
+    }
+    if (!this->_expectedMd5.empty()) {
+        md5_update(&this->_md5, data, len);
+    }
+}
+
+const char* ArtifactHash::verify()
+{
+    const char* mismatch = NULL;
+
+    if (!this->_expected256.empty() && this->_sha256.finishHex() != this->_expected256) {
+        mismatch = "sha256";
+    }
+    if (!this->_expected1.empty()) {
+        uint8_t digest[20];
+        sha1_finish(&this->_sha1, digest);
+        if (Sha256::hex(digest, sizeof(digest)) != this->_expected1 && mismatch == NULL) {
+            mismatch = "sha1";
+        }
+    }
+    if (!this->_expectedMd5.empty()) {
+        uint8_t digest[16];
+        md5_finish(&this->_md5, digest);
+        if (Sha256::hex(digest, sizeof(digest)) != this->_expectedMd5 && mismatch == NULL) {
+            mismatch = "md5";
+        }
+    }
+    return mismatch;
+}
@@ -0,0 +1,84 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <stdint.h>
+#include <stddef.h>
+#include "mbedtls/sha256.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/md5.h"
+
+/**
+ * Incremental SHA-256 on top of mbedTLS, which uses the hardware SHA
+ * accelerator where the chip has one.
+ */
+class Sha256 {
+    public:
+        static const size_t SIZE = 32;
+
+        Sha256();
+        ~Sha256();
+
+        Sha256(const Sha256&) = delete;
+        Sha256& operator=(const Sha256&) = delete;
+
+        void reset();
+        void update(const uint8_t* data, size_t len);
+        // digest of everything since the last reset(), resets the hash
+        void finish(uint8_t digest[SIZE]);
+        // same as finish(), as lowercase hex like the hashes of an Artifact
+        std::string finishHex();
+
+        static std::string hex(const uint8_t* data, size_t len);
+
+    private:
+        mbedtls_sha256_context _context;
+};
+
+/**
+ * Checks data against the hashes of an artifact in a single pass: sha256,
+ * sha1 and md5, as far as the server sent them, are updated from the same
+ * buffer while it is still in the cache. SHA-1 and SHA-256 run on the
+ * hardware accelerator where the chip has one.
+ */
+class ArtifactHash {
+    public:
+        ArtifactHash();
+        ~ArtifactHash();
+
+        ArtifactHash(const ArtifactHash&) = delete;
+        ArtifactHash& operator=(const ArtifactHash&) = delete;
+
+        /**
+         * Start over, checking against the known algorithms of expected.
+         * @param expected algorithm to hex digest, like Artifact::hashes()
+         * @return number of hashes that are checked
+         */
+        size_t begin(const std::map<std::string,std::string>& expected);
+        void update(const uint8_t* data, size_t len);
+
+        /**
+         * Finish the digests of everything since begin().
+         * @return NULL if all match, else the algorithm that doesn't
+         */
+        const char* verify();
+
+    private:
+        Sha256 _sha256;
+        mbedtls_sha1_context _sha1;
+        mbedtls_md5_context _md5;
+        // expected digests, empty for algorithms not checked
+        std::string _expected256;
+        std::string _expected1;
+        std::string _expectedMd5;
+};
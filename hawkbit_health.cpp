@@ -0,0 +1,223 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_health.h"
+#include "hawkbit_install.h"
+#include <string.h>
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+static const char* TAG = "hawkbit";
+
+#define PENDING_ID_KEY "pending_id"
+#define PENDING_APP_KEY "pending_app"
+#define PENDING_RESULT_KEY "pending_res"
+
+void HealthCheck::probe(const std::string& name, Probe probe)
+{
+    for (auto& entry : this->_probes) {
+        if (entry.first == name) {
+            entry.second = probe;
+            return;
+        }
+    }
+    this->_probes.push_back(std::make_pair(name, probe));
+}
+
+esp_err_t HealthCheck::pending(const Deployment& deployment)
+{
+    const esp_partition_t* boot = esp_ota_get_boot_partition();
+    if (boot == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hawkbit", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_str(nvs, PENDING_ID_KEY, deployment.id().c_str());
+    if (err == ESP_OK) {
+        err = nvs_set_str(nvs, PENDING_APP_KEY, boot->label);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+void HealthCheck::clear()
+{
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    nvs_erase_key(nvs, PENDING_ID_KEY);
+    nvs_erase_key(nvs, PENDING_APP_KEY);
+    nvs_erase_key(nvs, PENDING_RESULT_KEY);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+esp_err_t HealthCheck::decide(bool success, const std::vector<std::string>& details)
+{
+    // "1" or "0", then one line per detail
+    std::string result = success ? "1" : "0";
+    for (const std::string& detail : details) {
+        result += "\n" + detail;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hawkbit", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_str(nvs, PENDING_RESULT_KEY, result.c_str());
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "HealthCheck: storing the result failed");
+    }
+    return err;
+}
+
+esp_err_t HealthCheck::report(const Deployment& deployment, bool success, const std::vector<std::string>& details)
+{
+    UpdateResult result = this->_client.reportComplete(deployment, success, details);
+    if (result.code() < 200 || result.code() >= 300) {
+        // kept for the next run()
+        ESP_LOGW(TAG, "HealthCheck: feedback for %s failed with %u", deployment.id().c_str(), result.code());
+        return success ? ESP_OK : ESP_FAIL;
+    }
+    clear();
+    return success ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t HealthCheck::run(uint32_t budget)
+{
+    char id[64] = {};
+    char app[sizeof(((esp_partition_t*)0)->label)] = {};
+    std::string result;
+
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READONLY, &nvs) != ESP_OK) {
+        return ESP_OK;
+    }
+    size_t idLen = sizeof(id);
+    size_t appLen = sizeof(app);
+    esp_err_t err = nvs_get_str(nvs, PENDING_ID_KEY, id, &idLen);
+    if (err == ESP_OK) {
+        err = nvs_get_str(nvs, PENDING_APP_KEY, app, &appLen);
+    }
+    size_t resultLen = 0;
+    if (err == ESP_OK && nvs_get_str(nvs, PENDING_RESULT_KEY, NULL, &resultLen) == ESP_OK && resultLen > 1) {
+        result.resize(resultLen);
+        if (nvs_get_str(nvs, PENDING_RESULT_KEY, &result[0], &resultLen) == ESP_OK) {
+            result.resize(resultLen - 1);
+        } else {
+            result.clear();
+        }
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK) {
+        return ESP_OK;
+    }
+
+    Deployment deployment(id, "", "", {});
+
+    if (!result.empty()) {
+        // decided before, but the server didn't get the feedback yet
+        std::vector<std::string> details;
+        for (size_t start = 2; start < result.size() + 1; ) {
+            size_t end = result.find('\n', start);
+            if (end == std::string::npos) {
+                end = result.size();
+            }
+            details.push_back(result.substr(start, end - start));
+            start = end + 1;
+        }
+        ESP_LOGI(TAG, "HealthCheck: sending the result of deployment %s again", id);
+        return report(deployment, result[0] == '1', details);
+    }
+
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    const esp_partition_t* boot = esp_ota_get_boot_partition();
+
+    if (strcmp(running->label, app) != 0 && boot != NULL && strcmp(boot->label, app) == 0) {
+        // pending() was called, but the restart into the new image didn't happen yet
+        return ESP_OK;
+    }
+
+    if (strcmp(running->label, app) != 0) {
+        // the bootloader went back to the previous image
+        ESP_LOGW(TAG, "HealthCheck: deployment %s was rolled back", id);
+        InstallTransaction::rollback();
+        std::vector<std::string> details = { "rolled back by bootloader" };
+        decide(false, details);
+        return report(deployment, false, details);
+    }
+
+    std::vector<bool> passed(this->_probes.size(), false);
+    size_t remaining = this->_probes.size();
+    int64_t deadline = esp_timer_get_time() + (int64_t) budget * 1000;
+    while (true) {
+        for (size_t i = 0; i < this->_probes.size(); i++) {
+            if (!passed[i] && this->_probes[i].second()) {
+                ESP_LOGI(TAG, "HealthCheck: %s passed", this->_probes[i].first.c_str());
+                passed[i] = true;
+                remaining--;
+            }
+        }
+        if (remaining == 0 || esp_timer_get_time() >= deadline) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(HAWKBIT_HEALTH_PROBE_INTERVAL_MS));
+    }
+
+    std::vector<std::string> details;
+    for (size_t i = 0; i < this->_probes.size(); i++) {
+        if (!passed[i]) {
+            details.push_back("health probe failed: " + this->_probes[i].first);
+        }
+    }
+
+    esp_ota_img_states_t state;
+    bool verifying = esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+
+    if (remaining == 0) {
+        if (verifying) {
+            esp_ota_mark_app_valid_cancel_rollback();
+        }
+        ESP_LOGI(TAG, "HealthCheck: deployment %s healthy", id);
+        decide(true, details);
+        return report(deployment, true, details);
+    }
+
+    ESP_LOGE(TAG, "HealthCheck: deployment %s unhealthy", id);
+    if (!verifying) {
+        // rollback isn't enabled in the bootloader, keep running
+        details.push_back("rollback not available");
+        decide(false, details);
+        return report(deployment, false, details);
+    }
+
+    // the previous application sends the feedback if it doesn't get through now
+    details.push_back("rolled back");
+    InstallTransaction::rollback();
+    decide(false, details);
+    report(deployment, false, details);
+    return esp_ota_mark_app_invalid_rollback_and_reboot();
+}
@@ -0,0 +1,79 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include "hawkbit.h"
+
+// Default time the probes get to pass after an update, and the delay
+// between two rounds of probes that haven't passed yet
+#ifndef HAWKBIT_HEALTH_BUDGET_MS
+#define HAWKBIT_HEALTH_BUDGET_MS 30000
+#endif
+
+#ifndef HAWKBIT_HEALTH_PROBE_INTERVAL_MS
+#define HAWKBIT_HEALTH_PROBE_INTERVAL_MS 1000
+#endif
+
+/**
+ * Decides on a freshly installed application right after it booted.
+ *
+ * Before restarting into a new image the application calls pending() with
+ * the deployment. After the restart run() executes the registered probes
+ * until all of them passed or the budget is used up, then marks the image
+ * valid or rolls back, and reports the deployment closed right away instead
+ * of on the next poll. The decision is kept until the server accepted the
+ * feedback, a later run() sends it again without running the probes. A
+ * deployment whose image the bootloader already rolled back is reported as
+ * failed by the previous application. Data slots an InstallTransaction
+ * switched along with the image go back with it. As long as the new image is
+ * only the boot partition and not yet running, run() leaves it pending.
+ */
+class HealthCheck {
+    public:
+        // returns true once the application is healthy, called repeatedly
+        typedef std::function<bool()> Probe;
+
+        HealthCheck(HawkbitClient& client) :
+            _client(client)
+        {
+        }
+
+        /**
+         * Register a probe, e.g. "connected to the broker" or "sensor responds".
+         */
+        void probe(const std::string& name, Probe probe);
+
+        /**
+         * Remember the deployment whose image boots next. Call after the boot
+         * partition was set, before restarting.
+         */
+        static esp_err_t pending(const Deployment& deployment);
+
+        /**
+         * Check a pending deployment, returns immediately without one. Doesn't
+         * return if the image is rolled back. Call again, e.g. once the
+         * network is up, while the feedback wasn't sent.
+         * @param budget milliseconds the probes may take to pass
+         * @return ESP_OK if nothing was pending or the image is healthy
+         */
+        esp_err_t run(uint32_t budget = HAWKBIT_HEALTH_BUDGET_MS);
+
+    private:
+        HawkbitClient& _client;
+        std::vector<std::pair<std::string,Probe>> _probes;
+
+        static void clear();
+        static esp_err_t decide(bool success, const std::vector<std::string>& details);
+        esp_err_t report(const Deployment& deployment, bool success, const std::vector<std::string>& details);
+};
@@ -0,0 +1,480 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_install.h"
+#include "hawkbit_blockmap.h"
+#include "hawkbit_hash.h"
+#include "hawkbit_health.h"
+#include <algorithm>
+#include <string.h>
+#include "esp_ota_ops.h"
+#include "nvs.h"
+
+static const char* TAG = "hawkbit";
+
+#define PROGRESS_VERSION 1
+#define PROGRESS_KEY "install"
+#define SLOTS_KEY "slots"
+#define PREVIOUS_KEY "slots_prev"
+#define OTA_SLOT 0xff
+#define VERIFY_BLOCK 1024
+
+InstallTransaction::InstallTransaction(HawkbitClient& client, const Deployment& deployment) :
+    _client(client),
+    _deployment(deployment)
+{
+    memset(&this->_progress, 0, sizeof(this->_progress));
+}
+
+void InstallTransaction::target(const std::string& part, const esp_partition_t* slot0, const esp_partition_t* slot1)
+{
+    for (Target& target : this->_targets) {
+        if (target.part == part) {
+            target.slots[0] = slot0;
+            target.slots[1] = slot1;
+            return;
+        }
+    }
+    this->_targets.push_back({ part, { slot0, slot1 } });
+}
+
+const esp_partition_t* InstallTransaction::partition(const Chunk& chunk, uint8_t& slot) const
+{
+    if (chunk.part() == "os" || chunk.part() == "bApp") {
+        slot = OTA_SLOT;
+        return esp_ota_get_next_update_partition(NULL);
+    }
+
+    for (const Target& target : this->_targets) {
+        if (target.part == chunk.part()) {
+            slot = 1 - activeSlot(chunk.part());
+            return target.slots[slot];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t InstallTransaction::verify(const esp_partition_t* partition, const Artifact& artifact) const
+{
+    auto hash = artifact.hashes().find("sha256");
+    if (hash == artifact.hashes().end()) {
+        ESP_LOGE(TAG, "InstallTransaction: %s has no sha256", artifact.filename().c_str());
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    std::string expected = hash->second;
+    std::transform(expected.begin(), expected.end(), expected.begin(), ::tolower);
+
+    // read back what actually landed in flash
+    Sha256 sha256;
+    uint8_t buffer[VERIFY_BLOCK];
+    for (size_t offset = 0; offset < artifact.size(); offset += sizeof(buffer)) {
+        size_t len = std::min<size_t>(sizeof(buffer), artifact.size() - offset);
+        esp_err_t err = esp_partition_read(partition, offset, buffer, len);
+        if (err != ESP_OK) {
+            return err;
+        }
+        sha256.update(buffer, len);
+    }
+
+    if (sha256.finishHex() != expected) {
+        ESP_LOGE(TAG, "InstallTransaction: sha256 mismatch for %s in %s", artifact.filename().c_str(), partition->label);
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+esp_err_t InstallTransaction::stage()
+{
+    const std::list<Chunk>& chunks = this->_deployment.chunks();
+    if (chunks.size() > 32) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // a second chunk for the same partition would overwrite the first one
+    std::vector<const esp_partition_t*> targets;
+    for (const Chunk& chunk : chunks) {
+        uint8_t slot;
+        const esp_partition_t* partition = this->partition(chunk, slot);
+        if (partition != NULL && std::find(targets.begin(), targets.end(), partition) != targets.end()) {
+            ESP_LOGE(TAG, "InstallTransaction: chunk %s targets %s like an earlier one", chunk.name().c_str(), partition->label);
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        targets.push_back(partition);
+    }
+
+    if (!load()) {
+        memset(&this->_progress, 0, sizeof(this->_progress));
+        this->_progress.version = PROGRESS_VERSION;
+        snprintf(this->_progress.id, sizeof(this->_progress.id), "%s", this->_deployment.id().c_str());
+    } else if (this->_progress.committing) {
+        // interrupted commit, recover() has to finish it first
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t bit = 1;
+    for (const Chunk& chunk : chunks) {
+        const Artifact* payload = this->payload(chunk);
+        if (payload == NULL) {
+            ESP_LOGE(TAG, "InstallTransaction: chunk %s has %u artifacts, expected one", chunk.name().c_str(), chunk.artifacts().size());
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        const Artifact& artifact = *payload;
+
+        uint8_t slot;
+        const esp_partition_t* partition = this->partition(chunk, slot);
+        if (partition == NULL) {
+            ESP_LOGE(TAG, "InstallTransaction: no target for part %s", chunk.part().c_str());
+            return ESP_ERR_NOT_FOUND;
+        }
+
+        if (this->_progress.staged & bit) {
+            if (verify(partition, artifact) == ESP_OK) {
+                ESP_LOGI(TAG, "InstallTransaction: %s already staged in %s", artifact.filename().c_str(), partition->label);
+                bit <<= 1;
+                continue;
+            }
+            this->_progress.staged &= ~bit;
+        }
+
+        esp_err_t err = download(chunk, artifact, partition, slot == OTA_SLOT);
+        if (err == ESP_OK) {
+            err = verify(partition, artifact);
+        }
+        if (err != ESP_OK) {
+            save();
+            return err;
+        }
+
+        this->_progress.staged |= bit;
+        err = save();
+        if (err != ESP_OK) {
+            return err;
+        }
+        bit <<= 1;
+    }
+    return ESP_OK;
+}
+
+const Artifact* InstallTransaction::payload(const Chunk& chunk)
+{
+    // a block map may come along with the artifact
+    const Artifact* payload = NULL;
+    for (const Artifact& artifact : chunk.artifacts()) {
+        if (BlockMap::isBlockMap(artifact)) {
+            continue;
+        }
+        if (payload != NULL) {
+            return NULL;
+        }
+        payload = &artifact;
+    }
+    return payload;
+}
+
+esp_err_t InstallTransaction::download(const Chunk& chunk, const Artifact& artifact, const esp_partition_t* partition, bool app)
+{
+    OtaSink ota(partition);
+    PartitionSink raw(partition);
+    DownloadSink* sink = app ? (DownloadSink*) &ota : (DownloadSink*) &raw;
+
+    BlockMap blocks;
+    const Artifact* map = BlockMap::find(chunk, artifact);
+    if (map != NULL) {
+        esp_err_t err = blocks.load(this->_client, *map, artifact);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    VerifyingSink verifying(this->_client, blocks, *sink);
+    DownloadResult result = map != NULL ? verifying.download(artifact) : this->_client.download(artifact, *sink);
+    if (!result.ok()) {
+        return result.error() != ESP_OK ? result.error() : ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t InstallTransaction::commit()
+{
+    const std::list<Chunk>& chunks = this->_deployment.chunks();
+    uint32_t all = chunks.size() == 32 ? UINT32_MAX : (1u << chunks.size()) - 1;
+    if (!load() || this->_progress.staged != all) {
+        ESP_LOGE(TAG, "InstallTransaction: %s is not staged completely", this->_deployment.id().c_str());
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t count = 0;
+    memset(this->_progress.app, 0, sizeof(this->_progress.app));
+    memset(this->_progress.slots, 0, sizeof(this->_progress.slots));
+    for (const Chunk& chunk : chunks) {
+        uint8_t slot;
+        const esp_partition_t* partition = this->partition(chunk, slot);
+        if (partition == NULL) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        if (slot == OTA_SLOT) {
+            snprintf(this->_progress.app, sizeof(this->_progress.app), "%s", partition->label);
+            continue;
+        }
+        if (count == HAWKBIT_INSTALL_MAX_TARGETS || chunk.part().size() >= HAWKBIT_INSTALL_PART_LENGTH) {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        snprintf(this->_progress.slots[count].part, sizeof(this->_progress.slots[count].part), "%s", chunk.part().c_str());
+        this->_progress.slots[count].slot = slot;
+        count++;
+    }
+
+    // from here on recover() completes the switch after a reset
+    this->_progress.committing = 1;
+    esp_err_t err = save();
+    if (err != ESP_OK) {
+        return err;
+    }
+    return apply(this->_progress);
+}
+
+void InstallTransaction::abort()
+{
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_erase_key(nvs, PROGRESS_KEY) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    memset(&this->_progress, 0, sizeof(this->_progress));
+}
+
+esp_err_t InstallTransaction::apply(const Progress& progress)
+{
+    Slot slots[HAWKBIT_INSTALL_MAX_TARGETS];
+    readSlots(slots);
+
+    // kept until the new application proved itself, a commit repeated by
+    // recover() must not replace them with the slots it already switched
+    Previous previous;
+    bool keep = progress.app[0] != '\0' &&
+        !(readPrevious(previous) && strncmp(previous.id, progress.id, sizeof(previous.id)) == 0);
+    if (keep) {
+        memset(&previous, 0, sizeof(previous));
+        previous.version = PROGRESS_VERSION;
+        memcpy(previous.id, progress.id, sizeof(previous.id));
+        memcpy(previous.app, progress.app, sizeof(previous.app));
+        memcpy(previous.slots, slots, sizeof(previous.slots));
+    }
+
+    for (const Slot& update : progress.slots) {
+        if (update.part[0] == '\0') {
+            continue;
+        }
+        Slot* entry = NULL;
+        for (Slot& slot : slots) {
+            if (strcmp(slot.part, update.part) == 0) {
+                entry = &slot;
+                break;
+            }
+            if (entry == NULL && slot.part[0] == '\0') {
+                entry = &slot;
+            }
+        }
+        if (entry == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        *entry = update;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hawkbit", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (keep) {
+        err = nvs_set_blob(nvs, PREVIOUS_KEY, &previous, sizeof(previous));
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, SLOTS_KEY, slots, sizeof(slots));
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+
+    if (err == ESP_OK && progress.app[0] != '\0') {
+        const esp_partition_t* app = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, progress.app);
+        err = app != NULL ? esp_ota_set_boot_partition(app) : ESP_ERR_NOT_FOUND;
+        if (err == ESP_OK) {
+            // let the new application confirm itself after the restart
+            err = HealthCheck::pending(Deployment(progress.id, "", "", {}));
+        }
+    }
+
+    if (err == ESP_OK) {
+        nvs_erase_key(nvs, PROGRESS_KEY);
+        err = nvs_commit(nvs);
+        ESP_LOGI(TAG, "InstallTransaction: %s committed", progress.id);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+esp_err_t InstallTransaction::rollback()
+{
+    Previous previous;
+    if (!readPrevious(previous)) {
+        return ESP_OK;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hawkbit", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, SLOTS_KEY, previous.slots, sizeof(previous.slots));
+    if (err == ESP_OK) {
+        err = nvs_erase_key(nvs, PREVIOUS_KEY);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+        ESP_LOGW(TAG, "InstallTransaction: data slots of %s rolled back", previous.id);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+esp_err_t InstallTransaction::recover()
+{
+    esp_err_t err = ESP_OK;
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READONLY, &nvs) == ESP_OK) {
+        Progress progress;
+        size_t len = sizeof(progress);
+        err = nvs_get_blob(nvs, PROGRESS_KEY, &progress, &len);
+        nvs_close(nvs);
+        if (err == ESP_OK && len == sizeof(progress) && progress.version == PROGRESS_VERSION && progress.committing) {
+            err = complete(progress);
+        } else {
+            err = ESP_OK;
+        }
+    }
+
+    Previous previous;
+    if (err != ESP_OK || !readPrevious(previous)) {
+        return err;
+    }
+    const esp_partition_t* boot = esp_ota_get_boot_partition();
+    if (boot == NULL || strncmp(boot->label, previous.app, sizeof(previous.app)) != 0) {
+        // the application of the commit won't run (anymore)
+        return rollback();
+    }
+
+    esp_ota_img_states_t state;
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    if (running == boot && (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY)) {
+        // the application is here to stay, its data slots too
+        if (nvs_open("hawkbit", NVS_READWRITE, &nvs) == ESP_OK) {
+            nvs_erase_key(nvs, PREVIOUS_KEY);
+            nvs_commit(nvs);
+            nvs_close(nvs);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t InstallTransaction::complete(Progress& progress)
+{
+    if (progress.app[0] != '\0') {
+        // the new application was started and rolled back, don't boot it again
+        const esp_partition_t* app = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, progress.app);
+        esp_ota_img_states_t state;
+        if (app != NULL && esp_ota_get_state_partition(app, &state) == ESP_OK &&
+            (state == ESP_OTA_IMG_INVALID || state == ESP_OTA_IMG_ABORTED)) {
+            // slots it already switched are restored by the caller
+            ESP_LOGW(TAG, "InstallTransaction: %s was rolled back", progress.id);
+            progress.app[0] = '\0';
+            memset(progress.slots, 0, sizeof(progress.slots));
+        }
+    }
+
+    ESP_LOGI(TAG, "InstallTransaction: completing commit of %s", progress.id);
+    return apply(progress);
+}
+
+uint8_t InstallTransaction::activeSlot(const std::string& part)
+{
+    Slot slots[HAWKBIT_INSTALL_MAX_TARGETS];
+    if (readSlots(slots)) {
+        for (const Slot& slot : slots) {
+            if (part == slot.part) {
+                return slot.slot;
+            }
+        }
+    }
+    return 0;
+}
+
+bool InstallTransaction::readSlots(Slot* slots)
+{
+    memset(slots, 0, HAWKBIT_INSTALL_MAX_TARGETS * sizeof(Slot));
+
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    size_t len = HAWKBIT_INSTALL_MAX_TARGETS * sizeof(Slot);
+    esp_err_t err = nvs_get_blob(nvs, SLOTS_KEY, slots, &len);
+    nvs_close(nvs);
+    return err == ESP_OK;
+}
+
+bool InstallTransaction::readPrevious(Previous& previous)
+{
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    size_t len = sizeof(previous);
+    esp_err_t err = nvs_get_blob(nvs, PREVIOUS_KEY, &previous, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == sizeof(previous) && previous.version == PROGRESS_VERSION;
+}
+
+bool InstallTransaction::load()
+{
+    nvs_handle_t nvs;
+    if (nvs_open("hawkbit", NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    Progress progress;
+    size_t len = sizeof(progress);
+    esp_err_t err = nvs_get_blob(nvs, PROGRESS_KEY, &progress, &len);
+    nvs_close(nvs);
+
+    // progress of another deployment is dropped, its slots were never activated
+    if (err != ESP_OK || len != sizeof(progress) || progress.version != PROGRESS_VERSION ||
+        strncmp(progress.id, this->_deployment.id().c_str(), sizeof(progress.id)) != 0) {
+        return false;
+    }
+    this->_progress = progress;
+    return true;
+}
+
+esp_err_t InstallTransaction::save() const
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("hawkbit", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, PROGRESS_KEY, &this->_progress, sizeof(this->_progress));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
@@ -0,0 +1,131 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "hawkbit.h"
+#include "esp_partition.h"
+
+// Number of data partitions that can be switched by one transaction, and the
+// longest chunk part name stored for them
+#ifndef HAWKBIT_INSTALL_MAX_TARGETS
+#define HAWKBIT_INSTALL_MAX_TARGETS 4
+#endif
+
+#ifndef HAWKBIT_INSTALL_PART_LENGTH
+#define HAWKBIT_INSTALL_PART_LENGTH 16
+#endif
+
+/**
+ * Installs all chunks of a deployment or none of them.
+ *
+ * stage() writes every chunk to an inactive slot and verifies the sha256 of
+ * what ended up in flash. Only when all chunks are staged, commit() switches
+ * the boot partition and the active slots of data partitions together.
+ * Progress is kept in NVS: after a reboot or a failed download, stage() for
+ * the same deployment only fetches the chunks that aren't staged yet.
+ *
+ * Chunks with the part "os" or "bApp" go to the next OTA partition, other
+ * parts need a pair of data partitions registered with target(). The
+ * application finds the current one of a pair with activeSlot(). A new
+ * application is registered with HealthCheck::pending() on commit. Until it
+ * proved itself the previous data slots are kept, and they are active again
+ * if the application is rolled back. A chunk holds one artifact, plus
+ * optionally its BlockMap.
+ */
+class InstallTransaction {
+    public:
+        InstallTransaction(HawkbitClient& client, const Deployment& deployment);
+
+        /**
+         * Stage chunks with this part to whichever of the two partitions
+         * isn't active.
+         */
+        void target(const std::string& part, const esp_partition_t* slot0, const esp_partition_t* slot1);
+
+        /**
+         * Download and verify all chunks not staged yet.
+         * @return ESP_ERR_NOT_SUPPORTED if two chunks target the same
+         *         partition, e.g. two "os" chunks
+         */
+        esp_err_t stage();
+
+        /**
+         * Activate the staged chunks, the new application runs after a restart.
+         */
+        esp_err_t commit();
+
+        // forget the progress of this deployment, staged slots stay inactive
+        void abort();
+
+        /**
+         * Finish a commit() interrupted by a reset. Call once at startup,
+         * before data partitions are used.
+         */
+        static esp_err_t recover();
+
+        /**
+         * Activate the data slots used before the last commit that switched
+         * the application again, called when that application is rolled back.
+         */
+        static esp_err_t rollback();
+
+        // 0 or 1, the slot of a data partition pair currently in use
+        static uint8_t activeSlot(const std::string& part);
+
+    private:
+        typedef struct {
+            char part[HAWKBIT_INSTALL_PART_LENGTH];
+            uint8_t slot;
+        } Slot;
+
+        // persisted progress, a single NVS blob so it is updated atomically
+        typedef struct {
+            uint32_t version;
+            char id[32];
+            uint32_t staged;    // one bit per chunk
+            uint8_t committing;
+            char app[HAWKBIT_INSTALL_PART_LENGTH];
+            Slot slots[HAWKBIT_INSTALL_MAX_TARGETS];
+        } Progress;
+
+        // data slots before a commit that also switched the application
+        typedef struct {
+            uint32_t version;
+            char id[32];
+            char app[HAWKBIT_INSTALL_PART_LENGTH];
+            Slot slots[HAWKBIT_INSTALL_MAX_TARGETS];
+        } Previous;
+
+        typedef struct {
+            std::string part;
+            const esp_partition_t* slots[2];
+        } Target;
+
+        HawkbitClient& _client;
+        const Deployment& _deployment;
+        std::vector<Target> _targets;
+        Progress _progress;
+
+        const esp_partition_t* partition(const Chunk& chunk, uint8_t& slot) const;
+        esp_err_t download(const Chunk& chunk, const Artifact& artifact, const esp_partition_t* partition, bool app);
+        static const Artifact* payload(const Chunk& chunk);
+        esp_err_t verify(const esp_partition_t* partition, const Artifact& artifact) const;
+
+        bool load();
+        esp_err_t save() const;
+
+        static esp_err_t apply(const Progress& progress);
+        static esp_err_t complete(Progress& progress);
+        static bool readSlots(Slot* slots);
+        static bool readPrevious(Previous& previous);
+};
@@ -0,0 +1,94 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+// JSON library used to build request bodies, select with
+// -DHAWKBIT_JSON_BACKEND=HAWKBIT_JSON_CJSON to use the cJSON component that
+// ships with ESP-IDF instead of ArduinoJson. Responses are read by DdiParser
+// and don't depend on either. The ArduinoJson dependency in library.json is
+// only needed by the default backend, with cJSON it can be left out, e.g.
+// with lib_ignore = ArduinoJson in platformio.ini.
+#define HAWKBIT_JSON_ARDUINOJSON 1
+#define HAWKBIT_JSON_CJSON 2
+
+#ifndef HAWKBIT_JSON_BACKEND
+#define HAWKBIT_JSON_BACKEND HAWKBIT_JSON_ARDUINOJSON
+#endif
+
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+#include <ArduinoJson.h>
+#elif HAWKBIT_JSON_BACKEND != HAWKBIT_JSON_CJSON
+#error "Unknown HAWKBIT_JSON_BACKEND"
+#endif
+
+/**
+ * Serializes the DDI request bodies. Every backend implements this class in
+ * its own translation unit, only the selected one is compiled.
+ */
+class JsonWriter {
+    public:
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+        JsonWriter(JsonDocument& doc) :
+            _doc(doc)
+        {
+        }
+#else
+        JsonWriter()
+        {
+        }
+#endif
+
+        /**
+         * Serialize a feedback body into out.
+         * @return length of the body, 0 if it doesn't fit into size bytes
+         */
+        size_t feedback(
+            char* out,
+            size_t size,
+            const std::string& id,
+            const std::string& execution,
+            const std::string& finished,
+            const std::vector<std::string>& details
+            );
+
+        size_t registration(
+            char* out,
+            size_t size,
+            const char* mode,
+            const std::map<std::string,std::string>& data,
+            const std::vector<std::string>& details
+            );
+
+        // same as above, into a string of any length
+        size_t feedback(
+            std::string& out,
+            const std::string& id,
+            const std::string& execution,
+            const std::string& finished,
+            const std::vector<std::string>& details
+            );
+
+        size_t registration(
+            std::string& out,
+            const char* mode,
+            const std::map<std::string,std::string>& data,
+            const std::vector<std::string>& details
+            );
+
+    private:
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+        JsonDocument& _doc;
+#endif
+};
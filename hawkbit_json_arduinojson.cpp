@@ -0,0 +1,92 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_json.h"
+
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+
+// a document that ran out of memory lacks values, it isn't sent
+static size_t serialize(JsonDocument& doc, char* out, size_t size)
+{
+    if (doc.overflowed() || measureJson(doc) >= size) {
+        return 0;
+    }
+    return serializeJson(doc, out, size);
+}
+
+static size_t serialize(JsonDocument& doc, std::string& out)
+{
+    out.clear();
+    if (doc.overflowed()) {
+        return 0;
+    }
+    return serializeJson(doc, out);
+}
+
+static void feedbackDocument(JsonDocument& doc, const std::string& id, const std::string& execution, const std::string& finished, const std::vector<std::string>& details)
+{
+    doc.clear();
+
+    doc["id"] = id;
+
+    JsonArray d = doc["status"].createNestedArray("details");
+    for (const std::string& detail : details) {
+        d.add(detail);
+    }
+
+    doc["status"]["execution"] = execution;
+    doc["status"]["result"]["finished"] = finished;
+}
+
+static void registrationDocument(JsonDocument& doc, const char* mode, const std::map<std::string,std::string>& data, const std::vector<std::string>& details)
+{
+    doc.clear();
+
+    doc["mode"] = mode;
+
+    doc.createNestedObject("data");
+    for (const auto& entry : data) {
+        doc["data"][entry.first] = entry.second;
+    }
+
+    JsonArray d = doc["status"].createNestedArray("details");
+    for (const std::string& detail : details) {
+        d.add(detail);
+    }
+
+    doc["status"]["execution"] = "closed";
+    doc["status"]["result"]["finished"] = "success";
+}
+
+size_t JsonWriter::feedback(char* out, size_t size, const std::string& id, const std::string& execution, const std::string& finished, const std::vector<std::string>& details)
+{
+    feedbackDocument(_doc, id, execution, finished, details);
+    return serialize(_doc, out, size);
+}
+
+size_t JsonWriter::feedback(std::string& out, const std::string& id, const std::string& execution, const std::string& finished, const std::vector<std::string>& details)
+{
+    feedbackDocument(_doc, id, execution, finished, details);
+    return serialize(_doc, out);
+}
+
+size_t JsonWriter::registration(char* out, size_t size, const char* mode, const std::map<std::string,std::string>& data, const std::vector<std::string>& details)
+{
+    registrationDocument(_doc, mode, data, details);
+    return serialize(_doc, out, size);
+}
+
+size_t JsonWriter::registration(std::string& out, const char* mode, const std::map<std::string,std::string>& data, const std::vector<std::string>& details)
+{
+    registrationDocument(_doc, mode, data, details);
+    return serialize(_doc, out);
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_json.h"
+
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_CJSON
+
+#include "cJSON.h"
+#include <string.h>
+
+// every cJSON_Create/Add* allocates, each of them returns NULL or false when that fails
+static bool addStatus(cJSON* root, const char* execution, const char* finished, const std::vector<std::string>& details)
+{
+    cJSON* status = cJSON_AddObjectToObject(root, "status");
+    cJSON* d = cJSON_AddArrayToObject(status, "details");
+    if (d == NULL) {
+        return false;
+    }
+    for (const std::string& detail : details) {
+        if (!cJSON_AddItemToArray(d, cJSON_CreateString(detail.c_str()))) {
+            return false;
+        }
+    }
+
+    cJSON* result = NULL;
+    return cJSON_AddStringToObject(status, "execution", execution) != NULL &&
+        (result = cJSON_AddObjectToObject(status, "result")) != NULL &&
+        cJSON_AddStringToObject(result, "finished", finished) != NULL;
+}
+
+// a document that couldn't be built completely is deleted, NULL is printed as 0 bytes
+static cJSON* complete(cJSON* root, bool ok)
+{
+    if (!ok) {
+        cJSON_Delete(root);
+        return NULL;
+    }
+    return root;
+}
+
+static size_t print(cJSON* root, char* out, size_t size)
+{
+    // cJSON needs a few bytes of headroom in preallocated buffers
+    size_t len = 0;
+    if (root != NULL && size > 5 && cJSON_PrintPreallocated(root, out, size - 5, false)) {
+        len = strlen(out);
+    }
+    cJSON_Delete(root);
+    return len;
+}
+
+static size_t print(cJSON* root, std::string& out)
+{
+    char* printed = root != NULL ? cJSON_PrintUnformatted(root) : NULL;
+    cJSON_Delete(root);
+    if (printed == NULL) {
+        out.clear();
+        return 0;
+    }
+    out = printed;
+    cJSON_free(printed);
+    return out.size();
+}
+
+static cJSON* feedbackDocument(const std::string& id, const std::string& execution, const std::string& finished, const std::vector<std::string>& details)
+{
+    cJSON* root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    bool ok = cJSON_AddStringToObject(root, "id", id.c_str()) != NULL &&
+        addStatus(root, execution.c_str(), finished.c_str(), details);
+    return complete(root, ok);
+}
+
+static cJSON* registrationDocument(const char* mode, const std::map<std::string,std::string>& data, const std::vector<std::string>& details)
+{
+    cJSON* root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    bool ok = cJSON_AddStringToObject(root, "mode", mode) != NULL;
+
+    cJSON* d = ok ? cJSON_AddObjectToObject(root, "data") : NULL;
+    ok = d != NULL;
+    for (const std::pair<const std::string,std::string>& entry : data) {
+        ok = ok && cJSON_AddStringToObject(d, entry.first.c_str(), entry.second.c_str()) != NULL;
+    }
+
+    ok = ok && addStatus(root, "closed", "success", details);
+    return complete(root, ok);
+}
+
+size_t JsonWriter::feedback(char* out, size_t size, const std::string& id, const std::string& execution, const std::string& finished, const std::vector<std::string>& details)
+{
+    return print(feedbackDocument(id, execution, finished, details), out, size);
+}
+
+size_t JsonWriter::feedback(std::string& out, const std::string& id, const std::string& execution, const std::string& finished, const std::vector<std::string>& details)
+{
+    return print(feedbackDocument(id, execution, finished, details), out);
+}
+
+size_t JsonWriter::registration(char* out, size_t size, const char* mode, const std::map<std::string,std::string>& data, const std::vector<std::string>& details)
+{
+    return print(registrationDocument(mode, data, details), out, size);
+}
+
+size_t JsonWriter::registration(std::string& out, const char* mode, const std::map<std::string,std::string>& data, const std::vector<std::string>& details)
+{
+    return print(registrationDocument(mode, data, details), out);
+}
+
+#endif
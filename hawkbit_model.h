@@ -0,0 +1,240 @@
+/* Original Copyright Notice */
+/*******************************************************************************
+ * Copyright (c) 2020 Red Hat Inc
+ *
+ * See the NOTICE file(s) distributed with this work for additional
+ * information regarding copyright ownership.
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+/* 
+ * Modified by Martin Schuessler
+ * Copyright (c) 2023 Martin Schuessler
+ */
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <list>
+#include <stdint.h>
+#include "esp_log.h"
+
+// The deployment model DdiParser builds, free of ESP-IDF dependencies other
+// than logging so the parser can be built on a host (see test/).
+
+class Artifact {
+    public:
+        Artifact(
+            const std::string& filename,
+            uint32_t size,
+            const std::map<std::string,std::string>& hashes,
+            const std::map<std::string,std::string>& links
+            ) :
+            _filename(filename),
+            _size(size),
+            _hashes(hashes),
+            _links(links)
+        {
+        }
+
+        const std::string& filename() const { return _filename; }
+        uint32_t size() const { return _size; }
+        const std::map<std::string,std::string>& hashes() const { return _hashes; }
+        const std::map<std::string,std::string>& links() const { return _links; }
+
+        void dump(const std::string& prefix = "") const {
+             ESP_LOGI(prefix.c_str(),"%s %u\n", this->_filename.c_str(), this->_size);
+             ESP_LOGI(prefix.c_str(),"Hashes");
+             for (std::pair<std::string,std::string> element : this->_hashes) {
+                 ESP_LOGI(prefix.c_str(), "    %s = %s\n", element.first.c_str(), element.second.c_str());
+             }
+            ESP_LOGI(prefix.c_str(),"Links");
+             for (std::pair<std::string,std::string> element : this->_links) {
+                 ESP_LOGI(prefix.c_str(), "    %s = %s\n", element.first.c_str(), element.second.c_str());
+             }
+         }
+
+    private:
+        std::string _filename;
+        uint32_t _size;
+        std::map<std::string,std::string> _hashes;
+        std::map<std::string,std::string> _links;
+};
+
+class Chunk {
+    public:
+        Chunk(const std::string& part, const std::string& version, const std::string& name, const std::list<Artifact>& artifacts) :
+            _part(part),
+            _version(version),
+            _name(name),
+            _artifacts(artifacts)
+        {
+        }
+
+        const std::string& part() const { return _part; }
+        const std::string& version() const { return _version; }
+        const std::string& name() const { return _name; }
+        const std::list<Artifact>& artifacts() const { return _artifacts; }
+
+        void dump(const std::string& prefix = "") const {
+             ESP_LOGI(prefix.c_str(),"%s - %s (%s)\n", this->_name.c_str(), this->_version.c_str(), this->_part.c_str());
+             for (Artifact a: this->_artifacts) {
+                 a.dump(prefix + "    ");
+             }
+         }
+
+    private:
+        std::string _part;
+        std::string _version;
+        std::string _name;
+        std::list<Artifact> _artifacts;
+};
+
+class Deployment {
+    public:
+        Deployment() {
+        }
+
+        Deployment(const std::string& id, const std::string& download, const std::string& update, const std::list<Chunk>& chunks) :
+            _id(id),
+            _download(download),
+            _update(update),
+            _chunks(chunks)
+        {
+        }
+
+        const std::string& id() const { return _id; }
+        const std::list<Chunk>& chunks() const { return _chunks; }
+
+        void dump(const std::string& prefix = "") const {
+             ESP_LOGI(prefix.c_str(),"Deployment: %s\n", this->_id.c_str());
+             ESP_LOGI(prefix.c_str(),"    Download: %s, Update: %s\n", this->_download.c_str(), this->_update.c_str());
+             ESP_LOGI(prefix.c_str(),"    Chunks:");
+             std::string chunkPrefix = prefix + "        ";
+             for (Chunk c : this->_chunks) {
+                 c.dump(chunkPrefix);
+             }
+             ESP_LOGI(prefix.c_str(), "");
+         };
+    private:
+        std::string _id;
+        std::string _download;
+        std::string _update;
+        std::list<Chunk> _chunks;
+};
+
+class Stop {
+    public:
+        Stop() {
+        }
+
+        Stop(const std::string&id) :
+            _id(id)
+        {}
+
+        const std::string& id() const { return this->_id; }
+
+        void dump(const std::string& prefix = "") const
+        {
+            ESP_LOGI(prefix.c_str(),"Stop: %s\n", this->_id.c_str());
+        }
+    private:
+        std::string _id;
+};
+
+class Registration {
+    public:
+        Registration()
+        {
+        }
+
+        Registration(const std::string& url):
+            _url(url)
+        {
+        }
+
+        const std::string& url() const { return this->_url; }
+
+        void dump(const std::string& prefix = "") const
+        {
+            ESP_LOGI(prefix.c_str(),"Registration: %s\n", this->_url.c_str());
+        }
+
+    private:
+        std::string _url;
+};
+
+class State {
+
+    public:
+
+        typedef enum { NONE, REGISTER, UPDATE, CANCEL } Type;
+
+        State() :
+            _type(State::NONE)
+        {
+        }
+
+        State(const Stop& stop) :
+            _type(State::CANCEL),
+            _stop(stop)
+        {
+        }
+
+        State(const Registration& registration) :
+            _type(State::REGISTER),
+            _registration(registration)
+        {
+        }
+
+        State(const Deployment& deployment) :
+            _type(State::UPDATE),
+            _deployment(deployment)
+        {
+        }
+
+        bool is(Type type) const
+        {
+            return this->_type == type;
+        }
+
+        Type type() const { return this->_type; }
+        const Deployment& deployment() const { return this->_deployment; }
+        const Stop& stop() const { return this->_stop; }
+        const Registration& registration() const { return this->_registration; }
+
+        void dump(const std::string& prefix = "") const
+        {
+            switch (this->_type) {
+                case State::NONE:
+                    ESP_LOGI(prefix.c_str(),"State <NONE>");
+                    break;
+                case State::UPDATE:
+                    ESP_LOGI(prefix.c_str(),"State <UPDATE>");
+                    this->_deployment.dump("    ");
+                    break;
+                case State::CANCEL:
+                    ESP_LOGI(prefix.c_str(),"State <CANCEL>");
+                    this->_stop.dump("    ");
+                    break;
+                case State::REGISTER:
+                    ESP_LOGI(prefix.c_str(),"State <REGISTER>");
+                    this->_registration.dump("    ");
+                    break;
+                default:
+                    ESP_LOGI(prefix.c_str(),"State <UNKNOWN>");
+                    break;
+            }
+        }
+
+    private:
+        Type _type;
+        Deployment _deployment;
+        Stop _stop;
+        Registration _registration;
+};
@@ -0,0 +1,360 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_multicast.h"
+#include "hawkbit_hash.h"
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+static const char* TAG = "hawkbit";
+
+static const char PACKET_MAGIC[4] = { 'H', 'B', 'M', 'C' };
+
+typedef struct {
+    char magic[4];
+    uint32_t session;   // leading bytes of the artifact's sha256
+    uint32_t size;      // of the artifact
+    uint32_t group;
+    uint16_t index;     // HAWKBIT_MULTICAST_GROUP for the parity packet
+    uint16_t len;
+} PacketHeader;
+
+#define PACKET_SIZE (sizeof(PacketHeader) + HAWKBIT_MULTICAST_BLOCK)
+#define RECEIVE_TIMEOUT_MS 100
+
+static bool session(const Artifact& artifact, uint32_t& id)
+{
+    auto hash = artifact.hashes().find("sha256");
+    if (hash == artifact.hashes().end() || hash->second.size() < 8) {
+        ESP_LOGE(TAG, "Multicast: %s has no sha256", artifact.filename().c_str());
+        return false;
+    }
+    id = strtoul(hash->second.substr(0, 8).c_str(), NULL, 16);
+    return true;
+}
+
+static size_t packetLength(uint32_t size, uint32_t packet)
+{
+    return std::min<size_t>(HAWKBIT_MULTICAST_BLOCK, size - packet * HAWKBIT_MULTICAST_BLOCK);
+}
+
+// the sender paces one group per tick, the group timeout covers the time the
+// sending itself takes
+static int64_t roundTime(uint32_t groups)
+{
+    return (int64_t) groups * portTICK_PERIOD_MS * 1000 + HAWKBIT_MULTICAST_GROUP_TIMEOUT_MS * 1000LL;
+}
+
+/**
+ * Continues a reception with a download of the rest of the artifact. The
+ * receiver begins and ends the sink, the download only adds to it.
+ */
+class RestSink : public DownloadSink {
+    public:
+        RestSink(DownloadSink& sink, Sha256& sha256, DownloadStats& stats) :
+            _sink(sink),
+            _sha256(sha256),
+            _stats(stats)
+        {
+        }
+
+        esp_err_t begin(const Artifact& artifact) override
+        {
+            return ESP_OK;
+        }
+
+        esp_err_t write(const uint8_t* data, size_t len) override
+        {
+            this->_sha256.update(data, len);
+            int64_t writeStart = esp_timer_get_time();
+            esp_err_t err = this->_sink.write(data, len);
+            this->_stats.flashWrite += (esp_timer_get_time() - writeStart) / 1000;
+            this->_stats.bytes += len;
+            return err;
+        }
+
+    private:
+        DownloadSink& _sink;
+        Sha256& _sha256;
+        DownloadStats& _stats;
+};
+
+esp_err_t MulticastSender::send(const Artifact& artifact, FILE* file, uint8_t rounds)
+{
+    uint32_t id;
+    if (!session(artifact, id)) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(this->_port);
+    if (inet_aton(this->_address.c_str(), &to.sin_addr) == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        return ESP_FAIL;
+    }
+    uint8_t ttl = HAWKBIT_MULTICAST_TTL;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    uint32_t packets = (artifact.size() + HAWKBIT_MULTICAST_BLOCK - 1) / HAWKBIT_MULTICAST_BLOCK;
+    uint32_t groups = (packets + HAWKBIT_MULTICAST_GROUP - 1) / HAWKBIT_MULTICAST_GROUP;
+    std::vector<uint8_t> packet(PACKET_SIZE);
+    std::vector<uint8_t> parity(HAWKBIT_MULTICAST_BLOCK);
+    PacketHeader* header = (PacketHeader*) &packet[0];
+    uint8_t* payload = &packet[sizeof(PacketHeader)];
+    memcpy(header->magic, PACKET_MAGIC, sizeof(PACKET_MAGIC));
+    header->session = id;
+    header->size = artifact.size();
+
+    ESP_LOGI(TAG, "MulticastSender: sending %s to %s:%u, %u rounds", artifact.filename().c_str(), this->_address.c_str(), this->_port, rounds);
+
+    esp_err_t err = ESP_OK;
+    for (uint8_t round = 0; round < rounds && err == ESP_OK; round++) {
+        for (uint32_t group = 0; group < groups && err == ESP_OK; group++) {
+            std::fill(parity.begin(), parity.end(), 0);
+            header->group = group;
+
+            for (uint16_t index = 0; index <= HAWKBIT_MULTICAST_GROUP && err == ESP_OK; index++) {
+                uint32_t number = group * HAWKBIT_MULTICAST_GROUP + index;
+                size_t len;
+                if (index == HAWKBIT_MULTICAST_GROUP) {
+                    memcpy(payload, &parity[0], parity.size());
+                    len = parity.size();
+                } else if (number < packets) {
+                    len = packetLength(artifact.size(), number);
+                    if (fseek(file, number * HAWKBIT_MULTICAST_BLOCK, SEEK_SET) != 0 || fread(payload, 1, len, file) != len) {
+                        err = ESP_ERR_INVALID_SIZE;
+                        break;
+                    }
+                    for (size_t i = 0; i < len; i++) {
+                        parity[i] ^= payload[i];
+                    }
+                } else {
+                    // last group is short, its parity still follows
+                    continue;
+                }
+
+                header->index = index;
+                header->len = len;
+                // lwIP runs out of buffers when sending faster than the link
+                int attempts = 0;
+                while (sendto(sock, &packet[0], sizeof(PacketHeader) + len, 0, (struct sockaddr*) &to, sizeof(to)) < 0) {
+                    if (++attempts == 10) {
+                        ESP_LOGE(TAG, "MulticastSender: send failed");
+                        err = ESP_FAIL;
+                        break;
+                    }
+                    vTaskDelay(1);
+                }
+            }
+            // pace one group per tick
+            vTaskDelay(1);
+        }
+    }
+
+    closesocket(sock);
+    return err;
+}
+
+DownloadResult MulticastReceiver::receive(const Artifact& artifact, DownloadSink& sink, const std::string& linkType)
+{
+    DownloadStats stats;
+    stats.filename = artifact.filename();
+    int64_t start = esp_timer_get_time();
+    this->_recovered = 0;
+    this->_fetched = 0;
+
+    uint32_t id;
+    if (!session(artifact, id)) {
+        return DownloadResult(0, ESP_ERR_NOT_SUPPORTED, stats);
+    }
+    std::string expected = artifact.hashes().at("sha256");
+    std::transform(expected.begin(), expected.end(), expected.begin(), ::tolower);
+
+    struct ip_mreq membership = {};
+    if (inet_aton(this->_address.c_str(), &membership.imr_multiaddr) == 0) {
+        return DownloadResult(0, ESP_ERR_INVALID_ARG, stats);
+    }
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        return DownloadResult(0, ESP_FAIL, stats);
+    }
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct timeval timeout = { 0, RECEIVE_TIMEOUT_MS * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(this->_port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*) &local, sizeof(local)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        ESP_LOGE(TAG, "MulticastReceiver: can't join %s:%u", this->_address.c_str(), this->_port);
+        closesocket(sock);
+        return DownloadResult(0, ESP_FAIL, stats);
+    }
+
+    esp_err_t err = sink.begin(artifact);
+    if (err != ESP_OK) {
+        closesocket(sock);
+        return DownloadResult(0, err, stats);
+    }
+
+    uint32_t packets = (artifact.size() + HAWKBIT_MULTICAST_BLOCK - 1) / HAWKBIT_MULTICAST_BLOCK;
+    uint32_t groups = (packets + HAWKBIT_MULTICAST_GROUP - 1) / HAWKBIT_MULTICAST_GROUP;
+    std::vector<uint8_t> packet(PACKET_SIZE);
+    std::vector<uint8_t> data(HAWKBIT_MULTICAST_GROUP * HAWKBIT_MULTICAST_BLOCK);
+    std::vector<uint8_t> parity(HAWKBIT_MULTICAST_BLOCK);
+    const PacketHeader* header = (const PacketHeader*) &packet[0];
+    Sha256 sha256;
+    int held = 0;
+
+    for (uint32_t group = 0; group < groups && err == ESP_OK; group++) {
+        uint32_t first = group * HAWKBIT_MULTICAST_GROUP;
+        size_t count = std::min<size_t>(HAWKBIT_MULTICAST_GROUP, packets - first);
+        bool have[HAWKBIT_MULTICAST_GROUP] = {};
+        bool haveParity = false;
+        bool seen = false;
+        bool waiting = false;
+        size_t missing = count;
+        // short packets are padded with zeros for the parity
+        std::fill(data.begin(), data.end(), 0);
+
+        int64_t deadline = esp_timer_get_time() + HAWKBIT_MULTICAST_GROUP_TIMEOUT_MS * 1000LL;
+        while (missing > 0 && !(missing == 1 && haveParity) && esp_timer_get_time() < deadline) {
+            // a packet that ended the previous group may start this one
+            int n = held > 0 ? held : recv(sock, &packet[0], packet.size(), 0);
+            held = 0;
+            if (n < (int) sizeof(PacketHeader) ||
+                memcmp(header->magic, PACKET_MAGIC, sizeof(PACKET_MAGIC)) != 0 ||
+                header->session != id || header->size != artifact.size() ||
+                header->len > HAWKBIT_MULTICAST_BLOCK || n != (int)(sizeof(PacketHeader) + header->len)) {
+                continue;
+            }
+            if (header->group != group) {
+                if (seen) {
+                    // the sender moved on, the rest of this group won't come before the next round
+                    held = n;
+                    break;
+                }
+                if (!waiting) {
+                    // the sender is busy with other groups, this one comes
+                    // again within a round
+                    deadline = std::max(deadline, esp_timer_get_time() + roundTime(groups));
+                    waiting = true;
+                }
+                continue;
+            }
+            seen = true;
+
+            const uint8_t* payload = &packet[sizeof(PacketHeader)];
+            if (header->index == HAWKBIT_MULTICAST_GROUP) {
+                if (!haveParity) {
+                    memcpy(&parity[0], payload, header->len);
+                    haveParity = true;
+                }
+            } else if (header->index < count && !have[header->index] && header->len == packetLength(artifact.size(), first + header->index)) {
+                memcpy(&data[header->index * HAWKBIT_MULTICAST_BLOCK], payload, header->len);
+                have[header->index] = true;
+                missing--;
+            }
+        }
+
+        if (!seen) {
+            // no sender in reach, one download is cheaper than a range
+            // request per group
+            ESP_LOGW(TAG, "MulticastReceiver: nothing received for group %u, downloading the rest", group);
+            RestSink rest(sink, sha256, stats);
+            DownloadResult result = this->_client.download(artifact, rest, linkType, first * HAWKBIT_MULTICAST_BLOCK);
+            err = result.error();
+            if (err == ESP_OK && result.code() != HttpStatus_Ok && result.code() != HTTP_PARTIAL_CONTENT) {
+                err = ESP_FAIL;
+            }
+            this->_fetched += packets - first;
+            break;
+        }
+
+        if (missing == 1 && haveParity) {
+            size_t lost = std::find(have, have + count, false) - have;
+            uint8_t* block = &data[lost * HAWKBIT_MULTICAST_BLOCK];
+            memcpy(block, &parity[0], HAWKBIT_MULTICAST_BLOCK);
+            for (size_t i = 0; i < count; i++) {
+                if (i == lost) {
+                    continue;
+                }
+                const uint8_t* other = &data[i * HAWKBIT_MULTICAST_BLOCK];
+                for (size_t j = 0; j < HAWKBIT_MULTICAST_BLOCK; j++) {
+                    block[j] ^= other[j];
+                }
+            }
+            have[lost] = true;
+            missing = 0;
+            this->_recovered++;
+        }
+
+        // fetch runs of missing packets with one range request each
+        for (size_t i = 0; i < count && missing > 0 && err == ESP_OK; ) {
+            if (have[i]) {
+                i++;
+                continue;
+            }
+            size_t end = i;
+            size_t len = 0;
+            while (end < count && !have[end]) {
+                len += packetLength(artifact.size(), first + end);
+                have[end++] = true;
+            }
+            err = this->_client.downloadRange(artifact, (first + i) * HAWKBIT_MULTICAST_BLOCK, &data[i * HAWKBIT_MULTICAST_BLOCK], len, linkType);
+            this->_fetched += end - i;
+            missing -= end - i;
+            i = end;
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "MulticastReceiver: group %u incomplete: %s", group, esp_err_to_name(err));
+            break;
+        }
+
+        size_t len = std::min<size_t>(count * HAWKBIT_MULTICAST_BLOCK, artifact.size() - first * HAWKBIT_MULTICAST_BLOCK);
+        sha256.update(&data[0], len);
+        int64_t writeStart = esp_timer_get_time();
+        err = sink.write(&data[0], len);
+        stats.flashWrite += (esp_timer_get_time() - writeStart) / 1000;
+        stats.bytes += len;
+    }
+
+    setsockopt(sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &membership, sizeof(membership));
+    closesocket(sock);
+
+    if (err == ESP_OK && sha256.finishHex() != expected) {
+        ESP_LOGE(TAG, "MulticastReceiver: sha256 mismatch for %s", artifact.filename().c_str());
+        err = ESP_ERR_INVALID_CRC;
+    }
+    esp_err_t endErr = sink.end(err == ESP_OK);
+    if (err == ESP_OK) {
+        err = endErr;
+    }
+
+    stats.duration = (esp_timer_get_time() - start) / 1000;
+    ESP_LOGI(TAG, "MulticastReceiver: %s, %u packets restored, %u fetched by unicast", stats.summary().c_str(), this->_recovered, this->_fetched);
+    return DownloadResult(HttpStatus_Ok, err, stats);
+}
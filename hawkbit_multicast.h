@@ -0,0 +1,113 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include "hawkbit.h"
+
+// Multicast group and port the artifacts are sent to
+#ifndef HAWKBIT_MULTICAST_ADDRESS
+#define HAWKBIT_MULTICAST_ADDRESS "239.255.66.66"
+#endif
+
+#ifndef HAWKBIT_MULTICAST_PORT
+#define HAWKBIT_MULTICAST_PORT 6666
+#endif
+
+// Payload bytes per packet, small enough to never be fragmented
+#ifndef HAWKBIT_MULTICAST_BLOCK
+#define HAWKBIT_MULTICAST_BLOCK 1024
+#endif
+
+// Data packets protected by one parity packet. A receiver can restore one
+// lost packet per group, more losses are fetched by unicast.
+#ifndef HAWKBIT_MULTICAST_GROUP
+#define HAWKBIT_MULTICAST_GROUP 8
+#endif
+
+// How long a receiver waits for the first packet of a group before it
+// downloads the rest of the artifact by unicast. While packets of other groups
+// arrive it waits up to a whole round longer.
+#ifndef HAWKBIT_MULTICAST_GROUP_TIMEOUT_MS
+#define HAWKBIT_MULTICAST_GROUP_TIMEOUT_MS 3000
+#endif
+
+// Time-to-live of the packets, 1 keeps them in the local network
+#ifndef HAWKBIT_MULTICAST_TTL
+#define HAWKBIT_MULTICAST_TTL 1
+#endif
+
+/**
+ * Sends a verified artifact to all devices of the local network at once.
+ *
+ * The artifact is split into numbered packets, groups of
+ * HAWKBIT_MULTICAST_GROUP of them followed by an XOR parity packet, and sent
+ * to the multicast group round after round. The content comes from a file,
+ * e.g. ArtifactCache::open().
+ */
+class MulticastSender {
+    public:
+        MulticastSender(const char* address = HAWKBIT_MULTICAST_ADDRESS, uint16_t port = HAWKBIT_MULTICAST_PORT) :
+            _address(address),
+            _port(port)
+        {
+        }
+
+        /**
+         * @param artifact the artifact, its sha256 identifies the transfer
+         * @param file content of the artifact, read from the start
+         * @param rounds how often the whole artifact is sent
+         */
+        esp_err_t send(const Artifact& artifact, FILE* file, uint8_t rounds = 3);
+
+    private:
+        std::string _address;
+        uint16_t _port;
+};
+
+/**
+ * Receives an artifact sent by a MulticastSender into a sink.
+ *
+ * Groups are written to the sink in order. A group is complete when all its
+ * data packets or all but one and the parity packet arrived. Packets still
+ * missing when the sender moved on to the next group are fetched with range
+ * requests through the HawkbitClient. A receiver that joins in the middle of a
+ * round, or lost a whole group, waits for the group to come again in the next
+ * round. When nothing of a group arrived within
+ * HAWKBIT_MULTICAST_GROUP_TIMEOUT_MS, or within a round while the sender is
+ * busy with other groups, the rest of the artifact is downloaded with a
+ * single request. That is also what happens to a receiver that joins during
+ * the last round. The result is checked against the sha256 of the
+ * artifact before the sink is ended successfully.
+ */
+class MulticastReceiver {
+    public:
+        MulticastReceiver(HawkbitClient& client, const char* address = HAWKBIT_MULTICAST_ADDRESS, uint16_t port = HAWKBIT_MULTICAST_PORT) :
+            _client(client),
+            _address(address),
+            _port(port)
+        {
+        }
+
+        DownloadResult receive(const Artifact& artifact, DownloadSink& sink, const std::string& linkType = "download");
+
+        // packets of the last transfer restored from parity and fetched by unicast
+        uint32_t recovered() const { return this->_recovered; }
+        uint32_t fetched() const { return this->_fetched; }
+
+    private:
+        HawkbitClient& _client;
+        std::string _address;
+        uint16_t _port;
+        uint32_t _recovered = 0;
+        uint32_t _fetched = 0;
+};
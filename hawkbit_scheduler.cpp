@@ -0,0 +1,245 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_scheduler.h"
+#include <algorithm>
+
+PollScheduler::PollScheduler(HawkbitClock& clock) :
+    _clock(clock)
+{
+    this->_lock = xSemaphoreCreateMutex();
+    this->_tick = currentTick();
+}
+
+PollScheduler::~PollScheduler()
+{
+    for (auto& timer : this->_timers) {
+        delete timer.second;
+    }
+    vSemaphoreDelete(this->_lock);
+}
+
+uint64_t PollScheduler::currentTick()
+{
+    return (uint64_t) this->_clock.now() / (HAWKBIT_SCHEDULER_TICK_MS * 1000);
+}
+
+PollScheduler::Timer PollScheduler::newId()
+{
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    Timer id = ++this->_lastId;
+    if (id == 0) {
+        id = ++this->_lastId;
+    }
+    xSemaphoreGive(this->_lock);
+    return id;
+}
+
+PollScheduler::Timer PollScheduler::schedule(uint32_t delay, std::function<void()> callback)
+{
+    Timer id = newId();
+    add(id, delay, callback);
+    return id;
+}
+
+PollScheduler::Timer PollScheduler::poll(HawkbitClient& client, std::function<void(HawkbitClient&)> poll)
+{
+    Timer id = newId();
+    add(id, 0, [this, id, &client, poll]() {
+        reschedule(id, client, poll);
+    });
+    return id;
+}
+
+void PollScheduler::reschedule(Timer id, HawkbitClient& client, std::function<void(HawkbitClient&)> poll)
+{
+    poll(client);
+
+    // the response may have changed the polling time
+    uint32_t delay = (uint32_t) std::min<uint64_t>((uint64_t) client.getPollingTime() * 1000, UINT32_MAX);
+
+    // checked and added under one lock, a cancel() in between would be lost
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    if (!this->_runningCancelled) {
+        addLocked(id, delay, [this, id, &client, poll]() {
+            reschedule(id, client, poll);
+        });
+    }
+    xSemaphoreGive(this->_lock);
+}
+
+void PollScheduler::add(Timer id, uint32_t delay, std::function<void()> callback)
+{
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    addLocked(id, delay, callback);
+    xSemaphoreGive(this->_lock);
+}
+
+void PollScheduler::addLocked(Timer id, uint32_t delay, std::function<void()> callback)
+{
+    // the first tick at which the delay has fully passed
+    const uint64_t tickUs = HAWKBIT_SCHEDULER_TICK_MS * 1000;
+    uint64_t due = ((uint64_t) this->_clock.now() + (uint64_t) delay * 1000 + tickUs - 1) / tickUs;
+
+    Entry* entry = new Entry{ id, std::max(due, this->_tick + 1), callback, NULL, NULL, NULL };
+    this->_timers[id] = entry;
+    insert(entry);
+}
+
+void PollScheduler::insert(Entry* entry)
+{
+    uint64_t delta = entry->due - this->_tick;
+    uint64_t at = entry->due;
+    int level;
+    if (delta < SLOTS) {
+        level = 0;
+    } else if (delta < (uint64_t) SLOTS << BITS) {
+        level = 1;
+    } else {
+        level = 2;
+        if (delta >= (uint64_t) 1 << (BITS * LEVELS)) {
+            // beyond the wheel, park it in the slot cascaded last, it is
+            // inserted again from there
+            at = this->_tick + ((uint64_t) 1 << (BITS * LEVELS)) - 1;
+        }
+    }
+
+    Entry** slot = &this->_slots[level][(at >> (BITS * level)) & (SLOTS - 1)];
+    entry->slot = slot;
+    entry->prev = NULL;
+    entry->next = *slot;
+    if (*slot) {
+        (*slot)->prev = entry;
+    }
+    *slot = entry;
+}
+
+void PollScheduler::unlink(Entry* entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        *entry->slot = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    }
+}
+
+void PollScheduler::cascade(int level)
+{
+    Entry** slot = &this->_slots[level][(this->_tick >> (BITS * level)) & (SLOTS - 1)];
+    Entry* entry = *slot;
+    *slot = NULL;
+    while (entry) {
+        Entry* next = entry->next;
+        insert(entry);
+        entry = next;
+    }
+}
+
+bool PollScheduler::cancel(Timer timer)
+{
+    bool cancelled = false;
+
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    auto it = this->_timers.find(timer);
+    if (it != this->_timers.end()) {
+        unlink(it->second);
+        delete it->second;
+        this->_timers.erase(it);
+        cancelled = true;
+    } else if (timer == this->_running && !this->_runningCancelled) {
+        // stops a poll from being scheduled again
+        this->_runningCancelled = true;
+        cancelled = true;
+    }
+    xSemaphoreGive(this->_lock);
+    return cancelled;
+}
+
+void PollScheduler::runDue()
+{
+    uint64_t now = currentTick();
+
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    while (this->_tick < now) {
+        if (this->_timers.empty()) {
+            // nothing to cascade or fire on the way
+            this->_tick = now;
+            break;
+        }
+
+        this->_tick++;
+        if ((this->_tick & (SLOTS - 1)) == 0) {
+            cascade(1);
+            if (((this->_tick >> BITS) & (SLOTS - 1)) == 0) {
+                cascade(2);
+            }
+        }
+
+        // callbacks can't add to this slot, the earliest tick they can add
+        // that maps to it is a whole level further and goes to level 1
+        Entry** slot = &this->_slots[0][this->_tick & (SLOTS - 1)];
+        while (*slot) {
+            Entry* entry = *slot;
+            unlink(entry);
+            this->_timers.erase(entry->id);
+            this->_running = entry->id;
+            this->_runningCancelled = false;
+            xSemaphoreGive(this->_lock);
+
+            entry->callback();
+            delete entry;
+
+            xSemaphoreTake(this->_lock, portMAX_DELAY);
+            this->_running = 0;
+        }
+    }
+    xSemaphoreGive(this->_lock);
+}
+
+uint32_t PollScheduler::next()
+{
+    const uint64_t tickUs = HAWKBIT_SCHEDULER_TICK_MS * 1000;
+
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    uint64_t tick = this->_tick + SLOTS - (this->_tick & (SLOTS - 1));
+    for (int i = 1; i < SLOTS; i++) {
+        if (this->_slots[0][(this->_tick + i) & (SLOTS - 1)]) {
+            tick = this->_tick + i;
+            break;
+        }
+    }
+    xSemaphoreGive(this->_lock);
+
+    int64_t now = this->_clock.now();
+    int64_t wait = (int64_t)(tick * tickUs) - now;
+    return wait > 0 ? (uint32_t)((wait + 999) / 1000) : 0;
+}
+
+void PollScheduler::loop()
+{
+    for (;;) {
+        runDue();
+        uint32_t wait = next();
+        if (wait > 0) {
+            this->_clock.sleep(wait);
+        }
+    }
+}
+
+size_t PollScheduler::pending()
+{
+    xSemaphoreTake(this->_lock, portMAX_DELAY);
+    size_t pending = this->_timers.size();
+    xSemaphoreGive(this->_lock);
+    return pending;
+}
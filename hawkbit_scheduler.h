@@ -0,0 +1,115 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include "hawkbit.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Resolution of the scheduler, timers fire at most this late
+#ifndef HAWKBIT_SCHEDULER_TICK_MS
+#define HAWKBIT_SCHEDULER_TICK_MS 100
+#endif
+
+/**
+ * Runs the polls, retries and progress reports of many HawkbitClients, e.g.
+ * on a gateway updating the devices behind it, from one task.
+ *
+ * Timers are kept in a hierarchical timing wheel: three levels of 64 slots
+ * with HAWKBIT_SCHEDULER_TICK_MS, 64 and 4096 times that per slot. Adding
+ * and cancelling a timer takes constant time regardless of how many are
+ * pending, a timer further out than the top level covers (about 7 hours
+ * with the default tick) is moved down as its time comes closer.
+ *
+ * Callbacks run without the lock held and may schedule or cancel timers.
+ * With a VirtualClock, loop() jumps over idle time.
+ */
+class PollScheduler {
+    public:
+        typedef uint32_t Timer;
+
+        PollScheduler(HawkbitClock& clock = HawkbitClock::standard());
+        ~PollScheduler();
+
+        PollScheduler(const PollScheduler&) = delete;
+        PollScheduler& operator=(const PollScheduler&) = delete;
+
+        /**
+         * Run the callback once after delay ms.
+         */
+        Timer schedule(uint32_t delay, std::function<void()> callback);
+
+        /**
+         * Call poll with the client right away and then again every time
+         * the polling time the server gave that client has passed, until
+         * cancelled.
+         */
+        Timer poll(HawkbitClient& client, std::function<void(HawkbitClient&)> poll);
+
+        /**
+         * @return false when the timer already fired or was cancelled
+         */
+        bool cancel(Timer timer);
+
+        /**
+         * Run the callbacks that are due.
+         */
+        void runDue();
+
+        /**
+         * Milliseconds until runDue() has something to do, at most 64 ticks.
+         */
+        uint32_t next();
+
+        /**
+         * Run callbacks as they become due, forever.
+         */
+        void loop();
+
+        size_t pending();
+
+    private:
+        static const int LEVELS = 3;
+        static const int BITS = 6;
+        static const int SLOTS = 1 << BITS;
+
+        struct Entry {
+            Timer id;
+            uint64_t due;
+            std::function<void()> callback;
+            Entry** slot;
+            Entry* prev;
+            Entry* next;
+        };
+
+        HawkbitClock& _clock;
+        SemaphoreHandle_t _lock;
+        Entry* _slots[LEVELS][SLOTS] = {};
+        std::unordered_map<Timer, Entry*> _timers;
+        // all timers due up to and including this tick have fired
+        uint64_t _tick;
+        Timer _lastId = 0;
+        // the timer whose callback runs, it can cancel itself
+        Timer _running = 0;
+        bool _runningCancelled = false;
+
+        uint64_t currentTick();
+        Timer newId();
+        void add(Timer id, uint32_t delay, std::function<void()> callback);
+        // with _lock held
+        void addLocked(Timer id, uint32_t delay, std::function<void()> callback);
+        void insert(Entry* entry);
+        void unlink(Entry* entry);
+        void cascade(int level);
+        void reschedule(Timer id, HawkbitClient& client, std::function<void(HawkbitClient&)> poll);
+};
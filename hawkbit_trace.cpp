@@ -0,0 +1,147 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_trace.h"
+
+#if HAWKBIT_TRACE_ENABLED
+
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#if __has_include("sdkconfig.h")
+#include "sdkconfig.h"
+#endif
+
+#if !defined(HAWKBIT_TRACE_SYSVIEW) && defined(CONFIG_APPTRACE_SV_ENABLE)
+#define HAWKBIT_TRACE_SYSVIEW CONFIG_APPTRACE_SV_ENABLE
+#endif
+
+#if HAWKBIT_TRACE_SYSVIEW
+#include "SEGGER_SYSVIEW.h"
+#endif
+
+static const char* TAG = "hawkbit-trace";
+
+#define TRACE_MAGIC 0x52544248 // "HBTR"
+#define TRACE_VERSION 1
+#define DUMP_LINE 32
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entries;
+    uint32_t boots;
+    uint32_t head;      // number of entries ever written
+    HawkbitTrace::Entry ring[HAWKBIT_TRACE_ENTRIES];
+} TraceBuffer;
+
+RTC_NOINIT_ATTR static TraceBuffer s_trace;
+static bool s_started = false;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void append(uint32_t time, uint8_t event, uint8_t phase, uint16_t arg0, uint32_t arg1)
+{
+    HawkbitTrace::Entry& entry = s_trace.ring[s_trace.head % HAWKBIT_TRACE_ENTRIES];
+    s_trace.head++;
+    entry.time = time;
+    entry.event = event;
+    entry.phase = phase;
+    entry.arg0 = arg0;
+    entry.arg1 = arg1;
+}
+
+void HawkbitTrace::record(Event event, Phase phase, uint16_t arg0, uint32_t arg1)
+{
+    uint32_t time = (uint32_t) esp_timer_get_time();
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    if (!s_started) {
+        // first event since reset, RTC memory holds garbage after power on
+        s_started = true;
+        if (s_trace.magic != TRACE_MAGIC || s_trace.version != TRACE_VERSION || s_trace.entries != HAWKBIT_TRACE_ENTRIES) {
+            memset(&s_trace, 0, sizeof(s_trace));
+            s_trace.magic = TRACE_MAGIC;
+            s_trace.version = TRACE_VERSION;
+            s_trace.entries = HAWKBIT_TRACE_ENTRIES;
+        }
+        s_trace.boots++;
+        append(time, BOOT, INSTANT, esp_reset_reason(), s_trace.boots);
+    }
+    append(time, event, phase, arg0, arg1);
+    portEXIT_CRITICAL_SAFE(&s_lock);
+
+#if HAWKBIT_TRACE_SYSVIEW
+    // user module ids are the event ids, instants are formatted on the host
+    static const char* const NAMES[] = {
+        "BOOT", "REQUEST", "CONNECT", "STATUS", "PARSE", "FEEDBACK",
+        "DOWNLOAD", "DOWNLOAD_BLOCK", "FLASH_WRITE"
+    };
+    switch (phase) {
+        case BEGIN:
+            SEGGER_SYSVIEW_OnUserStart(event);
+            break;
+        case END:
+            SEGGER_SYSVIEW_OnUserStop(event);
+            break;
+        default:
+            SEGGER_SYSVIEW_PrintfHost("hawkbit %s %u %u", NAMES[event], arg0, arg1);
+            break;
+    }
+#endif
+}
+
+size_t HawkbitTrace::copy(uint8_t* out, size_t size)
+{
+    if (size < sizeof(s_trace)) {
+        return 0;
+    }
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    memcpy(out, &s_trace, sizeof(s_trace));
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    return sizeof(s_trace);
+}
+
+void HawkbitTrace::dump()
+{
+    static const char HEX[] = "0123456789abcdef";
+
+    ESP_LOGI(TAG, "begin %u", (unsigned) sizeof(s_trace));
+    for (size_t offset = 0; offset < sizeof(s_trace); offset += DUMP_LINE) {
+        uint8_t data[DUMP_LINE];
+        size_t len = sizeof(s_trace) - offset < DUMP_LINE ? sizeof(s_trace) - offset : DUMP_LINE;
+
+        portENTER_CRITICAL_SAFE(&s_lock);
+        memcpy(data, (const uint8_t*)&s_trace + offset, len);
+        portEXIT_CRITICAL_SAFE(&s_lock);
+
+        char line[2 * DUMP_LINE + 1];
+        for (size_t i = 0; i < len; i++) {
+            line[2 * i] = HEX[data[i] >> 4];
+            line[2 * i + 1] = HEX[data[i] & 0x0f];
+        }
+        line[2 * len] = '\0';
+        ESP_LOGI(TAG, "%06x %s", (unsigned) offset, line);
+    }
+    ESP_LOGI(TAG, "end");
+}
+
+void HawkbitTrace::clear()
+{
+    portENTER_CRITICAL_SAFE(&s_lock);
+    s_trace.magic = 0;
+    s_started = false;
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+#endif
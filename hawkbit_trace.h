@@ -0,0 +1,86 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Build with -DHAWKBIT_TRACE_ENABLED=1 to record the client's phases into a
+// ring buffer in RTC memory that survives resets. Decode a dump() from the
+// serial log with tools/hawkbit_trace.py, which also exports Chrome trace
+// event JSON for Perfetto. HawkbitTrace is only available in builds with
+// tracing enabled.
+//
+// If SystemView tracing is enabled in the app_trace component, the events are
+// forwarded as SystemView user markers as well, so they show up next to the
+// application's tasks. Set HAWKBIT_TRACE_SYSVIEW to 0 to keep them out.
+#ifndef HAWKBIT_TRACE_ENTRIES
+#define HAWKBIT_TRACE_ENTRIES 256
+#endif
+
+#if HAWKBIT_TRACE_ENABLED
+#define HAWKBIT_TRACE(event, arg0, arg1) HawkbitTrace::record(HawkbitTrace::event, HawkbitTrace::INSTANT, (arg0), (arg1))
+#define HAWKBIT_TRACE_BEGIN(event, arg0, arg1) HawkbitTrace::record(HawkbitTrace::event, HawkbitTrace::BEGIN, (arg0), (arg1))
+#define HAWKBIT_TRACE_END(event, arg0, arg1) HawkbitTrace::record(HawkbitTrace::event, HawkbitTrace::END, (arg0), (arg1))
+#else
+#define HAWKBIT_TRACE(event, arg0, arg1) do {} while (0)
+#define HAWKBIT_TRACE_BEGIN(event, arg0, arg1) do {} while (0)
+#define HAWKBIT_TRACE_END(event, arg0, arg1) do {} while (0)
+#endif
+
+/**
+ * Binary event trace of the client.
+ *
+ * Every event is 12 bytes: a microsecond timestamp, the event id, its phase
+ * and two small arguments. The first event after a reset is BOOT with the
+ * reset reason, so events of earlier boots stay distinguishable.
+ */
+class HawkbitTrace {
+    public:
+        // ids are part of the dump format, only append
+        typedef enum {
+            BOOT = 0,
+            REQUEST,        // arg0: Request, whole HTTP exchange
+            CONNECT,        // TCP and TLS established
+            STATUS,         // arg1: HTTP status
+            PARSE,          // arg0: DdiParser::Document, arg1: result
+            FEEDBACK,       // arg1: HTTP status
+            DOWNLOAD,       // arg1: artifact size / esp_err_t at the end
+            DOWNLOAD_BLOCK, // arg0: read length, arg1: offset
+            FLASH_WRITE,    // arg0: length, arg1: offset
+        } Event;
+
+        typedef enum { INSTANT = 0, BEGIN = 1, END = 2 } Phase;
+
+        // the first three match DdiParser::Document
+        typedef enum { STATE, DEPLOYMENT, CANCEL, FEEDBACK_REQUEST, REGISTRATION, ARTIFACT } Request;
+
+        typedef struct {
+            uint32_t time;
+            uint8_t event;
+            uint8_t phase;
+            uint16_t arg0;
+            uint32_t arg1;
+        } Entry;
+
+        static void record(Event event, Phase phase, uint16_t arg0, uint32_t arg1);
+
+        /**
+         * Copy the raw trace (header followed by the ring of entries) to out.
+         * @return number of bytes copied, 0 if size is too small
+         */
+        static size_t copy(uint8_t* out, size_t size);
+
+        // log the raw trace as hex lines, tagged "hawkbit-trace"
+        static void dump();
+
+        static void clear();
+};
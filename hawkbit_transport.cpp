@@ -0,0 +1,323 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#include "hawkbit_transport.h"
+#include <algorithm>
+#include <string>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char* TAG = "hawkbit";
+
+static const char RECORDING_MAGIC[4] = { 'H', 'B', 'R', 'T' };
+static const uint32_t RECORDING_VERSION = 2;
+
+// request headers set by HawkbitClient
+static const char* const RECORDED_HEADERS[] = { "Accept", "Content-Type", "Authorization", "Range" };
+
+static bool requestHeader(esp_http_client_handle_t http, const char* name, std::string& line)
+{
+    char* value = NULL;
+    if (esp_http_client_get_header(http, name, &value) != ESP_OK || value == NULL) {
+        return false;
+    }
+    // of Authorization only the scheme, it tells which token was used but the
+    // token stays on the device
+    const char* end = strcmp(name, "Authorization") == 0 ? strchr(value, ' ') : NULL;
+    line = std::string(name) + ": " + std::string(value, end ? end - value : strlen(value));
+    return true;
+}
+
+esp_err_t HawkbitTransport::open(esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen)
+{
+    // URL and method are already set on the handle
+    return esp_http_client_open(http, writeLen);
+}
+
+int HawkbitTransport::write(esp_http_client_handle_t http, const char* data, int len)
+{
+    return esp_http_client_write(http, data, len);
+}
+
+int64_t HawkbitTransport::fetchHeaders(esp_http_client_handle_t http)
+{
+    return esp_http_client_fetch_headers(http);
+}
+
+int HawkbitTransport::status(esp_http_client_handle_t http)
+{
+    return esp_http_client_get_status_code(http);
+}
+
+int HawkbitTransport::read(esp_http_client_handle_t http, char* buffer, int len)
+{
+    return esp_http_client_read(http, buffer, len);
+}
+
+void HawkbitTransport::close(esp_http_client_handle_t http)
+{
+    esp_http_client_close(http);
+}
+
+HawkbitTransport& HawkbitTransport::standard()
+{
+    static HawkbitTransport transport;
+    return transport;
+}
+
+RecordingTransport::RecordingTransport(FILE* out, HawkbitTransport& inner) :
+    _out(out),
+    _inner(inner)
+{
+    fwrite(RECORDING_MAGIC, 1, sizeof(RECORDING_MAGIC), this->_out);
+    fwrite(&RECORDING_VERSION, 1, sizeof(RECORDING_VERSION), this->_out);
+}
+
+void RecordingTransport::record(uint8_t type, int32_t value, const void* data, uint32_t len)
+{
+    Record record = {};
+    record.type = type;
+    record.time = (uint32_t)(esp_timer_get_time() - this->_start);
+    record.value = value;
+    record.len = len;
+
+    if (fwrite(&record, 1, sizeof(record), this->_out) != sizeof(record) ||
+        (len > 0 && fwrite(data, 1, len, this->_out) != len)) {
+        ESP_LOGE(TAG, "RecordingTransport: write failed");
+    }
+}
+
+esp_err_t RecordingTransport::open(esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen)
+{
+    this->_start = esp_timer_get_time();
+    record(R_OPEN, method, url, strlen(url));
+    for (const char* name : RECORDED_HEADERS) {
+        std::string line;
+        if (requestHeader(http, name, line)) {
+            record(R_REQUEST_HEADER, 0, line.data(), line.size());
+        }
+    }
+
+    esp_err_t err = this->_inner.open(http, method, url, writeLen);
+    record(R_CONNECT, err, NULL, 0);
+    return err;
+}
+
+int RecordingTransport::write(esp_http_client_handle_t http, const char* data, int len)
+{
+    int written = this->_inner.write(http, data, len);
+    record(R_WRITE, written, data, written > 0 ? written : 0);
+    return written;
+}
+
+int64_t RecordingTransport::fetchHeaders(esp_http_client_handle_t http)
+{
+    int64_t contentLength = this->_inner.fetchHeaders(http);
+    record(R_HEADERS, this->_inner.status(http), &contentLength, sizeof(contentLength));
+    return contentLength;
+}
+
+int RecordingTransport::status(esp_http_client_handle_t http)
+{
+    return this->_inner.status(http);
+}
+
+int RecordingTransport::read(esp_http_client_handle_t http, char* buffer, int len)
+{
+    int received = this->_inner.read(http, buffer, len);
+    record(R_READ, received, buffer, received > 0 ? received : 0);
+    return received;
+}
+
+void RecordingTransport::close(esp_http_client_handle_t http)
+{
+    this->_inner.close(http);
+    record(R_CLOSE, 0, NULL, 0);
+    fflush(this->_out);
+}
+
+ReplayTransport::ReplayTransport(FILE* in, float speed, HawkbitClock& clock) :
+    _in(in),
+    _speed(speed),
+    _clock(clock)
+{
+    char magic[sizeof(RECORDING_MAGIC)];
+    uint32_t version = 0;
+    if (fread(magic, 1, sizeof(magic), this->_in) != sizeof(magic) ||
+        fread(&version, 1, sizeof(version), this->_in) != sizeof(version) ||
+        memcmp(magic, RECORDING_MAGIC, sizeof(magic)) != 0 || version != RECORDING_VERSION) {
+        ESP_LOGE(TAG, "ReplayTransport: not a recording");
+        this->_ok = false;
+    }
+}
+
+bool ReplayTransport::peek(Record& record)
+{
+    if (!this->_ok) {
+        return false;
+    }
+
+    // rest of a response the client didn't read
+    if (this->_remaining > 0) {
+        fseek(this->_in, this->_remaining, SEEK_CUR);
+        this->_remaining = 0;
+    }
+
+    if (!this->_peeked) {
+        if (fread(&this->_record, 1, sizeof(this->_record), this->_in) != sizeof(this->_record)) {
+            this->_ok = false;
+            return false;
+        }
+        this->_peeked = true;
+    }
+    record = this->_record;
+    return true;
+}
+
+void ReplayTransport::skip()
+{
+    fseek(this->_in, this->_record.len, SEEK_CUR);
+    this->_peeked = false;
+}
+
+bool ReplayTransport::next(uint8_t type, Record& record)
+{
+    // records of an exchange are in type order, don't run into the next one
+    while (peek(record)) {
+        if (record.type == type) {
+            this->_peeked = false;
+            return true;
+        }
+        if (type != R_OPEN && (record.type > type || record.type == R_OPEN)) {
+            return false;
+        }
+        skip();
+    }
+    return false;
+}
+
+void ReplayTransport::wait(uint32_t time) const
+{
+    if (this->_speed <= 0) {
+        return;
+    }
+
+    int64_t delay = this->_start + (int64_t)(time / this->_speed) - this->_clock.now();
+    if (delay >= 1000) {
+        this->_clock.sleep(delay / 1000);
+    }
+}
+
+esp_err_t ReplayTransport::open(esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen)
+{
+    this->_start = this->_clock.now();
+    this->_status = 0;
+
+    Record record;
+    if (!next(R_OPEN, record)) {
+        ESP_LOGE(TAG, "ReplayTransport: recording exhausted at %s", url);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    std::string recorded(record.len, '\0');
+    if (record.len > 0 && fread(&recorded[0], 1, record.len, this->_in) != record.len) {
+        this->_ok = false;
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (record.value != method || recorded != url) {
+        ESP_LOGW(TAG, "ReplayTransport: request %s does not match recorded %s", url, recorded.c_str());
+    }
+
+    std::string headers;
+    while (peek(record) && record.type == R_REQUEST_HEADER) {
+        std::string line(record.len, '\0');
+        if (record.len > 0 && fread(&line[0], 1, record.len, this->_in) != record.len) {
+            this->_ok = false;
+            return ESP_ERR_NOT_FOUND;
+        }
+        this->_peeked = false;
+        headers += line + "\n";
+    }
+    std::string expected;
+    for (const char* name : RECORDED_HEADERS) {
+        std::string line;
+        if (requestHeader(http, name, line)) {
+            expected += line + "\n";
+        }
+    }
+    if (headers != expected) {
+        ESP_LOGW(TAG, "ReplayTransport: headers of %s do not match, sent:\n%srecorded:\n%s", url, expected.c_str(), headers.c_str());
+    }
+
+    if (!next(R_CONNECT, record)) {
+        return ESP_FAIL;
+    }
+    wait(record.time);
+    return record.value;
+}
+
+int ReplayTransport::write(esp_http_client_handle_t http, const char* data, int len)
+{
+    Record record;
+    if (next(R_WRITE, record)) {
+        fseek(this->_in, record.len, SEEK_CUR);
+        wait(record.time);
+    }
+    return len;
+}
+
+int64_t ReplayTransport::fetchHeaders(esp_http_client_handle_t http)
+{
+    Record record;
+    int64_t contentLength = -1;
+    if (!next(R_HEADERS, record) ||
+        record.len != sizeof(contentLength) ||
+        fread(&contentLength, 1, sizeof(contentLength), this->_in) != sizeof(contentLength)) {
+        return -1;
+    }
+    wait(record.time);
+    this->_status = record.value;
+    return contentLength;
+}
+
+int ReplayTransport::status(esp_http_client_handle_t http)
+{
+    return this->_status;
+}
+
+int ReplayTransport::read(esp_http_client_handle_t http, char* buffer, int len)
+{
+    if (this->_remaining == 0) {
+        Record record;
+        if (!next(R_READ, record)) {
+            return 0;
+        }
+        wait(record.time);
+        if (record.value <= 0) {
+            fseek(this->_in, record.len, SEEK_CUR);
+            return record.value;
+        }
+        this->_remaining = record.len;
+    }
+
+    // recorded reads may be split differently than the ones replayed
+    size_t n = fread(buffer, 1, std::min<uint32_t>(len, this->_remaining), this->_in);
+    this->_remaining -= n;
+    return n;
+}
+
+void ReplayTransport::close(esp_http_client_handle_t http)
+{
+    Record record;
+    next(R_CLOSE, record);
+}
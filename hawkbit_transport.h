@@ -0,0 +1,135 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_client.h"
+#include "hawkbit_clock.h"
+
+/**
+ * The HTTP exchanges of a HawkbitClient. Every request goes through
+ * open(), optionally write(), fetchHeaders(), read() and close() on a handle
+ * prepared by the client (URL, method and headers set). The default
+ * implementation passes them on to esp_http_client.
+ */
+class HawkbitTransport {
+    public:
+        virtual ~HawkbitTransport() {}
+
+        /**
+         * Send the request line and headers.
+         * @param writeLen length of the body, -1 for a chunked body
+         */
+        virtual esp_err_t open(esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen);
+        virtual int write(esp_http_client_handle_t http, const char* data, int len);
+        // @return content length of the response
+        virtual int64_t fetchHeaders(esp_http_client_handle_t http);
+        virtual int status(esp_http_client_handle_t http);
+        virtual int read(esp_http_client_handle_t http, char* buffer, int len);
+        virtual void close(esp_http_client_handle_t http);
+
+        // esp_http_client based transport used by default
+        static HawkbitTransport& standard();
+
+    protected:
+        // recording file format: "HBRT", version, then one record per call,
+        // R_REQUEST_HEADER records follow R_OPEN with "Name: value"
+        typedef enum { R_OPEN = 1, R_REQUEST_HEADER, R_CONNECT, R_WRITE, R_HEADERS, R_READ, R_CLOSE } RecordType;
+
+        typedef struct {
+            uint8_t type;
+            uint8_t reserved[3];
+            uint32_t time;      // microseconds since open()
+            int32_t value;
+            uint32_t len;       // of the data following the record
+        } Record;
+};
+
+/**
+ * Passes a session on to another transport and records every exchange
+ * (method, URL, request headers, request body, status, content length and
+ * response body, with timing) to a file, e.g. on SPIFFS or an SD card, for
+ * ReplayTransport.
+ *
+ * Of the request headers the ones the client sets are recorded: Accept,
+ * Content-Type, Range and of Authorization only the scheme, the token isn't
+ * written to the file. Response headers are not recorded, esp_http_client
+ * only hands them to the event handler of the handle, which belongs to the
+ * client.
+ */
+class RecordingTransport : public HawkbitTransport {
+    public:
+        /**
+         * @param out file opened for binary writing, owned by the caller
+         * @param inner transport doing the actual requests
+         */
+        RecordingTransport(FILE* out, HawkbitTransport& inner = HawkbitTransport::standard());
+
+        esp_err_t open(esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen) override;
+        int write(esp_http_client_handle_t http, const char* data, int len) override;
+        int64_t fetchHeaders(esp_http_client_handle_t http) override;
+        int status(esp_http_client_handle_t http) override;
+        int read(esp_http_client_handle_t http, char* buffer, int len) override;
+        void close(esp_http_client_handle_t http) override;
+
+    private:
+        FILE* _out;
+        HawkbitTransport& _inner;
+        int64_t _start = 0;
+
+        void record(uint8_t type, int32_t value, const void* data, uint32_t len);
+};
+
+/**
+ * Serves a session recorded by RecordingTransport without touching the
+ * network. Exchanges are replayed in order, a request whose method, URL or
+ * recorded headers don't match the recording is logged and answered with the
+ * recorded response anyway.
+ */
+class ReplayTransport : public HawkbitTransport {
+    public:
+        /**
+         * @param in recording opened for binary reading, owned by the caller
+         * @param speed 1 reproduces the recorded timing, 2 runs twice as fast,
+         *              0 replays without any delay
+         * @param clock waits for the recorded timing, with a VirtualClock
+         *              the time passes without delay
+         */
+        ReplayTransport(FILE* in, float speed = 0, HawkbitClock& clock = HawkbitClock::standard());
+
+        esp_err_t open(esp_http_client_handle_t http, esp_http_client_method_t method, const char* url, int writeLen) override;
+        int write(esp_http_client_handle_t http, const char* data, int len) override;
+        int64_t fetchHeaders(esp_http_client_handle_t http) override;
+        int status(esp_http_client_handle_t http) override;
+        int read(esp_http_client_handle_t http, char* buffer, int len) override;
+        void close(esp_http_client_handle_t http) override;
+
+        // false once the file isn't a recording or it is used up
+        bool ok() const { return this->_ok; }
+
+    private:
+        FILE* _in;
+        float _speed;
+        HawkbitClock& _clock;
+        bool _ok = true;
+        bool _peeked = false;
+        Record _record = {};
+        uint32_t _remaining = 0;
+        int64_t _start = 0;
+        int _status = 0;
+
+        bool peek(Record& record);
+        void skip();
+        bool next(uint8_t type, Record& record);
+        void wait(uint32_t time) const;
+};
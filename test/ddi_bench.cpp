@@ -0,0 +1,59 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+// Parse time of a deployment with 8 chunks of 8 artifacts, fed in pieces of
+// 512 bytes like the HTTP reads on the device. Compare ddi_bench with
+// ddi_bench_reference, the parser without HAWKBIT_DDI_BULK_SCAN.
+
+#include "hawkbit_ddi.h"
+#include "hawkbit_model.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+
+int main(int argc, char** argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+
+    std::string json = "{\"id\":\"42\",\"deployment\":{\"download\":\"forced\",\"update\":\"attempt\",\"chunks\":[";
+    for (int c = 0; c < 8; c++) {
+        json += c ? "," : "";
+        json += "{\"part\":\"bApp\",\"version\":\"1.0." + std::to_string(c) + "\",\"name\":\"application\",\"artifacts\":[";
+        for (int a = 0; a < 8; a++) {
+            std::string path = "https://hawkbit.example/DEFAULT/controller/v1/target/softwaremodules/" + std::to_string(c) + "/artifacts/image" + std::to_string(a) + ".bin";
+            json += a ? "," : "";
+            json += "{\n    \"filename\" : \"image" + std::to_string(a) + ".bin\",\n    \"hashes\" : {\n      \"sha1\" : \"" + std::string(40, 'b') +
+                "\",\n      \"md5\" : \"" + std::string(32, 'c') + "\",\n      \"sha256\" : \"" + std::string(64, 'd') +
+                "\"\n    },\n    \"size\" : 1048576,\n    \"_links\" : {\n      \"download\" : {\n        \"href\" : \"" + path +
+                "\"\n      },\n      \"download-http\" : {\n        \"href\" : \"" + path + "\"\n      }\n    }\n  }";
+        }
+        json += "]}";
+    }
+    json += "]}}";
+
+    DdiLimits limits;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        DdiParser parser(DdiParser::DEPLOYMENT, limits);
+        for (size_t fed = 0; fed < json.size(); fed += 512) {
+            parser.feed(json.data() + fed, std::min<size_t>(512, json.size() - fed));
+        }
+        if (!parser.finish() || parser.deployment().chunks().size() != 8) {
+            fprintf(stderr, "parse failed: %s\n", parser.error());
+            return 1;
+        }
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / rounds;
+
+    printf("%s: %zu bytes in %.1f us, %.1f MB/s\n", HAWKBIT_DDI_BULK_SCAN ? "bulk scan" : "per character",
+        json.size(), us, json.size() / us);
+    return 0;
+}
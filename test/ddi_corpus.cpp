@@ -0,0 +1,99 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+// Parses generated and randomly corrupted deployment documents, fed in random
+// pieces, and writes the outcome of each to a file. Built once with and once
+// without HAWKBIT_DDI_BULK_SCAN, the two files must be identical.
+
+#include "hawkbit_ddi.h"
+#include "hawkbit_model.h"
+#include <stdio.h>
+#include <random>
+#include <string>
+
+#define DOCUMENTS 3000
+
+static std::string document(std::mt19937& random)
+{
+    std::string json = "{\n  \"id\" : \"12\",\n \"deployment\": {\"download\":\"forced\",\"update\":\"attempt\",\"chunks\":[";
+    int chunks = random() % 4;
+    for (int c = 0; c < chunks; c++) {
+        json += c ? "," : "";
+        json += "{\"part\":\"bApp\",\"version\":\"1.\\u00e9\\ud83d\\ude00x" + std::to_string(random() % 100) + "\",\"name\":\"n\\\"q\\\\\",\t\"artifacts\":[";
+        int artifacts = random() % 3;
+        for (int a = 0; a < artifacts; a++) {
+            json += a ? "," : "";
+            json += "{\"filename\":\"f" + std::string(random() % 1500, 'a') + "\",\"size\": " + std::to_string(random() % 100000) +
+                " ,\"hashes\":{\"sha1\":\"abc\",\"md5\":\"def\"},\"_links\":{\"download\":{\"href\":\"https://x/y" +
+                std::string(random() % 40, 'z') + "\"}}}";
+        }
+        json += "]}";
+    }
+    json += "]},\"actionHistory\":{\"status\":\"x\",\"messages\":[\"a\",\"b\\n\"]}}  \n";
+
+    // every fourth document gets a character replaced
+    if (random() % 4 == 0) {
+        static const char CORRUPTIONS[] = "\"\\ \x01}]{[:,a";
+        json[random() % json.size()] = CORRUPTIONS[random() % (sizeof(CORRUPTIONS) - 1)];
+    }
+    return json;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <output>\n", argv[0]);
+        return 2;
+    }
+    FILE* out = fopen(argv[1], "w");
+    if (out == NULL) {
+        return 2;
+    }
+
+    std::mt19937 random(7);
+    for (int i = 0; i < DOCUMENTS; i++) {
+        std::string json = document(random);
+        DdiLimits limits;
+        if (i % 5 == 0) {
+            // runs cut off by the string limit at varying points
+            limits.string = 20 + random() % 1500;
+        }
+
+        DdiParser parser(DdiParser::DEPLOYMENT, limits);
+        bool ok = true;
+        for (size_t fed = 0; fed < json.size() && ok; ) {
+            size_t n = std::min<size_t>(1 + random() % 64, json.size() - fed);
+            ok = parser.feed(json.data() + fed, n);
+            fed += n;
+        }
+        ok = ok && parser.finish();
+
+        fprintf(out, "%d %d %s |", i, ok, parser.error() ? parser.error() : "-");
+        if (ok) {
+            Deployment deployment = parser.deployment();
+            fprintf(out, "%s", deployment.id().c_str());
+            for (const Chunk& chunk : deployment.chunks()) {
+                fprintf(out, " [%s %s %s", chunk.part().c_str(), chunk.version().c_str(), chunk.name().c_str());
+                for (const Artifact& artifact : chunk.artifacts()) {
+                    fprintf(out, " %s %u", artifact.filename().c_str(), artifact.size());
+                    for (const auto& hash : artifact.hashes()) {
+                        fprintf(out, " %s=%s", hash.first.c_str(), hash.second.c_str());
+                    }
+                    for (const auto& link : artifact.links()) {
+                        fprintf(out, " %s=%s", link.first.c_str(), link.second.c_str());
+                    }
+                }
+                fprintf(out, "]");
+            }
+        }
+        fprintf(out, "\n");
+    }
+    return fclose(out) == 0 ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+// Feeds DdiParser well-formed and pathological responses, checks that every
+// DdiLimits bound fails with its error as soon as it is hit and prints the
+// time and peak heap each input cost.
+
+#include "hawkbit_ddi.h"
+#include "hawkbit_model.h"
+#include "test_heap.h"
+#include <chrono>
+#include <string.h>
+#include <string>
+
+// the pathological inputs must fail before this much was parsed or allocated
+#define EARLY_BYTES (16 * 1024)
+#define EARLY_HEAP (64 * 1024)
+
+typedef struct {
+    bool ok;
+    const char* error;
+    size_t fed;
+    size_t peak;
+} Outcome;
+
+static Outcome parse(const char* name, DdiParser& parser, const std::string& input, size_t piece = 512)
+{
+    heapReset();
+    size_t before = heapPeak();
+    auto start = std::chrono::steady_clock::now();
+
+    Outcome outcome = { true, NULL, 0, 0 };
+    while (outcome.fed < input.size() && outcome.ok) {
+        size_t n = std::min(piece, input.size() - outcome.fed);
+        outcome.ok = parser.feed(input.data() + outcome.fed, n);
+        outcome.fed += n;
+    }
+    outcome.ok = outcome.ok && parser.finish();
+    outcome.error = parser.error();
+    outcome.peak = heapPeak() - before;
+
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    printf("%-24s %8zu of %8zu bytes %10.1f us %8zu bytes heap  %s\n",
+        name, outcome.fed, input.size(), us, outcome.peak, outcome.ok ? "ok" : outcome.error);
+    return outcome;
+}
+
+static bool failed(const Outcome& outcome, const char* error)
+{
+    return !outcome.ok && outcome.error != NULL && strcmp(outcome.error, error) == 0;
+}
+
+static bool early(const Outcome& outcome)
+{
+    return outcome.fed <= EARLY_BYTES && outcome.peak <= EARLY_HEAP;
+}
+
+static std::string artifact(int index, size_t nameLength = 16, int hashes = 3, int links = 2)
+{
+    std::string json = "{\"filename\":\"" + std::string(nameLength, 'f') + "\",\"size\":" + std::to_string(1000 + index) + ",\"hashes\":{";
+    for (int i = 0; i < hashes; i++) {
+        json += (i ? ",\"h" : "\"h") + std::to_string(i) + "\":\"" + std::string(64, 'a') + "\"";
+    }
+    json += "},\"_links\":{";
+    for (int i = 0; i < links; i++) {
+        json += (i ? ",\"l" : "\"l") + std::to_string(i) + "\":{\"href\":\"https://hawkbit.example/artifacts/" + std::to_string(index) + "\"}";
+    }
+    return json + "}}";
+}
+
+static std::string chunk(int artifacts, const std::string& item)
+{
+    std::string json = "{\"part\":\"os\",\"version\":\"1.0\",\"name\":\"app\",\"artifacts\":[";
+    for (int i = 0; i < artifacts; i++) {
+        json += (i ? "," : "") + item;
+    }
+    return json + "]}";
+}
+
+static std::string deployment(int chunks, const std::string& item)
+{
+    std::string json = "{\"id\":\"42\",\"deployment\":{\"download\":\"forced\",\"update\":\"attempt\",\"chunks\":[";
+    for (int i = 0; i < chunks; i++) {
+        json += (i ? "," : "") + item;
+    }
+    return json + "]},\"actionHistory\":{\"status\":\"x\",\"messages\":[\"a\"]}}";
+}
+
+static std::string controller(int links)
+{
+    std::string json = "{\"config\":{\"polling\":{\"sleep\":\"00:05:00\"}},\"_links\":{";
+    for (int i = 0; i < links; i++) {
+        json += (i ? ",\"l" : "\"l") + std::to_string(i) + "\":{\"href\":\"https://hawkbit.example/" + std::to_string(i) + "\"}";
+    }
+    return json + "}}";
+}
+
+int main()
+{
+    DdiLimits limits;
+    // lets the inputs below grow past the document size to show where they stop
+    DdiLimits unbounded;
+    unbounded.document = SIZE_MAX;
+
+    {
+        // everything at its limit
+        std::string item = artifact(0, limits.string, limits.hashes, limits.links);
+        std::string input = deployment(limits.chunks, chunk(limits.artifacts, item));
+        DdiLimits large = limits;
+        large.document = input.size();
+        DdiParser parser(DdiParser::DEPLOYMENT, large);
+        CHECK(parse("at limits", parser, input, 61).ok);
+        Deployment result = parser.deployment();
+        CHECK(result.id() == "42");
+        CHECK(result.chunks().size() == limits.chunks);
+        for (const Chunk& c : result.chunks()) {
+            CHECK(c.part() == "os" && c.artifacts().size() == limits.artifacts);
+            for (const Artifact& a : c.artifacts()) {
+                CHECK(a.filename().size() == limits.string);
+                CHECK(a.hashes().size() == limits.hashes && a.links().size() == limits.links);
+            }
+        }
+    }
+
+    {
+        DdiParser parser(DdiParser::CONTROLLER);
+        CHECK(parse("controller", parser, controller(2)).ok);
+        CHECK(parser.pollingSleep() == "00:05:00" && parser.links().size() == 2);
+    }
+
+    {
+        DdiParser parser(DdiParser::CANCEL);
+        CHECK(parse("cancel", parser, "{\"id\":\"7\",\"cancelAction\":{\"stopId\":\"7\"}}").ok);
+        CHECK(parser.stop().id() == "7");
+    }
+
+    {
+        std::string input = deployment(1, chunk(1, artifact(0))) + std::string(limits.document, ' ');
+        DdiParser parser(DdiParser::DEPLOYMENT);
+        Outcome outcome = parse("document too large", parser, input);
+        CHECK(failed(outcome, "TooLarge") && outcome.fed <= limits.document + 512);
+    }
+
+    {
+        DdiParser parser(DdiParser::DEPLOYMENT, unbounded);
+        Outcome outcome = parse("100000 chunks", parser, deployment(100000, chunk(0, "")));
+        CHECK(failed(outcome, "TooManyChunks") && early(outcome));
+    }
+
+    {
+        DdiParser parser(DdiParser::DEPLOYMENT, unbounded);
+        Outcome outcome = parse("10000 artifacts", parser, deployment(1, chunk(10000, artifact(0))));
+        CHECK(failed(outcome, "TooManyArtifacts") && early(outcome));
+    }
+
+    {
+        DdiParser parser(DdiParser::DEPLOYMENT, unbounded);
+        Outcome outcome = parse("1000 hashes", parser, deployment(1, chunk(1, artifact(0, 16, 1000))));
+        CHECK(failed(outcome, "TooManyHashes") && early(outcome));
+    }
+
+    {
+        DdiParser parser(DdiParser::DEPLOYMENT, unbounded);
+        Outcome outcome = parse("1000 artifact links", parser, deployment(1, chunk(1, artifact(0, 16, 3, 1000))));
+        CHECK(failed(outcome, "TooManyLinks") && early(outcome));
+    }
+
+    {
+        DdiParser parser(DdiParser::CONTROLLER, unbounded);
+        Outcome outcome = parse("1000 controller links", parser, controller(1000));
+        CHECK(failed(outcome, "TooManyLinks") && early(outcome));
+    }
+
+    {
+        DdiParser parser(DdiParser::DEPLOYMENT);
+        Outcome outcome = parse("long filename", parser, deployment(1, chunk(1, artifact(0, limits.string + 1))));
+        CHECK(failed(outcome, "StringTooLong"));
+    }
+
+    {
+        // huge details in a member the client doesn't even keep
+        std::string input = "{\"id\":\"1\",\"actionHistory\":{\"messages\":[\"" + std::string(1 << 20, 'x') + "\"]}}";
+        DdiParser parser(DdiParser::DEPLOYMENT, unbounded);
+        Outcome outcome = parse("1 MB string", parser, input);
+        CHECK(failed(outcome, "StringTooLong") && early(outcome));
+    }
+
+    {
+        std::string input = "{\"a\":" + std::string(limits.nesting - 1, '[') + std::string(limits.nesting - 1, ']') + "}";
+        DdiParser parser(DdiParser::DEPLOYMENT);
+        CHECK(parse("nesting at limit", parser, input).ok);
+    }
+
+    {
+        std::string input = "{\"a\":" + std::string(1 << 20, '[');
+        DdiParser parser(DdiParser::DEPLOYMENT, unbounded);
+        Outcome outcome = parse("1 MB nesting", parser, input);
+        CHECK(failed(outcome, "TooDeep") && early(outcome));
+    }
+
+    {
+        std::string input;
+        for (int i = 0; i < 1000; i++) {
+            input += "{\"_links\":";
+        }
+        input += "{}" + std::string(1000, '}');
+        DdiParser parser(DdiParser::CONTROLLER, unbounded);
+        Outcome outcome = parse("nested _links", parser, input);
+        CHECK(failed(outcome, "TooDeep") && early(outcome));
+    }
+
+    {
+        std::string input = deployment(1, chunk(1, artifact(0)));
+        DdiParser parser(DdiParser::DEPLOYMENT);
+        CHECK(failed(parse("truncated", parser, input.substr(0, input.size() / 2)), "IncompleteInput"));
+    }
+
+    {
+        DdiParser parser(DdiParser::DEPLOYMENT);
+        CHECK(failed(parse("not JSON", parser, "{\"id\":\"1\",}"), "InvalidInput"));
+    }
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,18 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+// Stands in for the ESP-IDF header in host builds of the pure logic parts
+#define ESP_LOGE(tag, ...) do { (void) (tag); } while (0)
+#define ESP_LOGW(tag, ...) do { (void) (tag); } while (0)
+#define ESP_LOGI(tag, ...) do { (void) (tag); } while (0)
+#define ESP_LOGD(tag, ...) do { (void) (tag); } while (0)
+#define ESP_LOGV(tag, ...) do { (void) (tag); } while (0)
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+// Peak heap while JsonWriter builds the feedback and registration bodies the
+// client sends, with the backend selected by HAWKBIT_JSON_BACKEND. Writes the
+// bodies to the file given as argument, they are the same for every backend.
+
+#include "hawkbit_json.h"
+#include "test_heap.h"
+#include <functional>
+#include <string.h>
+
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+// capacity of the document the application hands to the client
+#define JSON_CAPACITY 2048
+
+struct HeapAllocator {
+    void* allocate(size_t size) { return heapAlloc(size); }
+    void deallocate(void* p) { heapFree(p); }
+    void* reallocate(void* p, size_t size) { return heapRealloc(p, size); }
+};
+#else
+#include "cJSON.h"
+#endif
+
+// same as the client's request buffer, MAX_HTTP_OUTPUT_BUFFER
+#define BODY_SIZE 2048
+
+static FILE* s_out;
+
+static size_t measure(const char* name, std::function<size_t()> build)
+{
+    heapReset();
+    size_t before = heapPeak();
+    size_t len = build();
+    size_t peak = heapPeak() - before;
+    printf("%-24s %6zu bytes body %8zu bytes heap\n", name, len, peak);
+    return len;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2 || (s_out = fopen(argv[1], "w")) == NULL) {
+        fprintf(stderr, "usage: %s <output>\n", argv[0]);
+        return 2;
+    }
+
+#if HAWKBIT_JSON_BACKEND == HAWKBIT_JSON_ARDUINOJSON
+    heapReset();
+    BasicJsonDocument<HeapAllocator> doc(JSON_CAPACITY);
+    printf("ArduinoJson, document of %zu bytes allocated by the application\n", heapPeak());
+    // as the client gets it, not as the allocator specific type
+    JsonDocument& document = doc;
+    JsonWriter json(document);
+#else
+    cJSON_Hooks hooks = { heapAlloc, heapFree };
+    cJSON_InitHooks(&hooks);
+    printf("cJSON\n");
+    JsonWriter json;
+#endif
+
+    // a closed deployment with the download summary, as reportComplete() sends it
+    std::vector<std::string> details = {
+        "Downloaded app.bin: 1048576 bytes in 9120 ms, 114978 B/s, ttfb 310 ms, flash 2210 ms",
+        "Installed into ota_1",
+        "Health check passed: broker, sensor",
+    };
+    // the attributes of downloadAttributes() and a few of the application
+    std::map<std::string,std::string> data = {
+        { "ota.download.bytes", "1048576" }, { "ota.download.Bps", "114978" },
+        { "ota.download.ttfb_ms", "310" }, { "ota.download.flash_ms", "2210" },
+        { "ota.download.retries", "0" }, { "ota.download.resumes", "0" },
+        { "hw.revision", "3" }, { "fw.version", "1.4.2" }, { "mac", "24:6f:28:aa:bb:cc" },
+        { "idf.version", "v5.1.2" }, { "app.name", "sensor-node" }, { "boot.count", "17" },
+    };
+
+    char body[BODY_SIZE];
+    std::string out;
+    size_t len;
+
+    len = measure("feedback", [&]() {
+        return json.feedback(body, sizeof(body), "1042", "closed", "success", details);
+    });
+    CHECK(len > 0);
+    fprintf(s_out, "%.*s\n", (int) len, body);
+
+    len = measure("feedback std::string", [&]() {
+        return json.feedback(out, "1042", "closed", "success", details);
+    });
+    CHECK(len > 0 && out == std::string(body, len));
+
+    len = measure("registration", [&]() {
+        return json.registration(body, sizeof(body), "merge", data, { "registered" });
+    });
+    CHECK(len > 0);
+    fprintf(s_out, "%.*s\n", (int) len, body);
+
+    len = measure("registration std::string", [&]() {
+        return json.registration(out, "merge", data, { "registered" });
+    });
+    CHECK(len > 0 && out == std::string(body, len));
+
+    return fclose(s_out) == 0 ? 0 : 1;
+}
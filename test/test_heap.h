@@ -0,0 +1,93 @@
+/*******************************************************************************
+ * Copyright (c) 2023 Martin Schuessler
+ *
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License 2.0 which is available at
+ * http://www.eclipse.org/legal/epl-2.0
+ *
+ * SPDX-License-Identifier: EPL-2.0
+ *******************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+// Include in exactly one file of a test executable: counts the bytes
+// allocated with new or heapAlloc(), the peak is reset by heapReset().
+// heapAlloc() and heapFree() can be handed to C libraries as allocator.
+static size_t s_heapUsed = 0;
+static size_t s_heapPeak = 0;
+
+static inline void heapReset()
+{
+    s_heapPeak = s_heapUsed;
+}
+
+static inline size_t heapPeak()
+{
+    return s_heapPeak;
+}
+
+static inline void* heapAlloc(size_t size)
+{
+    size_t* block = (size_t*) malloc(sizeof(size_t) * 2 + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block[0] = size;
+    s_heapUsed += size;
+    if (s_heapUsed > s_heapPeak) {
+        s_heapPeak = s_heapUsed;
+    }
+    return block + 2;
+}
+
+static inline void heapFree(void* p)
+{
+    if (p != NULL) {
+        size_t* block = (size_t*) p - 2;
+        s_heapUsed -= block[0];
+        free(block);
+    }
+}
+
+static inline void* heapRealloc(void* p, size_t size)
+{
+    void* moved = heapAlloc(size);
+    if (moved != NULL && p != NULL) {
+        memcpy(moved, p, std::min(size, ((size_t*) p - 2)[0]));
+        heapFree(p);
+    }
+    return moved;
+}
+
+void* operator new(size_t size)
+{
+    void* p = heapAlloc(size);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    heapFree(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    heapFree(p);
+}
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
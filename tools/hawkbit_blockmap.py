@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Martin Schuessler
+#
+# This program and the accompanying materials are made available under the
+# terms of the Eclipse Public License 2.0 which is available at
+# http://www.eclipse.org/legal/epl-2.0
+#
+# SPDX-License-Identifier: EPL-2.0
+#
+"""Create the block map for an artifact, for BlockMap and VerifyingSink.
+
+    python tools/hawkbit_blockmap.py build/app.bin
+    python tools/hawkbit_blockmap.py build/app.bin --block-size 8192
+
+Writes app.bin.blockmap next to the artifact. Upload it as a second artifact
+of the same software module.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"HBBM"
+VERSION = 1
+# HAWKBIT_BLOCKMAP_MAX_BLOCK on the device
+MAX_BLOCK = 32 * 1024
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("artifact", help="artifact file")
+    parser.add_argument("--block-size", type=int, default=16 * 1024, help="bytes per block (default 16384)")
+    parser.add_argument("-o", "--output", help="block map file (default <artifact>.blockmap)")
+    args = parser.parse_args()
+
+    if args.block_size <= 0 or args.block_size > MAX_BLOCK:
+        sys.exit("block size must be between 1 and %d" % MAX_BLOCK)
+
+    digests = []
+    with open(args.artifact, "rb") as f:
+        while True:
+            block = f.read(args.block_size)
+            if not block:
+                break
+            digests.append(hashlib.sha256(block).digest())
+
+    output = args.output or args.artifact + ".blockmap"
+    with open(output, "wb") as f:
+        f.write(MAGIC + struct.pack("<III", VERSION, args.block_size, len(digests)))
+        f.write(b"".join(digests))
+    print("%s: %d blocks of %d bytes" % (output, len(digests), args.block_size))
+
+
+if __name__ == "__main__":
+    main()
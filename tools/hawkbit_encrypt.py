@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Martin Schuessler
+#
+# This program and the accompanying materials are made available under the
+# terms of the Eclipse Public License 2.0 which is available at
+# http://www.eclipse.org/legal/epl-2.0
+#
+# SPDX-License-Identifier: EPL-2.0
+#
+"""Encrypt an artifact for DecryptingSink with AES-GCM.
+
+    python tools/hawkbit_encrypt.py build/app.bin --key device.key
+    python tools/hawkbit_encrypt.py --generate-key device.key
+
+The key file holds 16, 24 or 32 raw bytes, the same key has to be given to
+DecryptingSink on the device. Writes app.bin.enc next to the artifact,
+upload that one. Needs the "cryptography" package.
+"""
+
+import argparse
+import os
+import sys
+
+from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+
+MAGIC = b"HBGC"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("artifact", nargs="?", help="artifact file")
+    parser.add_argument("--key", help="file with the raw AES key")
+    parser.add_argument("--generate-key", metavar="FILE", help="write a new random 256 bit key and exit")
+    parser.add_argument("-o", "--output", help="encrypted file (default <artifact>.enc)")
+    args = parser.parse_args()
+
+    if args.generate_key:
+        with open(args.generate_key, "wb") as f:
+            f.write(AESGCM.generate_key(bit_length=256))
+        return
+
+    if not args.artifact or not args.key:
+        parser.error("artifact and --key are required")
+
+    with open(args.key, "rb") as f:
+        key = f.read()
+    if len(key) not in (16, 24, 32):
+        sys.exit("key must be 16, 24 or 32 bytes")
+
+    with open(args.artifact, "rb") as f:
+        data = f.read()
+
+    # a fresh IV for every encryption, never reuse one with the same key
+    iv = os.urandom(12)
+    # AESGCM appends the 16 byte tag to the ciphertext
+    encrypted = AESGCM(key).encrypt(iv, data, None)
+
+    output = args.output or args.artifact + ".enc"
+    with open(output, "wb") as f:
+        f.write(MAGIC + iv + encrypted)
+    print("%s: %d bytes" % (output, len(MAGIC) + len(iv) + len(encrypted)))
+
+
+if __name__ == "__main__":
+    main()
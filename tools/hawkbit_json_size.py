@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Martin Schuessler
+#
+# This program and the accompanying materials are made available under the
+# terms of the Eclipse Public License 2.0 which is available at
+# http://www.eclipse.org/legal/epl-2.0
+#
+# SPDX-License-Identifier: EPL-2.0
+#
+"""Compare the code size of an application with both JSON backends.
+
+    python tools/hawkbit_json_size.py path/to/project
+
+Builds the ESP-IDF project once per HAWKBIT_JSON_BACKEND, each in a build
+directory of its own, and prints `idf.py size-components` of every archive
+whose size differs. The project forwards the backend to the compiler, e.g. in
+its CMakeLists.txt after include($ENV{IDF_PATH}/tools/cmake/project.cmake):
+
+    if(DEFINED HAWKBIT_JSON_BACKEND)
+        idf_build_set_property(COMPILE_OPTIONS "-DHAWKBIT_JSON_BACKEND=${HAWKBIT_JSON_BACKEND}" APPEND)
+    endif()
+
+The heap the backends take while building request bodies is measured by the
+json_heap host tests in test/.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+BACKENDS = ["HAWKBIT_JSON_ARDUINOJSON", "HAWKBIT_JSON_CJSON"]
+
+
+def size_components(project, backend):
+    build = os.path.join(project, "build-" + backend.lower())
+    output = os.path.join(build, "size-components.json")
+    subprocess.run(["idf.py", "-C", project, "-B", build, "-DHAWKBIT_JSON_BACKEND=" + backend,
+                    "size-components", "--format", "json", "--output-file", output], check=True)
+    with open(output) as f:
+        archives = json.load(f)
+
+    sizes = {}
+    for name, size in archives.items():
+        if not isinstance(size, dict):
+            continue
+        # older idf_size versions have no total
+        sizes[name] = size.get("total", sum(v for v in size.values() if isinstance(v, int)))
+    return sizes
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("project", help="ESP-IDF project using the client")
+    args = parser.parse_args()
+
+    arduinojson, cjson = (size_components(args.project, backend) for backend in BACKENDS)
+
+    rows = []
+    for name in sorted(set(arduinojson) | set(cjson)):
+        a, c = arduinojson.get(name, 0), cjson.get(name, 0)
+        if a != c:
+            rows.append((name, a, c))
+    if not rows:
+        sys.exit("no difference, is HAWKBIT_JSON_BACKEND passed to the compiler?")
+
+    print("%-32s %12s %12s %8s" % ("archive", "ArduinoJson", "cJSON", "delta"))
+    for name, a, c in sorted(rows, key=lambda row: row[2] - row[1]):
+        print("%-32s %12d %12d %+8d" % (name, a, c, c - a))
+    print("%-32s %12d %12d %+8d" % ("total", sum(arduinojson.values()), sum(cjson.values()),
+                                      sum(cjson.values()) - sum(arduinojson.values())))
+
+
+if __name__ == "__main__":
+    main()
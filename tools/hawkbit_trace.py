@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Martin Schuessler
+#
+# This program and the accompanying materials are made available under the
+# terms of the Eclipse Public License 2.0 which is available at
+# http://www.eclipse.org/legal/epl-2.0
+#
+# SPDX-License-Identifier: EPL-2.0
+#
+"""Decode a HawkbitTrace::dump() from a serial log.
+
+    idf.py monitor | tee monitor.log
+    python tools/hawkbit_trace.py monitor.log
+    python tools/hawkbit_trace.py monitor.log --chrome trace.json
+
+The Chrome trace event file opens in Perfetto (ui.perfetto.dev) and
+chrome://tracing, every boot in the trace is shown as a separate process.
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+MAGIC = 0x52544248
+HEADER = struct.Struct("<IHHII")
+ENTRY = struct.Struct("<IBBHI")
+
+# must match HawkbitTrace::Event, HawkbitTrace::Phase and HawkbitTrace::Request
+EVENTS = ["BOOT", "REQUEST", "CONNECT", "STATUS", "PARSE", "FEEDBACK",
+          "DOWNLOAD", "DOWNLOAD_BLOCK", "FLASH_WRITE"]
+PHASES = ["", "begin", "end"]
+REQUESTS = ["state", "deployment", "cancel", "feedback", "registration", "artifact"]
+RESET_REASONS = ["unknown", "poweron", "ext", "sw", "panic", "int_wdt", "task_wdt",
+                 "wdt", "deepsleep", "brownout", "sdio"]
+
+LINE = re.compile(r"hawkbit-trace: (?:(begin) (\d+)|(end)|([0-9a-f]{6}) ([0-9a-f]+))")
+
+
+def read_dump(lines):
+    """Return the raw bytes of the last complete dump in lines."""
+    dump = None
+    data = None
+    for line in lines:
+        match = LINE.search(line)
+        if not match:
+            continue
+        if match.group(1):
+            data = bytearray()
+            size = int(match.group(2))
+        elif match.group(3):
+            if data is not None and len(data) == size:
+                dump = bytes(data)
+            data = None
+        elif data is not None:
+            if int(match.group(4), 16) != len(data):
+                data = None  # lost a line
+                continue
+            data += bytes.fromhex(match.group(5))
+    return dump
+
+
+def decode(dump):
+    """Return the entries of a raw trace, oldest first."""
+    magic, version, count, boots, head = HEADER.unpack_from(dump)
+    if magic != MAGIC or version != 1:
+        raise ValueError("not a hawkbit trace (magic %08x, version %d)" % (magic, version))
+    first = max(0, head - count)
+    entries = []
+    for n in range(first, head):
+        offset = HEADER.size + (n % count) * ENTRY.size
+        entries.append(ENTRY.unpack_from(dump, offset))
+    return boots, entries
+
+
+def describe(event, phase, arg0, arg1):
+    name = EVENTS[event] if event < len(EVENTS) else "EVENT_%d" % event
+    if event == 0:
+        reason = RESET_REASONS[arg0] if arg0 < len(RESET_REASONS) else arg0
+        return "BOOT #%d reset reason %s" % (arg1, reason)
+    if event in (1, 4):
+        kind = REQUESTS[arg0] if arg0 < len(REQUESTS) else arg0
+        return "%s %s %s %d" % (name, kind, PHASES[phase], arg1)
+    return "%s %s %d %d" % (name, PHASES[phase] if phase < len(PHASES) else phase, arg0, arg1)
+
+
+def timeline(entries):
+    """Yield (boot, microseconds since boot, entry), undoing 32 bit wrap around."""
+    boot = 0
+    last = 0
+    wraps = 0
+    for entry in entries:
+        time, event, arg1 = entry[0], entry[1], entry[4]
+        if event == 0:
+            boot, last, wraps = arg1, 0, 0
+        elif time < last:
+            wraps += 1
+        last = time
+        yield boot, time + (wraps << 32), entry
+
+
+def chrome(entries):
+    """Chrome trace events, flash writes on their own track (writer task)."""
+    events = []
+    for boot, time, (_, event, phase, arg0, arg1) in timeline(entries):
+        name = EVENTS[event] if event < len(EVENTS) else "EVENT_%d" % event
+        if event in (1, 4) and arg0 < len(REQUESTS):
+            name += " " + REQUESTS[arg0]
+        item = {
+            "name": name,
+            "cat": "hawkbit",
+            "ph": {0: "i", 1: "B", 2: "E"}.get(phase, "i"),
+            "ts": time,
+            "pid": boot,
+            "tid": 2 if event == 8 else 1,
+            "args": {"arg0": arg0, "arg1": arg1},
+        }
+        if item["ph"] == "i":
+            item["s"] = "t"
+        events.append(item)
+
+    for boot in sorted(set(e["pid"] for e in events)):
+        events.append({"name": "process_name", "ph": "M", "pid": boot, "args": {"name": "boot %d" % boot}})
+        events.append({"name": "thread_name", "ph": "M", "pid": boot, "tid": 1, "args": {"name": "client"}})
+        events.append({"name": "thread_name", "ph": "M", "pid": boot, "tid": 2, "args": {"name": "flash"}})
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a hawkbit-trace dump from a serial log")
+    parser.add_argument("log", nargs="?", help="serial log, stdin if omitted")
+    parser.add_argument("--chrome", metavar="FILE", help="write Chrome trace event JSON to FILE")
+    args = parser.parse_args()
+
+    source = open(args.log, errors="replace") if args.log else sys.stdin
+    dump = read_dump(source)
+    if dump is None:
+        sys.exit("no complete hawkbit-trace dump found")
+
+    boots, entries = decode(dump)
+    if args.chrome:
+        with open(args.chrome, "w") as out:
+            json.dump(chrome(entries), out)
+        print("%d events written to %s" % (len(entries), args.chrome))
+        return
+
+    print("%d boots, %d events" % (boots, len(entries)))
+    for _, time, entry in timeline(entries):
+        print("%12.3f ms  %s" % (time / 1000.0, describe(*entry[1:])))
+
+
+if __name__ == "__main__":
+    main()